@@ -18,6 +18,8 @@
 #include "dbus/message.h"
 #include "util/dispatch.h"
 #include "util/error.h"
+#include "util/metrics.h"
+#include "util/timer.h"
 #include "util/user.h"
 
 static int broker_dispatch_signals(DispatchFile *file) {
@@ -69,6 +71,8 @@ int broker_new(Broker **brokerp, int controller_fd, uint64_t max_bytes, uint64_t
                 return error_fold(r);
 
         broker->bus.pid = ucred.pid;
+        broker->bus.validate_body = main_arg_validate_body;
+        metrics_configure(&broker->bus.metrics, main_arg_metrics_clock, main_arg_metrics_interval);
         r = user_registry_ref_user(&broker->bus.users, &broker->bus.user, ucred.uid);
         if (r)
                 return error_fold(r);
@@ -77,6 +81,17 @@ int broker_new(Broker **brokerp, int controller_fd, uint64_t max_bytes, uint64_t
         if (r)
                 return error_fold(r);
 
+        broker->dispatcher.max_events = main_arg_max_poll_events;
+
+        r = timer_wheel_init(&broker->bus.timers, &broker->dispatcher);
+        if (r)
+                return error_fold(r);
+
+        broker->bus.reply_timeout = main_arg_reply_timeout * 1000ULL * 1000ULL;
+        broker->bus.throttle_high = main_arg_throttle_queue;
+        broker->bus.throttle_low = main_arg_throttle_queue / 2;
+        broker->bus.throttle_timeout = main_arg_throttle_timeout * 1000ULL * 1000ULL;
+
         sigemptyset(&sigmask);
         sigaddset(&sigmask, SIGTERM);
         sigaddset(&sigmask, SIGINT);
@@ -112,8 +127,8 @@ Broker *broker_free(Broker *broker) {
         controller_deinit(&broker->controller);
         dispatch_file_deinit(&broker->signals_file);
         c_close(broker->signals_fd);
-        dispatch_context_deinit(&broker->dispatcher);
         bus_deinit(&broker->bus);
+        dispatch_context_deinit(&broker->dispatcher);
         free(broker);
 
         return NULL;
@@ -8,7 +8,9 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include "broker/broker.h"
 #include "broker/controller.h"
+#include "bus/capture.h"
 #include "bus/policy.h"
 #include "dbus/connection.h"
 #include "dbus/message.h"
@@ -53,6 +55,13 @@ struct ControllerMethod {
                 _body                                   \
         )
 
+static const CDVarType controller_type_in_h[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE1(
+                        C_DVAR_T_h
+                )
+        )
+};
 static const CDVarType controller_type_in_ohsv[] = {
         C_DVAR_T_INIT(
                 C_DVAR_T_TUPLE4(
@@ -157,7 +166,7 @@ static int controller_send_error(Connection *connection, uint32_t serial, const
         if (r)
                 return error_fold(r);
 
-        r = connection_queue(connection, NULL, message);
+        r = connection_queue(connection, NULL, NULL, message);
         if (r) {
                 if (r == CONNECTION_E_QUOTA)
                         connection_close(connection);
@@ -261,6 +270,53 @@ static int controller_method_add_listener(Controller *controller, const char *_p
         return 0;
 }
 
+static int controller_method_start_capture(Controller *controller, const char *_path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        Bus *bus = &controller->broker->bus;
+        Capture *capture;
+        uint32_t fd_index;
+        int r, capture_fd;
+
+        c_dvar_read(in_v, "(h)", &fd_index);
+
+        r = controller_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        capture_fd = fdlist_get(fds, fd_index);
+        if (capture_fd < 0)
+                return CONTROLLER_E_CAPTURE_INVALID_FD;
+
+        /* a new capture replaces any running one, but only once it is set up */
+        r = capture_new(&capture, &controller->broker->dispatcher, capture_fd);
+        if (r)
+                return (r == CAPTURE_E_INVALID_FD) ? CONTROLLER_E_CAPTURE_INVALID_FD : error_fold(r);
+
+        fdlist_steal(fds, fd_index);
+
+        capture_free(bus->capture);
+        bus->capture = capture;
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+}
+
+static int controller_method_stop_capture(Controller *controller, const char *_path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        int r;
+
+        c_dvar_read(in_v, "()");
+
+        r = controller_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        controller->broker->bus.capture = capture_free(controller->broker->bus.capture);
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+}
+
 static int controller_method_listener_release(Controller *controller, const char *path, CDVar *in_v, FDList *fds, CDVar *out_v) {
         ControllerListener *listener;
         int r;
@@ -378,7 +434,7 @@ static int controller_handle_method(const ControllerMethod *method, Controller *
         if (r)
                 return error_fold(r);
 
-        r = connection_queue(&controller->connection, NULL, message_out);
+        r = connection_queue(&controller->connection, NULL, NULL, message_out);
         if (r) {
                 if (r == CONNECTION_E_QUOTA)
                         connection_close(&controller->connection);
@@ -393,6 +449,8 @@ static int controller_dispatch_controller(Controller *controller, uint32_t seria
         static const ControllerMethod methods[] = {
                 { "AddName",            controller_method_add_name,     controller_type_in_osu,         controller_type_out_unit },
                 { "AddListener",        controller_method_add_listener, controller_type_in_ohsv,        controller_type_out_unit },
+                { "StartCapture",       controller_method_start_capture,        controller_type_in_h,   controller_type_out_unit },
+                { "StopCapture",        controller_method_stop_capture, c_dvar_type_unit,       controller_type_out_unit },
         };
 
         for (size_t i = 0; i < C_ARRAY_SIZE(methods); i++) {
@@ -518,6 +576,9 @@ int controller_dbus_dispatch(Controller *controller, Message *message) {
         case CONTROLLER_E_NAME_NOT_FOUND:
                 r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Name.NotFound");
                 break;
+        case CONTROLLER_E_CAPTURE_INVALID_FD:
+                r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Broker.InvalidFD");
+                break;
         default:
                 break;
         }
@@ -557,7 +618,7 @@ int controller_dbus_send_activation(Controller *controller, const char *path) {
         if (r)
                 return error_fold(r);
 
-        r = connection_queue(&controller->connection, NULL, message);
+        r = connection_queue(&controller->connection, NULL, NULL, message);
         if (r)
                 return error_fold(r);
 
@@ -609,7 +670,7 @@ int controller_dbus_send_environment(Controller *controller, const char * const
         if (r)
                 return error_fold(r);
 
-        r = connection_queue(&controller->connection, NULL, message);
+        r = connection_queue(&controller->connection, NULL, NULL, message);
         if (r)
                 return error_fold(r);
 
@@ -45,6 +45,8 @@ enum {
 
         CONTROLLER_E_LISTENER_NOT_FOUND,
         CONTROLLER_E_NAME_NOT_FOUND,
+
+        CONTROLLER_E_CAPTURE_INVALID_FD,
 };
 
 struct ControllerName {
@@ -5,11 +5,14 @@
 #include <c-macro.h>
 #include <getopt.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include "broker/broker.h"
 #include "broker/main.h"
+#include "util/dispatch.h"
 #include "util/error.h"
 #include "util/selinux.h"
 
@@ -18,7 +21,14 @@ uint64_t main_arg_max_bytes = 16 * 1024 * 1024;
 uint64_t main_arg_max_fds = 64;
 uint64_t main_arg_max_matches = 10 * 1024;
 uint64_t main_arg_max_objects = 10 * 1024;
+uint64_t main_arg_max_poll_events = DISPATCH_CONTEXT_EVENTS_MAX;
+uint64_t main_arg_reply_timeout = 0;
+uint64_t main_arg_throttle_queue = 0;
+uint64_t main_arg_throttle_timeout = 10 * 1000;
+clockid_t main_arg_metrics_clock = CLOCK_THREAD_CPUTIME_ID;
+uint64_t main_arg_metrics_interval = 1;
 bool main_arg_verbose = false;
+bool main_arg_validate_body = true;
 
 static void help(void) {
         printf("%s [GLOBALS...] ...\n\n"
@@ -31,6 +41,13 @@ static void help(void) {
                "     --max-fds FDS              The maximum number of file descriptors each user may own in the broker\n"
                "     --max-matches MATCHES      The maximum number of match rules each user may own in the broker\n"
                "     --max-objects OBJECTS      The maximum total number of names, peers, pending replies, etc each user may own in the broker\n"
+               "     --max-poll-events EVENTS   The maximum number of events to fetch from the kernel per wake-up\n"
+               "     --metrics-clock CLOCK      Clock to sample dispatch metrics with: 'cputime' (default) or 'coarse' (cheaper, but only the average is meaningful)\n"
+               "     --metrics-interval N       Only sample dispatch metrics of every Nth message\n"
+               "     --no-validate-body         Only parse message bodies when needed for match rules\n"
+               "     --reply-timeout MSEC       Time out pending method calls after MSEC milliseconds (0 to disable)\n"
+               "     --throttle-queue BYTES     Stop reading from senders while a receiver has more than BYTES queued (0 to disable)\n"
+               "     --throttle-timeout MSEC    Disconnect receivers that keep senders throttled for more than MSEC milliseconds (0 to disable)\n"
                , program_invocation_short_name);
 }
 
@@ -42,6 +59,13 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_MAX_FDS,
                 ARG_MAX_MATCHES,
                 ARG_MAX_OBJECTS,
+                ARG_MAX_POLL_EVENTS,
+                ARG_METRICS_CLOCK,
+                ARG_METRICS_INTERVAL,
+                ARG_NO_VALIDATE_BODY,
+                ARG_REPLY_TIMEOUT,
+                ARG_THROTTLE_QUEUE,
+                ARG_THROTTLE_TIMEOUT,
         };
         static const struct option options[] = {
                 { "help",               no_argument,            NULL,   'h'                     },
@@ -52,6 +76,13 @@ static int parse_argv(int argc, char *argv[]) {
                 { "max-fds",            required_argument,      NULL,   ARG_MAX_FDS             },
                 { "max-matches",        required_argument,      NULL,   ARG_MAX_MATCHES         },
                 { "max-objects",        required_argument,      NULL,   ARG_MAX_OBJECTS         },
+                { "max-poll-events",    required_argument,      NULL,   ARG_MAX_POLL_EVENTS     },
+                { "metrics-clock",      required_argument,      NULL,   ARG_METRICS_CLOCK       },
+                { "metrics-interval",   required_argument,      NULL,   ARG_METRICS_INTERVAL    },
+                { "no-validate-body",   no_argument,            NULL,   ARG_NO_VALIDATE_BODY    },
+                { "reply-timeout",      required_argument,      NULL,   ARG_REPLY_TIMEOUT       },
+                { "throttle-queue",     required_argument,      NULL,   ARG_THROTTLE_QUEUE      },
+                { "throttle-timeout",   required_argument,      NULL,   ARG_THROTTLE_TIMEOUT    },
                 {}
         };
         int r, c;
@@ -145,6 +176,97 @@ static int parse_argv(int argc, char *argv[]) {
                         break;
                 }
 
+                case ARG_MAX_POLL_EVENTS: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || !vul || vul > INT_MAX) {
+                                fprintf(stderr, "%s: invalid max number of poll events -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_max_poll_events = vul;
+                        break;
+                }
+
+                case ARG_METRICS_CLOCK:
+                        if (!strcmp(optarg, "cputime")) {
+                                main_arg_metrics_clock = CLOCK_THREAD_CPUTIME_ID;
+                        } else if (!strcmp(optarg, "coarse")) {
+                                main_arg_metrics_clock = CLOCK_MONOTONIC_COARSE;
+                        } else {
+                                fprintf(stderr, "%s: invalid metrics clock -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        break;
+
+                case ARG_METRICS_INTERVAL: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || !vul || vul > UINT_MAX) {
+                                fprintf(stderr, "%s: invalid metrics interval -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_metrics_interval = vul;
+                        break;
+                }
+
+                case ARG_NO_VALIDATE_BODY:
+                        main_arg_validate_body = false;
+                        break;
+
+                case ARG_REPLY_TIMEOUT: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || vul > UINT32_MAX) {
+                                fprintf(stderr, "%s: invalid reply timeout -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_reply_timeout = vul;
+                        break;
+                }
+
+                case ARG_THROTTLE_QUEUE: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || vul > SIZE_MAX) {
+                                fprintf(stderr, "%s: invalid throttle queue size -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_throttle_queue = vul;
+                        break;
+                }
+
+                case ARG_THROTTLE_TIMEOUT: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || vul > UINT32_MAX) {
+                                fprintf(stderr, "%s: invalid throttle timeout -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_throttle_timeout = vul;
+                        break;
+                }
+
                 case '?':
                         /* getopt_long() prints warning */
                         return MAIN_FAILED;
@@ -213,6 +335,14 @@ int main(int argc, char **argv) {
         if (r)
                 goto exit;
 
+        /*
+         * Peer sockets are always written with MSG_NOSIGNAL, but captures
+         * may be written to pipes, which raise SIGPIPE once their reader is
+         * gone. A dead reader must merely stop the capture, so ignore SIGPIPE
+         * and rely on EPIPE instead.
+         */
+        signal(SIGPIPE, SIG_IGN);
+
         r = run();
 
 exit:
@@ -6,6 +6,7 @@
 
 #include <c-macro.h>
 #include <stdlib.h>
+#include <time.h>
 
 enum {
         _MAIN_SUCCESS,
@@ -15,3 +16,10 @@ enum {
 
 extern int main_arg_controller;
 extern bool main_arg_verbose;
+extern bool main_arg_validate_body;
+extern uint64_t main_arg_max_poll_events;
+extern uint64_t main_arg_reply_timeout;
+extern uint64_t main_arg_throttle_queue;
+extern uint64_t main_arg_throttle_timeout;
+extern clockid_t main_arg_metrics_clock;
+extern uint64_t main_arg_metrics_interval;
@@ -4,6 +4,7 @@
 
 #include <c-list.h>
 #include <c-macro.h>
+#include <c-ref.h>
 #include <stdlib.h>
 #include "broker/controller.h"
 #include "bus/activation.h"
@@ -27,12 +28,71 @@ ActivationRequest *activation_request_free(ActivationRequest *request) {
 
 C_DEFINE_CLEANUP(ActivationRequest *, activation_request_free);
 
+static void activation_sender_free(_Atomic unsigned long *n_refs, void *userdata) {
+        ActivationSender *sender = c_container_of(n_refs, ActivationSender, n_refs);
+
+        name_snapshot_free(sender->names);
+        policy_snapshot_free(sender->policy);
+        free(sender);
+}
+
+static ActivationSender *activation_sender_ref(ActivationSender *sender) {
+        if (sender)
+                c_ref_inc(&sender->n_refs);
+        return sender;
+}
+
+static ActivationSender *activation_sender_unref(ActivationSender *sender) {
+        if (sender)
+                c_ref_dec(&sender->n_refs, activation_sender_free, NULL);
+        return NULL;
+}
+
+C_DEFINE_CLEANUP(ActivationSender *, activation_sender_unref);
+
+static int activation_sender_new(ActivationSender **senderp, uint64_t id, NameOwner *names, PolicySnapshot *policy) {
+        _c_cleanup_(activation_sender_unrefp) ActivationSender *sender = NULL;
+        int r;
+
+        sender = malloc(sizeof(*sender));
+        if (!sender)
+                return error_origin(-ENOMEM);
+
+        *sender = (ActivationSender)ACTIVATION_SENDER_INIT;
+        sender->id = id;
+
+        r = policy_snapshot_dup(policy, &sender->policy);
+        if (r)
+                return error_fold(r);
+
+        r = name_snapshot_new(&sender->names, names);
+        if (r)
+                return error_fold(r);
+
+        *senderp = sender;
+        sender = NULL;
+        return 0;
+}
+
+static bool activation_sender_is_current(ActivationSender *sender, uint64_t id, NameOwner *names) {
+        NameOwnership *ownership;
+        size_t i = 0;
+
+        if (sender->id != id)
+                return false;
+
+        c_rbtree_for_each_entry(ownership, &names->ownership_tree, owner_node)
+                if (i >= sender->names->n_names || sender->names->names[i++] != ownership->name)
+                        return false;
+
+        return i == sender->names->n_names;
+}
+
 ActivationMessage *activation_message_free(ActivationMessage *message) {
         if (!message)
                 return NULL;
 
-        name_snapshot_free(message->senders_names);
-        policy_snapshot_free(message->senders_policy);
+        activation_sender_unref(message->sender);
         message_unref(message->message);
         c_list_unlink_init(&message->link);
         user_charge_deinit(&message->charges[1]);
@@ -59,6 +119,7 @@ int activation_init(Activation *a, Name *name, User *user) {
         activation->user = user_ref(user);
 
         name->activation = activation;
+        ++name->registry->generation;
         activation = NULL;
         return 0;
 }
@@ -76,6 +137,7 @@ void activation_deinit(Activation *activation) {
 
         if (activation->name) {
                 activation->name->activation = NULL;
+                ++activation->name->registry->generation;
                 activation->name = name_unref(activation->name);
         }
 }
@@ -115,6 +177,7 @@ int activation_queue_message(Activation *activation,
                              PolicySnapshot *policy,
                              Message *m) {
         _c_cleanup_(activation_message_freep) ActivationMessage *message = NULL;
+        ActivationMessage *last;
         int r;
 
         r = activation_request(activation);
@@ -138,13 +201,22 @@ int activation_queue_message(Activation *activation,
         if (r)
                 return (r == USER_E_QUOTA) ? ACTIVATION_E_QUOTA : error_fold(r);
 
-        r = policy_snapshot_dup(policy, &message->senders_policy);
-        if (r)
-                return error_fold(r);
-
-        r = name_snapshot_new(&message->senders_names, names);
-        if (r)
-                return error_fold(r);
+        /*
+         * While a service starts up, its clients usually queue bursts of
+         * messages. Rather than snapshotting the sender for each of them,
+         * share the snapshot of the previously queued message if it came from
+         * the same peer, and that peer still owns the same names. A peer
+         * keeps its policy for its entire lifetime, so the unique ID suffices
+         * to identify it.
+         */
+        last = c_list_last_entry(&activation->activation_messages, ActivationMessage, link);
+        if (last && activation_sender_is_current(last->sender, m->sender_id, names)) {
+                message->sender = activation_sender_ref(last->sender);
+        } else {
+                r = activation_sender_new(&message->sender, m->sender_id, names, policy);
+                if (r)
+                        return error_trace(r);
+        }
 
         c_list_link_tail(&activation->activation_messages, &message->link);
         message = NULL;
@@ -6,6 +6,7 @@
 
 #include <c-list.h>
 #include <c-macro.h>
+#include <c-ref.h>
 #include <stdlib.h>
 #include "bus/policy.h"
 #include "util/user.h"
@@ -13,6 +14,7 @@
 typedef struct Activation Activation;
 typedef struct ActivationMessage ActivationMessage;
 typedef struct ActivationRequest ActivationRequest;
+typedef struct ActivationSender ActivationSender;
 typedef struct Message Message;
 typedef struct Name Name;
 typedef struct NameOwner NameOwner;
@@ -33,13 +35,23 @@ struct ActivationRequest {
         CList link;
 };
 
+struct ActivationSender {
+        _Atomic unsigned long n_refs;
+        uint64_t id;
+        PolicySnapshot *policy;
+        NameSnapshot *names;
+};
+
+#define ACTIVATION_SENDER_INIT {                                                \
+                .n_refs = C_REF_INIT,                                           \
+        }
+
 struct ActivationMessage {
         User *user;
         UserCharge charges[2];
         CList link;
         Message *message;
-        PolicySnapshot *senders_policy;
-        NameSnapshot *senders_names;
+        ActivationSender *sender;
 };
 
 struct Activation {
@@ -3,9 +3,12 @@
  */
 
 #include <c-macro.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/auxv.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include "bus/bus.h"
 #include "bus/driver.h"
 #include "bus/match.h"
@@ -14,6 +17,33 @@
 #include "util/error.h"
 #include "util/user.h"
 
+static int bus_get_random(void *p, size_t n) {
+        ssize_t l;
+        int fd;
+
+        l = getrandom(p, n, GRND_NONBLOCK);
+        if (l == (ssize_t)n)
+                return 0;
+
+        /*
+         * Early during boot the entropy pool might not be initialized, yet.
+         * We only need our seeds to be unpredictable to remote peers, so fall
+         * back to /dev/urandom, which never blocks.
+         */
+        fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0)
+                return error_origin(-errno);
+
+        l = read(fd, p, n);
+        close(fd);
+        if (l < 0)
+                return error_origin(-errno);
+        else if (l != (ssize_t)n)
+                return error_origin(-EIO);
+
+        return 0;
+}
+
 int bus_init(Bus *bus,
              unsigned int max_bytes,
              unsigned int max_fds,
@@ -29,6 +59,18 @@ int bus_init(Bus *bus,
         assert(random);
         memcpy(bus->guid, random, sizeof(bus->guid));
 
+        /*
+         * The guid is public, so it must not be used as hash-seed. Fetch
+         * separate random bytes for the name registry.
+         */
+        r = bus_get_random(bus->names.seed, sizeof(bus->names.seed));
+        if (r)
+                return error_trace(r);
+
+        /* the member index of match registries shares the seed */
+        bus->wildcard_matches.seed = bus->names.seed;
+        bus->driver_matches.seed = bus->names.seed;
+
         static_assert(_USER_SLOT_N == C_ARRAY_SIZE(maxima),
                       "User accounting slot mismatch");
 
@@ -40,11 +82,23 @@ int bus_init(Bus *bus,
 }
 
 void bus_deinit(Bus *bus) {
+        size_t i;
+
         bus->pid = 0;
         bus->user = user_unref(bus->user);
+        for (i = 0; i < C_ARRAY_SIZE(bus->latency); ++i)
+                metrics_histogram_deinit(&bus->latency[i]);
+        for (i = 0; i < C_ARRAY_SIZE(bus->queue_metrics); ++i)
+                metrics_deinit(&bus->queue_metrics[i]);
         metrics_deinit(&bus->metrics);
+        bus->capture = capture_free(bus->capture);
+        free(bus->list_activatable_names.body);
+        free(bus->list_names.body);
+        bus->list_activatable_names = (BusNameList){};
+        bus->list_names = (BusNameList){};
         peer_registry_deinit(&bus->peers);
         user_registry_deinit(&bus->users);
+        timer_wheel_deinit(&bus->timers);
         name_registry_deinit(&bus->names);
         match_registry_deinit(&bus->driver_matches);
         match_registry_deinit(&bus->wildcard_matches);
@@ -7,11 +7,13 @@
 #include <c-macro.h>
 #include <c-rbtree.h>
 #include <stdlib.h>
+#include "bus/capture.h"
 #include "bus/listener.h"
 #include "bus/match.h"
 #include "bus/name.h"
 #include "bus/peer.h"
 #include "util/metrics.h"
+#include "util/timer.h"
 #include "util/user.h"
 
 enum {
@@ -20,10 +22,33 @@ enum {
         BUS_E_FAILURE,
 };
 
+enum {
+        BUS_LATENCY_DRIVER,
+        BUS_LATENCY_UNICAST,
+        BUS_LATENCY_BROADCAST,
+        BUS_LATENCY_MONITOR,
+        _BUS_LATENCY_N,
+};
+
+enum {
+        BUS_QUEUE_BYTES,
+        BUS_QUEUE_BUFFERS,
+        BUS_QUEUE_FDS,
+        _BUS_QUEUE_N,
+};
+
 typedef struct Bus Bus;
+typedef struct BusNameList BusNameList;
 typedef struct Message Message;
 typedef struct User User;
 
+struct BusNameList {
+        uint64_t names_generation;
+        uint64_t peers_generation;
+        void *body;
+        size_t n_body;
+};
+
 struct Bus {
         User *user;
         pid_t pid;
@@ -37,8 +62,26 @@ struct Bus {
 
         uint64_t transaction_ids;
         uint64_t listener_ids;
+        size_t n_monitors;
+
+        bool validate_body;
+        uint64_t reply_timeout;
+        size_t throttle_high;
+        size_t throttle_low;
+        uint64_t throttle_timeout;
+
+        BusNameList list_names;
+        BusNameList list_activatable_names;
+
+        /* pre-marshalled NameOwnerChanged header, see driver.c */
+        alignas(uint64_t) uint8_t name_owner_changed[256];
+        size_t n_name_owner_changed;
 
+        Capture *capture;
+        TimerWheel timers;
         Metrics metrics;
+        Metrics queue_metrics[_BUS_QUEUE_N];
+        MetricsHistogram latency[_BUS_LATENCY_N];
 };
 
 #define BUS_NULL(_x) {                                                          \
@@ -47,7 +90,20 @@ struct Bus {
                 .wildcard_matches = MATCH_REGISTRY_INIT((_x).wildcard_matches), \
                 .driver_matches = MATCH_REGISTRY_INIT((_x).driver_matches),     \
                 .peers = PEER_REGISTRY_INIT,                                    \
+                .validate_body = true,                                          \
+                .timers = TIMER_WHEEL_NULL((_x).timers),                        \
                 .metrics = METRICS_INIT,                                        \
+                .queue_metrics = {                                              \
+                        [BUS_QUEUE_BYTES] = METRICS_INIT,                       \
+                        [BUS_QUEUE_BUFFERS] = METRICS_INIT,                     \
+                        [BUS_QUEUE_FDS] = METRICS_INIT,                         \
+                },                                                              \
+                .latency = {                                                    \
+                        [BUS_LATENCY_DRIVER] = METRICS_HISTOGRAM_INIT,          \
+                        [BUS_LATENCY_UNICAST] = METRICS_HISTOGRAM_INIT,         \
+                        [BUS_LATENCY_BROADCAST] = METRICS_HISTOGRAM_INIT,       \
+                        [BUS_LATENCY_MONITOR] = METRICS_HISTOGRAM_INIT,         \
+                },                                                              \
         }
 
 int bus_init(Bus *bus,
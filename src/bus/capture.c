@@ -0,0 +1,350 @@
+/*
+ * Traffic Capture
+ *
+ * A capture writes every message dispatched on the bus to a file-descriptor
+ * in the pcap file format, using the DBUS link-type. Each record carries the
+ * wire-format of the message as it is forwarded to its receivers, including
+ * the sender field stitched in by the broker. This is much cheaper than a
+ * monitor connection, since messages are written straight from their
+ * io-vectors rather than being queued, accounted and forwarded on a socket.
+ *
+ * Only pipes and sockets are supported, as the broker must never block on
+ * disk I/O. They are put into non-blocking mode, and if they cannot keep up,
+ * the remaining data is buffered and flushed once the file-descriptor becomes
+ * writable again. That buffer is bounded, and messages that do not fit, or
+ * cannot be buffered for lack of memory, are dropped and counted. Write
+ * errors silently stop the capture, as capturing must never interfere with
+ * the bus itself. Note that SIGPIPE is ignored by the broker, so writing to a
+ * pipe without readers merely fails with EPIPE.
+ */
+
+#include <c-macro.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "bus/capture.h"
+#include "dbus/message.h"
+#include "util/dispatch.h"
+#include "util/error.h"
+
+#define CAPTURE_PCAP_MAGIC (0xa1b2c3d4U)
+#define CAPTURE_PCAP_LINKTYPE_DBUS (231U)
+
+typedef struct CapturePcapHeader CapturePcapHeader;
+typedef struct CapturePcapRecord CapturePcapRecord;
+
+struct CapturePcapHeader {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t network;
+};
+
+struct CapturePcapRecord {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t incl_len;
+        uint32_t orig_len;
+};
+
+static ssize_t capture_writev(Capture *capture, struct iovec *vecs, size_t n_vecs) {
+        if (capture->socket)
+                return sendmsg(capture->fd,
+                               &(struct msghdr){ .msg_iov = vecs, .msg_iovlen = n_vecs },
+                               MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        return writev(capture->fd, vecs, n_vecs);
+}
+
+static int capture_append(Capture *capture, struct iovec *vecs, size_t n_vecs, size_t n_skip) {
+        size_t i, n, n_total = 0;
+        void *p;
+
+        for (i = 0; i < n_vecs; ++i)
+                n_total += vecs[i].iov_len;
+
+        assert(n_skip < n_total);
+        n_total -= n_skip;
+
+        if (n_total > capture->n_allocated - capture->n_buffer) {
+                n = c_max(capture->n_buffer + n_total, capture->n_allocated * 2);
+
+                p = realloc(capture->buffer, n);
+                if (!p)
+                        return error_origin(-ENOMEM);
+
+                capture->buffer = p;
+                capture->n_allocated = n;
+        }
+
+        for (i = 0; i < n_vecs; ++i) {
+                if (n_skip >= vecs[i].iov_len) {
+                        n_skip -= vecs[i].iov_len;
+                        continue;
+                }
+
+                n = vecs[i].iov_len - n_skip;
+                memcpy(capture->buffer + capture->n_buffer, (char *)vecs[i].iov_base + n_skip, n);
+                capture->n_buffer += n;
+                n_skip = 0;
+        }
+
+        return 0;
+}
+
+static void capture_flush(Capture *capture) {
+        size_t i = 0;
+        ssize_t l;
+
+        while (i < capture->n_buffer) {
+                l = capture_writev(capture, &(struct iovec){ capture->buffer + i, capture->n_buffer - i }, 1);
+                if (l < 0) {
+                        if (errno == EAGAIN) {
+                                dispatch_file_clear(&capture->file, EPOLLOUT);
+                                break;
+                        }
+
+                        capture_deinit(capture);
+                        return;
+                }
+
+                i += l;
+        }
+
+        memmove(capture->buffer, capture->buffer + i, capture->n_buffer - i);
+        capture->n_buffer -= i;
+
+        if (!capture->n_buffer)
+                dispatch_file_deselect(&capture->file, EPOLLOUT);
+}
+
+static void capture_queue(Capture *capture, struct iovec *vecs, size_t n_vecs, size_t n_total) {
+        size_t n_written = 0;
+        ssize_t l;
+        int r;
+
+        if (!capture->n_buffer) {
+                l = capture_writev(capture, vecs, n_vecs);
+                if (l < 0) {
+                        if (errno != EAGAIN) {
+                                capture_deinit(capture);
+                                return;
+                        }
+
+                        dispatch_file_clear(&capture->file, EPOLLOUT);
+                        l = 0;
+                }
+
+                n_written = l;
+                if (n_written == n_total)
+                        return;
+        }
+
+        /*
+         * A partially written record must be completed, or the stream would
+         * be corrupted. Hence, only records that were not started can be
+         * dropped. If the remainder of a started record cannot be buffered,
+         * the capture is stopped instead.
+         */
+        if (!n_written && capture->n_buffer + n_total > CAPTURE_BUFFER_MAX) {
+                ++capture->n_dropped;
+                return;
+        }
+
+        r = capture_append(capture, vecs, n_vecs, n_written);
+        if (r) {
+                if (n_written)
+                        capture_deinit(capture);
+                else
+                        ++capture->n_dropped;
+                return;
+        }
+
+        dispatch_file_select(&capture->file, EPOLLOUT);
+}
+
+static int capture_dispatch(DispatchFile *file) {
+        Capture *capture = c_container_of(file, Capture, file);
+
+        if (!(dispatch_file_events(file) & EPOLLOUT))
+                return 0;
+
+        capture_flush(capture);
+        return 0;
+}
+
+/**
+ * capture_init() - initialize capture
+ * @c:                  capture to operate on
+ * @dispatcher:         dispatch context to use
+ * @fd:                 file-descriptor to write to
+ *
+ * This initializes a new capture, writing to @fd. The pcap file header is
+ * queued right away. The file-descriptor @fd must be a pipe or a socket, and
+ * it must be open for writing. Regular files are rejected, since writes to
+ * them would block the broker. On success, @fd is owned by the capture.
+ *
+ * Return: 0 on success, CAPTURE_E_INVALID_FD if @fd cannot be used, negative
+ *         error code on failure.
+ */
+int capture_init(Capture *c, DispatchContext *dispatcher, int fd) {
+        _c_cleanup_(capture_deinitp) Capture *capture = c;
+        CapturePcapHeader header = {
+                .magic = CAPTURE_PCAP_MAGIC,
+                .version_major = 2,
+                .version_minor = 4,
+                .snaplen = MESSAGE_SIZE_MAX,
+                .network = CAPTURE_PCAP_LINKTYPE_DBUS,
+        };
+        struct stat st;
+        int r, flags;
+
+        *capture = (Capture)CAPTURE_NULL(*capture);
+
+        r = fstat(fd, &st);
+        if (r < 0)
+                return (errno == EBADF) ? CAPTURE_E_INVALID_FD : error_origin(-errno);
+
+        flags = fcntl(fd, F_GETFL);
+        if (flags < 0)
+                return error_origin(-errno);
+        if ((flags & O_ACCMODE) == O_RDONLY)
+                return CAPTURE_E_INVALID_FD;
+
+        if (!S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode))
+                return CAPTURE_E_INVALID_FD;
+
+        r = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        if (r < 0)
+                return error_origin(-errno);
+
+        r = dispatch_file_init(&capture->file,
+                               dispatcher,
+                               capture_dispatch,
+                               fd,
+                               EPOLLOUT,
+                               EPOLLOUT);
+        if (r)
+                return error_fold(r);
+
+        capture->socket = S_ISSOCK(st.st_mode);
+
+        r = capture_append(capture, &(struct iovec){ &header, sizeof(header) }, 1, 0);
+        if (r)
+                return error_trace(r);
+
+        capture->fd = fd;
+        dispatch_file_select(&capture->file, EPOLLOUT);
+
+        capture = NULL;
+        return 0;
+}
+
+/**
+ * capture_deinit() - deinitialize capture
+ * @capture:            capture to operate on
+ *
+ * This stops the capture, closes its file-descriptor and discards any data
+ * that was not written, yet. It is safe to call this multiple times.
+ */
+void capture_deinit(Capture *capture) {
+        dispatch_file_deinit(&capture->file);
+        c_close(capture->fd);
+        free(capture->buffer);
+        *capture = (Capture)CAPTURE_NULL(*capture);
+}
+
+/**
+ * capture_new() - create new capture
+ * @capturep:           output argument for new capture
+ * @dispatcher:         dispatch context to use
+ * @fd:                 file-descriptor to write to
+ *
+ * This allocates a new capture and initializes it via capture_init(). This
+ * allows setting up a capture before replacing a running one.
+ *
+ * Return: 0 on success, CAPTURE_E_INVALID_FD if @fd cannot be used, negative
+ *         error code on failure.
+ */
+int capture_new(Capture **capturep, DispatchContext *dispatcher, int fd) {
+        Capture *capture;
+        int r;
+
+        capture = malloc(sizeof(*capture));
+        if (!capture)
+                return error_origin(-ENOMEM);
+
+        r = capture_init(capture, dispatcher, fd);
+        if (r) {
+                free(capture);
+                return error_trace(r);
+        }
+
+        *capturep = capture;
+        return 0;
+}
+
+/**
+ * capture_free() - destroy capture
+ * @capture:            capture to operate on, or NULL
+ *
+ * This deinitializes and frees a capture created via capture_new().
+ *
+ * Return: NULL is returned.
+ */
+Capture *capture_free(Capture *capture) {
+        if (!capture)
+                return NULL;
+
+        capture_deinit(capture);
+        free(capture);
+
+        return NULL;
+}
+
+/**
+ * capture_message() - write message to capture
+ * @capture:            capture to operate on
+ * @message:            message to write
+ *
+ * This writes a pcap record for @message to the capture, using the current
+ * wall-clock time as timestamp. If the capture is not running, this is a
+ * no-op. Failures never propagate to the caller; the message is dropped, or
+ * the capture is stopped.
+ */
+void capture_message(Capture *capture, Message *message) {
+        struct iovec vecs[1 + C_ARRAY_SIZE(message->vecs)];
+        CapturePcapRecord record;
+        struct timespec ts;
+        size_t i, n_data = 0;
+
+        if (!capture_is_running(capture))
+                return;
+
+        for (i = 0; i < C_ARRAY_SIZE(message->vecs); ++i) {
+                vecs[1 + i] = message->vecs[i];
+                n_data += message->vecs[i].iov_len;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        record = (CapturePcapRecord){
+                .ts_sec = ts.tv_sec,
+                .ts_usec = ts.tv_nsec / 1000,
+                .incl_len = n_data,
+                .orig_len = n_data,
+        };
+        vecs[0] = (struct iovec){ &record, sizeof(record) };
+
+        ++capture->n_captured;
+
+        capture_queue(capture, vecs, C_ARRAY_SIZE(vecs), sizeof(record) + n_data);
+}
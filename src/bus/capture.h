@@ -0,0 +1,57 @@
+#pragma once
+
+/*
+ * Traffic Capture
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include "util/dispatch.h"
+
+typedef struct Capture Capture;
+typedef struct DispatchContext DispatchContext;
+typedef struct Message Message;
+
+#define CAPTURE_BUFFER_MAX (16UL * 1024UL * 1024UL) /* randomly picked, no tuning done so far */
+
+enum {
+        _CAPTURE_E_SUCCESS,
+
+        CAPTURE_E_INVALID_FD,
+};
+
+struct Capture {
+        int fd;
+        DispatchFile file;
+        bool socket : 1;
+
+        char *buffer;
+        size_t n_buffer;
+        size_t n_allocated;
+
+        uint64_t n_captured;
+        uint64_t n_dropped;
+};
+
+#define CAPTURE_NULL(_x) {                                              \
+                .fd = -1,                                               \
+                .file = DISPATCH_FILE_NULL((_x).file),                  \
+        }
+
+int capture_init(Capture *capture, DispatchContext *dispatcher, int fd);
+void capture_deinit(Capture *capture);
+
+int capture_new(Capture **capturep, DispatchContext *dispatcher, int fd);
+Capture *capture_free(Capture *capture);
+
+void capture_message(Capture *capture, Message *message);
+
+C_DEFINE_CLEANUP(Capture *, capture_deinit);
+C_DEFINE_CLEANUP(Capture *, capture_free);
+
+/* inline helpers */
+
+static inline bool capture_is_running(Capture *capture) {
+        return capture->fd >= 0;
+}
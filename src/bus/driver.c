@@ -20,6 +20,7 @@
 #include "dbus/socket.h"
 #include "util/error.h"
 #include "util/selinux.h"
+#include "util/timer.h"
 
 typedef struct DriverMethod DriverMethod;
 typedef int (*DriverMethodFn) (Peer *peer, CDVar *var_in, uint32_t serial, CDVar *var_out);
@@ -175,7 +176,7 @@ static void driver_write_bytes(CDVar *var, char *bytes, size_t n_bytes) {
 }
 
 static void driver_dvar_write_unique_name(CDVar *var, Peer *peer) {
-        c_dvar_write(var, "s", address_to_string(&(Address)ADDRESS_INIT_ID(peer->id)));
+        c_dvar_write(var, "s", message_sender_get_name(&peer->sender));
 }
 
 static void driver_dvar_write_signature_out(CDVar *var, const CDVarType *type) {
@@ -293,8 +294,11 @@ static const char *driver_error_to_string(int r) {
 static int driver_send_unicast(Peer *receiver, Message *message) {
         int r;
 
+        /* messages of the driver enter the broker in the current round */
+        connection_stamp(&receiver->connection, message);
+
         /* XXX: handle quota */
-        r = connection_queue(&receiver->connection, NULL, message);
+        r = connection_queue(&receiver->connection, NULL, &receiver->bus->latency[BUS_LATENCY_DRIVER], message);
         if (r)
                 return error_fold(r);
 
@@ -381,6 +385,50 @@ static int driver_send_reply(Peer *peer, CDVar *var, uint32_t serial) {
         return 0;
 }
 
+static int driver_send_reply_with_body(Peer *peer, CDVar *var, uint32_t serial, const void *body, size_t n_body) {
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        size_t n_data, n_prefix;
+        void *data, *p;
+        int r;
+
+        /*
+         * This is like driver_send_reply(), but the caller wrote an empty
+         * array as body, which we replace by the pre-marshalled @body. The
+         * body is always 8-byte aligned, so this produces the same message as
+         * marshalling the body in place would have.
+         */
+
+        if (!serial)
+                return 0;
+
+        c_dvar_write(var, ")");
+
+        r = c_dvar_end_write(var, &data, &n_data);
+        if (r)
+                return error_origin(r);
+
+        n_prefix = c_align8(sizeof(MessageHeader) + ((MessageHeader *)data)->n_fields);
+        assert(n_data == n_prefix + sizeof(uint32_t));
+
+        p = realloc(data, n_prefix + n_body);
+        if (!p) {
+                free(data);
+                return error_origin(-ENOMEM);
+        }
+
+        memcpy(p + n_prefix, body, n_body);
+
+        r = message_new_outgoing(&message, p, n_prefix + n_body);
+        if (r)
+                return error_fold(r);
+
+        r = driver_send_unicast(peer, message);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
 static int driver_notify_name_acquired(Peer *peer, const char *name) {
         static const CDVarType type[] = {
                 C_DVAR_T_INIT(
@@ -466,6 +514,7 @@ static int driver_notify_name_owner_changed(Bus *bus, const char *name, const ch
                 .argpaths[1] = old_owner,
                 .args[2] = new_owner,
                 .argpaths[2] = new_owner,
+                .args_mask = 0x7,
         };
         static const CDVarType type[] = {
                 C_DVAR_T_INIT(
@@ -478,24 +527,62 @@ static int driver_notify_name_owner_changed(Bus *bus, const char *name, const ch
                         )
                 )
         };
-        _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
         _c_cleanup_(message_unrefp) Message *message = NULL;
-        void *data;
         size_t n_data;
+        void *data;
         int r;
 
-        c_dvar_begin_write(&var, type, 1);
-        c_dvar_write(&var, "(");
-        driver_write_signal_header(&var, NULL, "NameOwnerChanged", "sss");
-        c_dvar_write(&var, "(sss)", name, old_owner, new_owner);
-        c_dvar_write(&var, ")");
-        r = c_dvar_end_write(&var, &data, &n_data);
-        if (r)
-                return error_origin(r);
+        /*
+         * NameOwnerChanged is broadcast by the driver only, so only wildcard
+         * and driver matches can ever select it. If there are none, there is
+         * no need to build the message at all.
+         */
+        if (!bus->wildcard_matches.n_rules && !bus->driver_matches.n_rules)
+                return 0;
+
+        /*
+         * The header of NameOwnerChanged is constant, as it has no
+         * destination. Marshal it once as template, and then only append the
+         * body for each name change. This keeps c-dvar off the path that is
+         * hit for every name of every disconnecting peer.
+         */
+        if (!bus->n_name_owner_changed) {
+                _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
+
+                c_dvar_begin_write(&var, type, 1);
+                c_dvar_write(&var, "(");
+                driver_write_signal_header(&var, NULL, "NameOwnerChanged", "sss");
+                c_dvar_write(&var, "(sss))", "", "", "");
+                r = c_dvar_end_write(&var, &data, &n_data);
+                if (r)
+                        return error_origin(r);
+
+                n_data = c_align8(sizeof(MessageHeader) + ((MessageHeader *)data)->n_fields);
+                assert(n_data <= sizeof(bus->name_owner_changed));
+
+                memcpy(bus->name_owner_changed, data, n_data);
+                bus->n_name_owner_changed = n_data;
+                free(data);
+        }
+
+        n_data = message_marshal_string(NULL, bus->n_name_owner_changed, name);
+        n_data = message_marshal_string(NULL, n_data, old_owner);
+        n_data = message_marshal_string(NULL, n_data, new_owner);
+
+        data = malloc(n_data);
+        if (!data)
+                return error_origin(-ENOMEM);
+
+        memcpy(data, bus->name_owner_changed, bus->n_name_owner_changed);
+        n_data = message_marshal_string(data, bus->n_name_owner_changed, name);
+        n_data = message_marshal_string(data, n_data, old_owner);
+        n_data = message_marshal_string(data, n_data, new_owner);
 
         r = message_new_outgoing(&message, data, n_data);
-        if (r)
+        if (r) {
+                free(data);
                 return error_fold(r);
+        }
 
         r = peer_broadcast(NULL, NULL, NULL, ADDRESS_ID_INVALID, NULL, bus, &filter, message);
         if (r)
@@ -511,8 +598,8 @@ static int driver_name_owner_changed(Bus *bus, const char *name, Peer *old_owner
         assert(old_owner || new_owner);
         assert(name || !old_owner || !new_owner);
 
-        old_owner_str = old_owner ? address_to_string(&(Address)ADDRESS_INIT_ID(old_owner->id)) : "";
-        new_owner_str = new_owner ? address_to_string(&(Address)ADDRESS_INIT_ID(new_owner->id)) : "";
+        old_owner_str = old_owner ? message_sender_get_name(&old_owner->sender) : "";
+        new_owner_str = new_owner ? message_sender_get_name(&new_owner->sender) : "";
         name = name ?: (old_owner ? old_owner_str : new_owner_str);
 
         if (old_owner) {
@@ -566,13 +653,13 @@ static int driver_name_activated(Activation *activation, Peer *receiver) {
         }
 
         c_list_for_each_entry_safe(message, message_safe, &activation->activation_messages, link) {
-                NameSet sender_names = NAME_SET_INIT_FROM_SNAPSHOT(message->senders_names);
+                NameSet sender_names = NAME_SET_INIT_FROM_SNAPSHOT(message->sender->names);
                 Peer *sender;
 
                 sender = peer_registry_find_peer(&receiver->bus->peers, message->message->sender_id);
 
                 /* XXX: deal with sender matches on the unique name */
-                r = peer_queue_call(message->senders_policy, &sender_names, NULL, sender ? &sender->owned_replies : NULL, message->user, message->message->sender_id, receiver, message->message);
+                r = peer_queue_call(message->sender->policy, &sender_names, NULL, sender ? &sender->owned_replies : NULL, message->user, message->message->sender_id, receiver, message->message);
                 if (r) {
                         switch (r) {
                         case PEER_E_QUOTA:
@@ -638,7 +725,7 @@ static int driver_method_hello(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *
                 return error_trace(r);
 
         peer_register(peer);
-        unique_name = address_to_string(&(Address)ADDRESS_INIT_ID(peer->id));
+        unique_name = message_sender_get_name(&peer->sender);
 
         c_dvar_write(out_v, "(s)", unique_name);
 
@@ -799,34 +886,85 @@ static int driver_method_list_queued_owners(Peer *peer, CDVar *in_v, uint32_t se
         return 0;
 }
 
-static int driver_method_list_names(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+static int driver_update_name_list(Bus *bus, BusNameList *list, bool activatable) {
+        static const CDVarType type[] = {
+                C_DVAR_T_INIT(
+                        C_DVAR_T_ARRAY(
+                                C_DVAR_T_s
+                        )
+                )
+        };
+        _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
         Peer *p;
         Name *name;
+        void *data;
+        size_t n_data;
         int r;
 
-        c_dvar_read(in_v, "()");
+        /*
+         * The body of ListNames() and ListActivatableNames() replies is the
+         * same for all callers. We keep it pre-marshalled and only rebuild it
+         * once the name registry or the set of registered peers changed.
+         * The activatable names do not depend on the peers.
+         */
 
-        r = driver_end_read(in_v);
-        if (r)
-                return error_trace(r);
+        if (list->body &&
+            list->names_generation == bus->names.generation &&
+            (activatable || list->peers_generation == bus->peers.generation))
+                return 0;
 
-        c_dvar_write(out_v, "([");
-        c_dvar_write(out_v, "s", "org.freedesktop.DBus");
-        c_rbtree_for_each_entry(p, &peer->bus->peers.peer_tree, registry_node) {
-                if (!peer_is_registered(p))
-                        continue;
+        c_dvar_begin_write(&var, type, 1);
+        c_dvar_write(&var, "[");
+        c_dvar_write(&var, "s", "org.freedesktop.DBus");
+
+        if (!activatable) {
+                c_rbtree_for_each_entry(p, &bus->peers.peer_tree, registry_node) {
+                        if (!peer_is_registered(p))
+                                continue;
 
-                driver_dvar_write_unique_name(out_v, p);
+                        driver_dvar_write_unique_name(&var, p);
+                }
         }
-        c_rbtree_for_each_entry(name, &peer->bus->names.name_tree, registry_node) {
-                if (!name_primary(name))
+
+        c_rbtree_for_each_entry(name, &bus->names.name_tree, registry_node) {
+                if (activatable ? !name->activation : !name_primary(name))
                         continue;
 
-                c_dvar_write(out_v, "s", name->name);
+                c_dvar_write(&var, "s", name->name);
         }
-        c_dvar_write(out_v, "])");
 
-        r = driver_send_reply(peer, out_v, serial);
+        c_dvar_write(&var, "]");
+
+        r = c_dvar_end_write(&var, &data, &n_data);
+        if (r)
+                return error_origin(r);
+
+        free(list->body);
+        list->body = data;
+        list->n_body = n_data;
+        list->names_generation = bus->names.generation;
+        list->peers_generation = bus->peers.generation;
+
+        return 0;
+}
+
+static int driver_method_list_names(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        BusNameList *list = &peer->bus->list_names;
+        int r;
+
+        c_dvar_read(in_v, "()");
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        r = driver_update_name_list(peer->bus, list, false);
+        if (r)
+                return error_trace(r);
+
+        c_dvar_write(out_v, "([])");
+
+        r = driver_send_reply_with_body(peer, out_v, serial, list->body, list->n_body);
         if (r)
                 return error_trace(r);
 
@@ -834,7 +972,7 @@ static int driver_method_list_names(Peer *peer, CDVar *in_v, uint32_t serial, CD
 }
 
 static int driver_method_list_activatable_names(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
-        Name *name;
+        BusNameList *list = &peer->bus->list_activatable_names;
         int r;
 
         c_dvar_read(in_v, "()");
@@ -843,17 +981,13 @@ static int driver_method_list_activatable_names(Peer *peer, CDVar *in_v, uint32_
         if (r)
                 return error_trace(r);
 
-        c_dvar_write(out_v, "([");
-        c_dvar_write(out_v, "s", "org.freedesktop.DBus");
-        c_rbtree_for_each_entry(name, &peer->bus->names.name_tree, registry_node) {
-                if (!name->activation)
-                        continue;
+        r = driver_update_name_list(peer->bus, list, true);
+        if (r)
+                return error_trace(r);
 
-                c_dvar_write(out_v, "s", name->name);
-        }
-        c_dvar_write(out_v, "])");
+        c_dvar_write(out_v, "([])");
 
-        r = driver_send_reply(peer, out_v, serial);
+        r = driver_send_reply_with_body(peer, out_v, serial, list->body, list->n_body);
         if (r)
                 return error_trace(r);
 
@@ -968,7 +1102,6 @@ static int driver_method_update_activation_environment(Peer *peer, CDVar *in_v,
 
 static int driver_method_get_name_owner(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
         const char *name_str, *owner_str;
-        Address addr;
         int r;
 
         c_dvar_read(in_v, "(s)", &name_str);
@@ -978,7 +1111,7 @@ static int driver_method_get_name_owner(Peer *peer, CDVar *in_v, uint32_t serial
                 return error_trace(r);
 
         if (!strcmp(name_str, "org.freedesktop.DBus")) {
-                addr = (Address)ADDRESS_INIT_NAME("org.freedesktop.DBus");
+                owner_str = "org.freedesktop.DBus";
         } else {
                 Peer *owner;
 
@@ -986,11 +1119,9 @@ static int driver_method_get_name_owner(Peer *peer, CDVar *in_v, uint32_t serial
                 if (!owner)
                         return DRIVER_E_NAME_OWNER_NOT_FOUND;
 
-                addr = (Address)ADDRESS_INIT_ID(owner->id);
+                owner_str = message_sender_get_name(&owner->sender);
         }
 
-        owner_str = address_to_string(&addr);
-
         c_dvar_write(out_v, "(s)", owner_str);
 
         r = driver_send_reply(peer, out_v, serial);
@@ -1543,7 +1674,6 @@ static int driver_dispatch_interface(Peer *peer, uint32_t serial, const char *in
 
 int driver_goodbye(Peer *peer, bool silent) {
         ReplySlot *reply, *reply_safe;
-        MatchRule *rule, *rule_safe;
         NameOwnership *ownership, *ownership_safe;
         int r;
 
@@ -1552,8 +1682,7 @@ int driver_goodbye(Peer *peer, bool silent) {
         c_list_for_each_entry_safe(reply, reply_safe, &peer->owned_replies.reply_list, owner_link)
                 reply_slot_free(reply);
 
-        c_list_for_each_entry_safe(rule, rule_safe, &peer->matches.rule_list, registry_link)
-                match_rule_unlink(rule);
+        match_registry_flush(&peer->matches);
 
         c_rbtree_for_each_entry_unlink(ownership, ownership_safe, &peer->owned_names.ownership_tree, owner_node) {
                 NameChange change;
@@ -1596,13 +1725,79 @@ int driver_goodbye(Peer *peer, bool silent) {
         return 0;
 }
 
+/**
+ * driver_reply_timeout() - expire a pending reply
+ * @timer:              timeout of the reply slot
+ *
+ * This is called when the callee did not reply to a method call in time. It
+ * drops the reply slot, so a late reply is treated as unexpected, and sends
+ * a NoReply error to the caller on behalf of the callee.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int driver_reply_timeout(Timer *timer) {
+        ReplySlot *reply = c_container_of(timer, ReplySlot, timeout);
+        Peer *sender = c_container_of(reply->owner, Peer, owned_replies);
+        uint32_t serial = reply->serial;
+        int r;
+
+        reply_slot_free(reply);
+
+        r = driver_send_error(sender, serial, "org.freedesktop.DBus.Error.NoReply", "Message did not receive a reply (timeout by message bus)");
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static Peer *driver_find_destination(Peer *sender, Name **namep, const char *destination) {
+        PeerDestination *entry;
+        NameOwnership *ownership;
+        size_t i, n_destination;
+        Peer *receiver;
+        Name *name;
+
+        /*
+         * Most peers talk to only a handful of well-known names. Remember the
+         * last few of them, pinning each name object by a reference. This
+         * skips the hashed registry lookup, and costs a length comparison per
+         * entry plus a single memcmp() on a hit. The primary owner is read
+         * from the name on each hit, so the cache never needs invalidation
+         * when ownership changes. Unique names are resolved directly, as they
+         * do not need a string lookup.
+         */
+        if (destination[0] != ':') {
+                n_destination = strlen(destination);
+
+                for (i = 0; i < C_ARRAY_SIZE(sender->destinations); ++i) {
+                        entry = &sender->destinations[i];
+                        if (entry->name && entry->n_name == n_destination && !memcmp(entry->name->name, destination, n_destination)) {
+                                ownership = name_primary(entry->name);
+                                *namep = entry->name;
+                                return ownership ? c_container_of(ownership->owner, Peer, owned_names) : NULL;
+                        }
+                }
+        }
+
+        receiver = bus_find_peer_by_name(sender->bus, &name, destination);
+        if (name) {
+                entry = &sender->destinations[sender->i_destination++ % C_ARRAY_SIZE(sender->destinations)];
+                name_unref(entry->name);
+                entry->name = name_ref(name);
+                entry->n_name = strlen(name->name);
+        }
+
+        *namep = name;
+        return receiver;
+}
+
 static int driver_forward_unicast(Peer *sender, const char *destination, Message *message) {
         Peer *receiver;
         Name *name;
         NameSet sender_names = NAME_SET_INIT_FROM_OWNER(&sender->owned_names);
         int r;
 
-        receiver = bus_find_peer_by_name(sender->bus, &name, destination);
+        receiver = driver_find_destination(sender, &name, destination);
         if (!receiver) {
                 if (!name || !name->activation)
                         return DRIVER_E_DESTINATION_NOT_FOUND;
@@ -1635,6 +1830,15 @@ static int driver_monitor_to_matches(MatchRegistry *matches, MatchFilter *filter
         MatchRule *rule;
         int r;
 
+        /* see peer_broadcast_to_matches() for lazy body parsing */
+        if (matches->n_arg_rules && !message->parsed_body) {
+                r = message_parse_body(message);
+                if (r < 0)
+                        return error_fold(r);
+
+                peer_filter_set_args(filter, message);
+        }
+
         for (rule = match_rule_next_monitor_match(matches, NULL, filter); rule; rule = match_rule_next_monitor_match(matches, rule, filter)) {
                 Peer *receiver = c_container_of(rule->owner, Peer, owned_matches);
 
@@ -1643,13 +1847,9 @@ static int driver_monitor_to_matches(MatchRegistry *matches, MatchFilter *filter
 
                 receiver->transaction_id = c_max(transaction_id, receiver->transaction_id);
 
-                r = connection_queue(&receiver->connection, NULL, message);
-                if (r) {
-                        if (r == CONNECTION_E_QUOTA)
-                                connection_shutdown(&receiver->connection);
-                        else
-                                return error_fold(r);
-                }
+                r = peer_queue_monitor(receiver, message);
+                if (r)
+                        return error_fold(r);
         }
 
         return 0;
@@ -1660,20 +1860,17 @@ static int driver_monitor(Peer *sender, Message *message) {
         NameOwnership *ownership;
         int r;
 
+        if (!sender->bus->n_monitors)
+                return 0;
+
         filter.type = message->metadata.header.type;
         filter.sender = sender->id;
         filter.interface = message->metadata.fields.interface;
         filter.member = message->metadata.fields.member,
         filter.path = message->metadata.fields.path;
 
-        for (size_t i = 0; i < 64; ++i) {
-                if (message->metadata.args[i].element == 's') {
-                        filter.args[i] = message->metadata.args[i].value;
-                        filter.argpaths[i] = message->metadata.args[i].value;
-                } else if (message->metadata.args[i].element == 'o') {
-                        filter.argpaths[i] = message->metadata.args[i].value;
-                }
-        }
+        if (message->parsed_body)
+                peer_filter_set_args(&filter, message);
 
         /* start a new transaction, to avoid duplicates */
         ++sender->bus->transaction_ids;
@@ -1765,9 +1962,26 @@ int driver_dispatch(Peer *peer, Message *message) {
         else if (r < 0)
                 return error_fold(r);
 
-        message_stitch_sender(message, peer->id);
+        /*
+         * The body is validated upfront, unless disabled. In that case, it is
+         * only parsed once its arguments are needed for match-filters.
+         */
+        if (peer->bus->validate_body) {
+                r = message_parse_body(message);
+                if (r > 0)
+                        return DRIVER_E_PROTOCOL_VIOLATION;
+                else if (r < 0)
+                        return error_fold(r);
+        }
+
+        message_stitch_sender(message, &peer->sender);
 
         r = driver_dispatch_internal(peer, message);
+
+        /* only messages that passed all policy checks are captured */
+        if (!r && peer->bus->capture)
+                capture_message(peer->bus->capture, message);
+
         switch (r) {
         case DRIVER_E_PEER_NOT_REGISTERED:
                 r = driver_send_error(peer, message_read_serial(message), "org.freedesktop.DBus.Error.AccessDenied", driver_error_to_string(r));
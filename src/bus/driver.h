@@ -10,6 +10,7 @@ typedef struct Bus Bus;
 typedef struct MatchOwner MatchOwner;
 typedef struct Message Message;
 typedef struct Peer Peer;
+typedef struct Timer Timer;
 typedef struct User User;
 
 enum {
@@ -62,3 +63,4 @@ enum {
 int driver_dispatch(Peer *peer, Message *message);
 void driver_matches_cleanup(MatchOwner *owner, Bus *bus, User *user);
 int driver_goodbye(Peer *peer, bool silent);
+int driver_reply_timeout(Timer *timer);
@@ -10,6 +10,7 @@
 #include "dbus/address.h"
 #include "dbus/protocol.h"
 #include "util/error.h"
+#include "util/siphash.h"
 
 static bool match_key_equal(const char *key1, const char *key2, size_t n_key2) {
         if (strlen(key1) != n_key2)
@@ -18,21 +19,21 @@ static bool match_key_equal(const char *key1, const char *key2, size_t n_key2) {
         return !strncmp(key1, key2, n_key2);
 }
 
-static int match_keys_assign(MatchKeys *keys, const char *key, size_t n_key, const char *value) {
+static int match_keys_assign(MatchKeys *keys, const char **args, const char **argpaths, const char *key, size_t n_key, const char *value) {
         Address addr;
 
         if (match_key_equal("type", key, n_key)) {
-                if (keys->filter.type != DBUS_MESSAGE_TYPE_INVALID)
+                if (keys->type != DBUS_MESSAGE_TYPE_INVALID)
                         return MATCH_E_INVALID;
 
                 if (strcmp(value, "signal") == 0)
-                        keys->filter.type = DBUS_MESSAGE_TYPE_SIGNAL;
+                        keys->type = DBUS_MESSAGE_TYPE_SIGNAL;
                 else if (strcmp(value, "method_call") == 0)
-                        keys->filter.type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+                        keys->type = DBUS_MESSAGE_TYPE_METHOD_CALL;
                 else if (strcmp(value, "method_return") == 0)
-                        keys->filter.type = DBUS_MESSAGE_TYPE_METHOD_RETURN;
+                        keys->type = DBUS_MESSAGE_TYPE_METHOD_RETURN;
                 else if (strcmp(value, "error") == 0)
-                        keys->filter.type = DBUS_MESSAGE_TYPE_ERROR;
+                        keys->type = DBUS_MESSAGE_TYPE_ERROR;
                 else
                         return MATCH_E_INVALID;
         } else if (match_key_equal("sender", key, n_key)) {
@@ -46,27 +47,27 @@ static int match_keys_assign(MatchKeys *keys, const char *key, size_t n_key, con
 
                 address_from_string(&addr, value);
                 if (addr.type == ADDRESS_TYPE_ID)
-                        keys->filter.destination = addr.id;
+                        keys->destination_id = addr.id;
                 else
-                        keys->filter.destination = ADDRESS_ID_INVALID;
+                        keys->destination_id = ADDRESS_ID_INVALID;
         } else if (match_key_equal("interface", key, n_key)) {
-                if (keys->filter.interface)
+                if (keys->interface)
                         return MATCH_E_INVALID;
-                keys->filter.interface = value;
+                keys->interface = value;
         } else if (match_key_equal("member", key, n_key)) {
-                if (keys->filter.member)
+                if (keys->member)
                         return MATCH_E_INVALID;
-                keys->filter.member = value;
+                keys->member = value;
         } else if (match_key_equal("path", key, n_key)) {
-                if (keys->filter.path || keys->path_namespace)
+                if (keys->path || keys->path_namespace)
                         return MATCH_E_INVALID;
-                keys->filter.path = value;
+                keys->path = value;
         } else if (match_key_equal("path_namespace", key, n_key)) {
-                if (keys->path_namespace || keys->filter.path)
+                if (keys->path_namespace || keys->path)
                         return MATCH_E_INVALID;
                 keys->path_namespace = value;
         } else if (match_key_equal("arg0namespace", key, n_key)) {
-                if (keys->arg0namespace || keys->filter.args[0] || keys->filter.argpaths[0])
+                if (keys->arg0namespace || args[0] || argpaths[0])
                         return MATCH_E_INVALID;
                 keys->arg0namespace = value;
         } else if (n_key >= strlen("arg") && match_key_equal("arg", key, strlen("arg"))) {
@@ -87,13 +88,13 @@ static int match_keys_assign(MatchKeys *keys, const char *key, size_t n_key, con
                 if (i > 63)
                         return MATCH_E_INVALID;
 
-                if (keys->filter.args[i] || keys->filter.argpaths[i])
+                if (args[i] || argpaths[i])
                         return MATCH_E_INVALID;
 
                 if (match_key_equal("", key, n_key)) {
-                        keys->filter.args[i] = value;
+                        args[i] = value;
                 } else if (match_key_equal("path", key, n_key)) {
-                        keys->filter.argpaths[i] = value;
+                        argpaths[i] = value;
                 } else
                         return MATCH_E_INVALID;
         } else {
@@ -177,8 +178,8 @@ static int match_parse_key(const char **match, const char **keyp, size_t *n_keyp
 }
 
 static int match_keys_parse(MatchKeys *keys, const char *string) {
-        const char *key, *value;
-        size_t n_key;
+        const char *key, *value, *args[64] = {}, *argpaths[64] = {};
+        size_t i, n_key, n_args;
         char *p;
         int r;
 
@@ -202,15 +203,52 @@ static int match_keys_parse(MatchKeys *keys, const char *string) {
                 if (r)
                         break;
 
-                r = match_keys_assign(keys, key, n_key, value);
+                r = match_keys_assign(keys, args, argpaths, key, n_key, value);
                 if (r)
                         break;
         }
 
-        return (r == MATCH_E_EOF) ? 0 : error_trace(r);
+        if (r != MATCH_E_EOF)
+                return error_trace(r);
+
+        /*
+         * Argument keys are rare, but there are 64 of them. Rather than
+         * reserving space for all of them in every rule, store only the used
+         * ones, sorted by index, and remember which slots are in use.
+         */
+
+        static_assert(C_ARRAY_SIZE(args) == 64, "Argument mask size mismatch");
+
+        for (i = 0; i < C_ARRAY_SIZE(args); ++i)
+                if (args[i] || argpaths[i])
+                        keys->args_mask |= UINT64_C(1) << i;
+
+        keys->n_args = __builtin_popcountll(keys->args_mask);
+        if (keys->n_args) {
+                keys->args = malloc(keys->n_args * sizeof(*keys->args));
+                if (!keys->args)
+                        return error_origin(-ENOMEM);
+
+                for (i = 0, n_args = 0; i < C_ARRAY_SIZE(args); ++i) {
+                        if (!args[i] && !argpaths[i])
+                                continue;
+
+                        keys->args[n_args++] = (MatchArg){
+                                .value = args[i] ?: argpaths[i],
+                                .index = i,
+                                .path = !args[i],
+                        };
+                }
+        }
+
+        if (keys->arg0namespace)
+                keys->args_mask |= 1;
+
+        return 0;
 }
 
 static void match_keys_deinit(MatchKeys *keys) {
+        free(keys->args);
         *keys = (MatchKeys)MATCH_KEYS_NULL;
 }
 
@@ -290,22 +328,30 @@ static bool match_string_prefix(const char *string, const char *prefix, char del
 }
 
 static bool match_keys_match_filter(MatchKeys *keys, MatchFilter *filter) {
-        if (keys->filter.type != DBUS_MESSAGE_TYPE_INVALID && keys->filter.type != filter->type)
+        if (keys->type != DBUS_MESSAGE_TYPE_INVALID && keys->type != filter->type)
                 return false;
 
-        if (keys->filter.destination != ADDRESS_ID_INVALID && keys->filter.destination != filter->destination)
+        if (keys->destination_id != ADDRESS_ID_INVALID && keys->destination_id != filter->destination)
                 return false;
 
-        if (keys->filter.sender != ADDRESS_ID_INVALID && keys->filter.sender != filter->sender)
+        if (keys->sender_id != ADDRESS_ID_INVALID && keys->sender_id != filter->sender)
                 return false;
 
-        if (keys->filter.interface && !c_string_equal(keys->filter.interface, filter->interface))
+        /*
+         * Every argument the rule matches on must be present in the message.
+         * The masks let us reject most rules without looking at any string,
+         * and only visit the argument slots the rule actually uses.
+         */
+        if (keys->args_mask & ~filter->args_mask)
+                return false;
+
+        if (keys->interface && !c_string_equal(keys->interface, filter->interface))
                 return false;
 
-        if (keys->filter.member && !c_string_equal(keys->filter.member, filter->member))
+        if (keys->member && !c_string_equal(keys->member, filter->member))
                 return false;
 
-        if (keys->filter.path && !c_string_equal(keys->filter.path, filter->path))
+        if (keys->path && !c_string_equal(keys->path, filter->path))
                 return false;
 
         if (keys->path_namespace && !match_string_prefix(keys->path_namespace, filter->path, '/', false))
@@ -315,20 +361,25 @@ static bool match_keys_match_filter(MatchKeys *keys, MatchFilter *filter) {
         if (keys->arg0namespace && !match_string_prefix(keys->arg0namespace, filter->args[0], '.', false))
                 return false;
 
-        for (unsigned int i = 0; i < C_ARRAY_SIZE(filter->args); i ++) {
-                if (keys->filter.args[i] && !c_string_equal(keys->filter.args[i], filter->args[i]))
-                        return false;
+        for (size_t i = 0; i < keys->n_args; ++i) {
+                MatchArg *arg = &keys->args[i];
 
-                if (keys->filter.argpaths[i]) {
-                        if (!match_string_prefix(filter->argpaths[i], keys->filter.argpaths[i], '/', true) &&
-                            !match_string_prefix(keys->filter.argpaths[i], filter->argpaths[i], '/', true))
+                if (arg->path) {
+                        if (!match_string_prefix(filter->argpaths[arg->index], arg->value, '/', true) &&
+                            !match_string_prefix(arg->value, filter->argpaths[arg->index], '/', true))
                                 return false;
+                } else if (!c_string_equal(arg->value, filter->args[arg->index])) {
+                        return false;
                 }
         }
 
         return true;
 }
 
+static bool match_keys_has_args(MatchKeys *keys) {
+        return keys->args_mask;
+}
+
 static int match_rule_compare(CRBTree *tree, void *k, CRBNode *rb) {
         MatchRule *rule = c_container_of(rb, MatchRule, owner_node);
         MatchKeys *key1 = k, *key2 = &rule->keys;
@@ -336,21 +387,33 @@ static int match_rule_compare(CRBTree *tree, void *k, CRBNode *rb) {
 
         if ((r = c_string_compare(key1->sender, key2->sender)) ||
             (r = c_string_compare(key1->destination, key2->destination)) ||
-            (r = c_string_compare(key1->filter.interface, key2->filter.interface)) ||
-            (r = c_string_compare(key1->filter.member, key2->filter.member)) ||
-            (r = c_string_compare(key1->filter.path, key2->filter.path)) ||
+            (r = c_string_compare(key1->interface, key2->interface)) ||
+            (r = c_string_compare(key1->member, key2->member)) ||
+            (r = c_string_compare(key1->path, key2->path)) ||
             (r = c_string_compare(key1->path_namespace, key2->path_namespace)) ||
             (r = c_string_compare(key1->arg0namespace, key2->arg0namespace)))
                 return r;
 
-        if (key1->filter.type > key2->filter.type)
+        if (key1->type > key2->type)
+                return 1;
+        if (key1->type < key2->type)
+                return -1;
+
+        if (key1->n_args > key2->n_args)
                 return 1;
-        if (key1->filter.type < key2->filter.type)
+        if (key1->n_args < key2->n_args)
                 return -1;
 
-        for (size_t i = 0; i < C_ARRAY_SIZE(key1->filter.args); i ++) {
-                if ((r = c_string_compare(key1->filter.args[i], key2->filter.args[i])) ||
-                    (r = c_string_compare(key1->filter.argpaths[i], key2->filter.argpaths[i])))
+        for (size_t i = 0; i < key1->n_args; i ++) {
+                if (key1->args[i].index > key2->args[i].index)
+                        return 1;
+                if (key1->args[i].index < key2->args[i].index)
+                        return -1;
+                if (key1->args[i].path > key2->args[i].path)
+                        return 1;
+                if (key1->args[i].path < key2->args[i].path)
+                        return -1;
+                if ((r = c_string_compare(key1->args[i].value, key2->args[i].value)))
                         return r;
         }
 
@@ -363,11 +426,11 @@ static MatchRule *match_rule_free(MatchRule *rule) {
 
         assert(!rule->n_user_refs);
 
+        match_rule_unlink(rule);
         match_keys_deinit(&rule->keys);
         user_charge_deinit(&rule->charge[1]);
         user_charge_deinit(&rule->charge[0]);
         c_rbtree_remove_init(&rule->owner->rule_tree, &rule->owner_node);
-        match_rule_unlink(rule);
         free(rule);
 
         return NULL;
@@ -391,15 +454,20 @@ static int match_rule_new(MatchRule **rulep, MatchOwner *owner, User *user, cons
         *rule = (MatchRule)MATCH_RULE_NULL(*rule);
         rule->owner = owner;
 
-        r = user_charge(user, &rule->charge[0], NULL, USER_SLOT_BYTES, sizeof(*rule) + n_string);
-        r = r ?: user_charge(user, &rule->charge[1], NULL, USER_SLOT_MATCHES, 1);
-        if (r)
-                return (r == USER_E_QUOTA) ? MATCH_E_QUOTA : error_fold(r);
-
         r = match_keys_init(&rule->keys, string, n_string);
         if (r)
                 return error_trace(r);
 
+        /* the argument array is allocated separately, charge it as well */
+        r = user_charge(user,
+                        &rule->charge[0],
+                        NULL,
+                        USER_SLOT_BYTES,
+                        sizeof(*rule) + n_string + rule->keys.n_args * sizeof(*rule->keys.args));
+        r = r ?: user_charge(user, &rule->charge[1], NULL, USER_SLOT_MATCHES, 1);
+        if (r)
+                return (r == USER_E_QUOTA) ? MATCH_E_QUOTA : error_fold(r);
+
         *rulep = rule;
         rule = NULL;
         return 0;
@@ -436,6 +504,72 @@ MatchRule *match_rule_user_unref(MatchRule *rule) {
         return NULL;
 }
 
+static uint32_t match_hash(MatchRegistry *registry, const char *string) {
+        static const uint8_t seed_null[SIPHASH_KEY_SIZE];
+
+        /*
+         * Members are picked by clients, so the index must be keyed to avoid
+         * collision flooding. Registries without seed are only used by tests.
+         * The hash is only ever computed for indexed registries, which are
+         * the few with many member rules.
+         */
+        return siphash24(string, strlen(string), registry->seed ?: seed_null);
+}
+
+static CList *match_registry_bucket(MatchRegistry *registry, uint32_t hash) {
+        return &registry->member_buckets[hash & (registry->n_member_buckets - 1)];
+}
+
+static void match_registry_index(MatchRegistry *registry) {
+        MatchRule *rule, *rule_safe;
+        CList *buckets, *old_buckets;
+        size_t i, n_buckets, n_old_buckets;
+
+        /*
+         * Rules with a member key are kept in a hash-table indexed by the
+         * member, so broadcasts only need to look at rules for their member,
+         * plus all rules without member key. The table is only created once
+         * there are enough such rules to be worth it, and grown whenever the
+         * load-factor exceeds 2. This is merely an optimization, so if the
+         * allocation fails we keep the rules where they are.
+         */
+
+        if (registry->n_member_rules < MATCH_REGISTRY_INDEX_MIN ||
+            registry->n_member_rules <= 2 * registry->n_member_buckets)
+                return;
+
+        n_buckets = c_max(registry->n_member_buckets * 2, MATCH_REGISTRY_INDEX_MIN);
+        buckets = malloc(n_buckets * sizeof(*buckets));
+        if (!buckets)
+                return;
+
+        for (i = 0; i < n_buckets; ++i)
+                buckets[i] = (CList)C_LIST_INIT(buckets[i]);
+
+        old_buckets = registry->member_buckets;
+        n_old_buckets = registry->n_member_buckets;
+        registry->member_buckets = buckets;
+        registry->n_member_buckets = n_buckets;
+
+        for (i = 0; i < n_old_buckets; ++i) {
+                c_list_for_each_entry_safe(rule, rule_safe, &old_buckets[i], registry_link) {
+                        c_list_unlink_init(&rule->registry_link);
+                        c_list_link_tail(match_registry_bucket(registry, rule->member_hash), &rule->registry_link);
+                }
+        }
+
+        c_list_for_each_entry_safe(rule, rule_safe, &registry->rule_list, registry_link) {
+                if (!rule->keys.member)
+                        continue;
+
+                c_list_unlink_init(&rule->registry_link);
+                c_list_link_tail(match_registry_bucket(registry, rule->member_hash), &rule->registry_link);
+                rule->indexed = true;
+        }
+
+        free(old_buckets);
+}
+
 /**
  * match_rule_link() - XXX
  */
@@ -445,10 +579,26 @@ void match_rule_link(MatchRule *rule, MatchRegistry *registry, bool monitor) {
                 assert(c_list_is_linked(&rule->registry_link));
         } else {
                 rule->registry = registry;
-                if (monitor)
+                rule->monitor = monitor;
+                if (match_keys_has_args(&rule->keys))
+                        ++registry->n_arg_rules;
+                if (monitor) {
                         c_list_link_tail(&registry->monitor_list, &rule->registry_link);
-                else
-                        c_list_link_tail(&registry->rule_list, &rule->registry_link);
+                } else {
+                        ++registry->n_rules;
+                        if (rule->keys.member) {
+                                rule->member_hash = match_hash(registry, rule->keys.member);
+                                ++registry->n_member_rules;
+                                match_registry_index(registry);
+                        }
+
+                        if (rule->keys.member && registry->n_member_buckets) {
+                                c_list_link_tail(match_registry_bucket(registry, rule->member_hash), &rule->registry_link);
+                                rule->indexed = true;
+                        } else {
+                                c_list_link_tail(&registry->rule_list, &rule->registry_link);
+                        }
+                }
         }
 }
 
@@ -457,17 +607,24 @@ void match_rule_link(MatchRule *rule, MatchRegistry *registry, bool monitor) {
  */
 void match_rule_unlink(MatchRule *rule) {
         if (rule->registry) {
+                if (match_keys_has_args(&rule->keys))
+                        --rule->registry->n_arg_rules;
+                if (!rule->monitor) {
+                        --rule->registry->n_rules;
+                        if (rule->keys.member)
+                                --rule->registry->n_member_rules;
+                }
                 c_list_unlink_init(&rule->registry_link);
                 rule->registry = NULL;
+                rule->monitor = false;
+                rule->indexed = false;
         }
 }
 
-static MatchRule *match_rule_next_match_internal(CList *rules, MatchRule *rule, MatchFilter *filter) {
-        CList *entry;
+static MatchRule *match_rule_next_match_internal(CList *rules, CList *entry, MatchFilter *filter) {
+        MatchRule *rule;
 
-        for (entry = rule ? rule->registry_link.next : rules->next;
-             entry != rules;
-             entry = entry->next) {
+        for ( ; entry != rules; entry = entry->next) {
                 rule = c_list_entry(entry, MatchRule, registry_link);
 
                 if (match_keys_match_filter(&rule->keys, filter))
@@ -478,14 +635,34 @@ static MatchRule *match_rule_next_match_internal(CList *rules, MatchRule *rule,
 }
 
 MatchRule *match_rule_next_match(MatchRegistry *registry, MatchRule *rule, MatchFilter *filter) {
+        CList *bucket;
+
         if (filter->destination != ADDRESS_ID_INVALID)
                 return NULL;
 
-        return match_rule_next_match_internal(&registry->rule_list, rule, filter);
+        /*
+         * Indexed rules are visited first, but only those in the bucket of
+         * the member of @filter. Rules with a member key can never match a
+         * filter without member. Then all remaining rules are visited.
+         */
+        if (!rule || rule->indexed) {
+                if (filter->member && registry->n_member_buckets) {
+                        bucket = match_registry_bucket(registry, rule ? rule->member_hash : match_hash(registry, filter->member));
+                        rule = match_rule_next_match_internal(bucket, rule ? rule->registry_link.next : bucket->next, filter);
+                        if (rule)
+                                return rule;
+                }
+
+                return match_rule_next_match_internal(&registry->rule_list, registry->rule_list.next, filter);
+        }
+
+        return match_rule_next_match_internal(&registry->rule_list, rule->registry_link.next, filter);
 }
 
 MatchRule *match_rule_next_monitor_match(MatchRegistry *registry, MatchRule *rule, MatchFilter *filter) {
-        return match_rule_next_match_internal(&registry->monitor_list, rule, filter);
+        return match_rule_next_match_internal(&registry->monitor_list,
+                                              rule ? rule->registry_link.next : registry->monitor_list.next,
+                                              filter);
 }
 
 /**
@@ -560,4 +737,29 @@ void match_registry_init(MatchRegistry *registry) {
 void match_registry_deinit(MatchRegistry *registry) {
         assert(c_list_is_empty(&registry->rule_list));
         assert(c_list_is_empty(&registry->monitor_list));
+        assert(!registry->n_rules);
+        assert(!registry->n_arg_rules);
+
+        free(registry->member_buckets);
+        registry->member_buckets = NULL;
+        registry->n_member_buckets = 0;
+}
+
+/**
+ * match_registry_flush() - unlink all rules
+ * @registry:           registry to operate on
+ *
+ * This unlinks all non-monitor rules from @registry, regardless of whether
+ * they are indexed or not. Monitor rules are left untouched.
+ */
+void match_registry_flush(MatchRegistry *registry) {
+        MatchRule *rule, *rule_safe;
+        size_t i;
+
+        for (i = 0; i < registry->n_member_buckets; ++i)
+                c_list_for_each_entry_safe(rule, rule_safe, &registry->member_buckets[i], registry_link)
+                        match_rule_unlink(rule);
+
+        c_list_for_each_entry_safe(rule, rule_safe, &registry->rule_list, registry_link)
+                match_rule_unlink(rule);
 }
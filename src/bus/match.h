@@ -10,6 +10,7 @@
 #include "dbus/address.h"
 #include "util/user.h"
 
+typedef struct MatchArg MatchArg;
 typedef struct MatchFilter MatchFilter;
 typedef struct MatchKeys MatchKeys;
 typedef struct MatchOwner MatchOwner;
@@ -17,6 +18,7 @@ typedef struct MatchRegistry MatchRegistry;
 typedef struct MatchRule MatchRule;
 
 #define MATCH_RULE_LENGTH_MAX (1024UL) /* taken from dbus-daemon(1) */
+#define MATCH_REGISTRY_INDEX_MIN (8UL)
 
 enum {
         _MATCH_E_SUCCESS,
@@ -35,6 +37,7 @@ struct MatchFilter {
         const char *path;
         const char *args[64];
         const char *argpaths[64];
+        uint64_t args_mask; /* set bit for each slot in @args or @argpaths */
 };
 
 #define MATCH_FILTER_INIT {                             \
@@ -43,18 +46,36 @@ struct MatchFilter {
                 .sender = ADDRESS_ID_INVALID,           \
         }
 
+struct MatchArg {
+        const char *value;
+        uint8_t index;
+        bool path : 1;
+};
+
 struct MatchKeys {
-        MatchFilter filter;
-        const char *destination;
-        const char *sender;
+        uint8_t type;
+        uint64_t args_mask;
+        uint64_t destination_id;
+        uint64_t sender_id;
+        const char *interface;
+        const char *member;
+        const char *path;
         const char *path_namespace;
         const char *arg0namespace;
 
+        size_t n_args;
+        MatchArg *args;
+
+        const char *destination;
+        const char *sender;
+
         char buffer[];
 };
 
 #define MATCH_KEYS_NULL {                                                       \
-                .filter = MATCH_FILTER_INIT,                                    \
+                .type = DBUS_MESSAGE_TYPE_INVALID,                              \
+                .destination_id = ADDRESS_ID_INVALID,                           \
+                .sender_id = ADDRESS_ID_INVALID,                                \
         }
 
 struct MatchRule {
@@ -65,6 +86,9 @@ struct MatchRule {
         CRBNode owner_node;
 
         UserCharge charge[2];
+        uint32_t member_hash;
+        bool monitor : 1;
+        bool indexed : 1;
         MatchKeys keys;
         /* @keys must be last, as it contains a VLA */
 };
@@ -85,8 +109,14 @@ struct MatchOwner {
         }
 
 struct MatchRegistry {
+        const uint8_t *seed;
         CList rule_list;
         CList monitor_list;
+        CList *member_buckets;
+        size_t n_member_buckets;
+        size_t n_member_rules;
+        size_t n_rules;
+        size_t n_arg_rules;
 };
 
 #define MATCH_REGISTRY_INIT(_x) {                                               \
@@ -119,3 +149,4 @@ int match_owner_find_rule(MatchOwner *owner, MatchRule **rulep, const char *rule
 
 void match_registry_init(MatchRegistry *registry);
 void match_registry_deinit(MatchRegistry *registry);
+void match_registry_flush(MatchRegistry *registry);
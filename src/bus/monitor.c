@@ -0,0 +1,120 @@
+/*
+ * Monitor Ring
+ *
+ * Monitors see a copy of every message they match, so a slow monitor must
+ * neither stall the bus nor be disconnected for falling behind. Messages that
+ * do not fit the socket queue of a monitor are parked in a fixed-size ring of
+ * message references instead. Each entry is charged on the user of the
+ * monitor, as the referenced message might outlive its sender. Once the ring
+ * is full, or the user is out of quota, the oldest entries are dropped in
+ * favor of new ones, and accounted in the drop counter of the ring.
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "bus/monitor.h"
+#include "dbus/message.h"
+#include "util/error.h"
+#include "util/user.h"
+
+/**
+ * monitor_ring_init() - initialize monitor ring
+ * @ring:               ring to operate on
+ * @user:               user to charge entries on
+ *
+ * This initializes the monitor ring @ring and allocates its entries upfront.
+ * All queued entries will be charged on @user.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int monitor_ring_init(MonitorRing *ring, User *user) {
+        *ring = (MonitorRing)MONITOR_RING_NULL;
+
+        ring->entries = calloc(MONITOR_RING_SIZE, sizeof(*ring->entries));
+        if (!ring->entries)
+                return error_origin(-ENOMEM);
+
+        ring->user = user_ref(user);
+        return 0;
+}
+
+/**
+ * monitor_ring_deinit() - deinitialize monitor ring
+ * @ring:               ring to operate on
+ *
+ * This drops all queued entries and releases all resources of @ring. The ring
+ * is reset to MONITOR_RING_NULL, so it is safe to call this multiple times.
+ */
+void monitor_ring_deinit(MonitorRing *ring) {
+        while (!monitor_ring_is_empty(ring))
+                monitor_ring_pop(ring);
+
+        free(ring->entries);
+        user_unref(ring->user);
+        *ring = (MonitorRing)MONITOR_RING_NULL;
+}
+
+/**
+ * monitor_ring_push() - queue message on monitor ring
+ * @ring:               ring to operate on
+ * @message:            message to queue
+ *
+ * This queues a reference to @message at the end of @ring, and charges it on
+ * the user of @ring. If the ring is full, or the charge exceeds the quota,
+ * the oldest entries are dropped until it fits. If it does not fit an empty
+ * ring, @message itself is dropped. Every dropped message is counted.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int monitor_ring_push(MonitorRing *ring, Message *message) {
+        MonitorEntry *entry;
+        int r;
+
+        assert(ring->entries);
+
+        if (ring->n_entries == MONITOR_RING_SIZE) {
+                monitor_ring_pop(ring);
+                ++ring->n_dropped;
+        }
+
+        entry = &ring->entries[(ring->i_entries + ring->n_entries) % MONITOR_RING_SIZE];
+
+        for (;;) {
+                r = user_charge(ring->user, &entry->charge, NULL, USER_SLOT_BYTES, sizeof(Message) + message->n_data);
+                if (!r)
+                        break;
+                else if (r != USER_E_QUOTA)
+                        return error_fold(r);
+
+                ++ring->n_dropped;
+
+                if (monitor_ring_is_empty(ring))
+                        return 0;
+
+                monitor_ring_pop(ring);
+        }
+
+        entry->message = message_ref(message);
+        ++ring->n_entries;
+        return 0;
+}
+
+/**
+ * monitor_ring_pop() - drop first entry of monitor ring
+ * @ring:               ring to operate on
+ *
+ * This drops the oldest entry of @ring and releases its charge. The ring must
+ * not be empty.
+ */
+void monitor_ring_pop(MonitorRing *ring) {
+        MonitorEntry *entry;
+
+        assert(!monitor_ring_is_empty(ring));
+
+        entry = &ring->entries[ring->i_entries];
+        entry->message = message_unref(entry->message);
+        user_charge_deinit(&entry->charge);
+
+        ring->i_entries = (ring->i_entries + 1) % MONITOR_RING_SIZE;
+        --ring->n_entries;
+}
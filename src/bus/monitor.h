@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+ * Monitor Ring
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/user.h"
+
+typedef struct Message Message;
+typedef struct MonitorEntry MonitorEntry;
+typedef struct MonitorRing MonitorRing;
+
+#define MONITOR_RING_SIZE 256
+
+struct MonitorEntry {
+        Message *message;
+        UserCharge charge;
+};
+
+struct MonitorRing {
+        User *user;
+        MonitorEntry *entries;
+        size_t i_entries;
+        size_t n_entries;
+        uint64_t n_dropped;
+};
+
+#define MONITOR_RING_NULL {}
+
+int monitor_ring_init(MonitorRing *ring, User *user);
+void monitor_ring_deinit(MonitorRing *ring);
+
+int monitor_ring_push(MonitorRing *ring, Message *message);
+void monitor_ring_pop(MonitorRing *ring);
+
+/* inline helpers */
+
+static inline bool monitor_ring_is_empty(MonitorRing *ring) {
+        return !ring->n_entries;
+}
+
+static inline Message *monitor_ring_first(MonitorRing *ring) {
+        return ring->n_entries ? ring->entries[ring->i_entries].message : NULL;
+}
@@ -11,6 +11,7 @@
 #include "dbus/protocol.h"
 #include "dbus/socket.h"
 #include "util/error.h"
+#include "util/siphash.h"
 #include "util/user.h"
 
 /**
@@ -125,6 +126,7 @@ void name_ownership_release(NameOwnership *ownership, NameChange *change) {
 
         if (ownership == primary) {
                 primary = name_primary(ownership->name);
+                ++ownership->name->registry->generation;
 
                 change->name = name_ref(ownership->name);
                 change->old_owner = ownership->owner;
@@ -148,6 +150,7 @@ static int name_ownership_update(NameOwnership *ownership, uint32_t flags, NameC
 
         if (!primary) {
                 /* there is no primary owner */
+                ++name->registry->generation;
                 change->name = name_ref(name);
                 change->old_owner = NULL;
                 change->new_owner = ownership->owner;
@@ -163,6 +166,7 @@ static int name_ownership_update(NameOwnership *ownership, uint32_t flags, NameC
         } else if ((ownership->flags & DBUS_NAME_FLAG_REPLACE_EXISTING) &&
                    (primary->flags & DBUS_NAME_FLAG_ALLOW_REPLACEMENT)) {
                 /* we replace the primary owner */
+                ++name->registry->generation;
                 change->name = name_ref(name);
                 change->old_owner = primary->owner;
                 change->new_owner = ownership->owner;
@@ -197,10 +201,53 @@ static int name_compare(CRBTree *tree, void *k, CRBNode *rb) {
         return strcmp(k, name->name);
 }
 
+static uint64_t name_registry_hash(NameRegistry *registry, const char *name_str) {
+        return siphash24(name_str, strlen(name_str), registry->seed);
+}
+
+static CList *name_registry_bucket(NameRegistry *registry, uint64_t hash) {
+        return &registry->name_buckets[hash & (registry->n_name_buckets - 1)];
+}
+
+static int name_registry_grow(NameRegistry *registry) {
+        CList *buckets;
+        size_t i, n_buckets;
+        Name *name;
+
+        /*
+         * Keep the load-factor of the hash-table below 1. The number of
+         * buckets is always a power of 2, so the bucket can be picked by
+         * masking the hash. On resize, we rehash from the name tree, rather
+         * than walking the old buckets.
+         */
+
+        if (registry->n_names < registry->n_name_buckets)
+                return 0;
+
+        n_buckets = registry->n_name_buckets ? registry->n_name_buckets * 2 : 64;
+        buckets = malloc(n_buckets * sizeof(*buckets));
+        if (!buckets)
+                return error_origin(-ENOMEM);
+
+        for (i = 0; i < n_buckets; ++i)
+                buckets[i] = (CList)C_LIST_INIT(buckets[i]);
+
+        free(registry->name_buckets);
+        registry->name_buckets = buckets;
+        registry->n_name_buckets = n_buckets;
+
+        c_rbtree_for_each_entry(name, &registry->name_tree, registry_node)
+                c_list_link_tail(name_registry_bucket(registry, name->hash), &name->registry_link);
+
+        return 0;
+}
+
 static void name_link(Name *name, CRBNode *parent, CRBNode **slot) {
         assert(!c_rbnode_is_linked(&name->registry_node));
 
         c_rbtree_add(&name->registry->name_tree, parent, slot, &name->registry_node);
+        c_list_link_tail(name_registry_bucket(name->registry, name->hash), &name->registry_link);
+        ++name->registry->n_names;
 }
 
 static int name_new(Name **namep, NameRegistry *registry, const char *name_str) {
@@ -214,6 +261,8 @@ static int name_new(Name **namep, NameRegistry *registry, const char *name_str)
 
         *name = (Name)NAME_INIT(*name);
         name->registry = registry;
+        name->matches.seed = registry->seed;
+        name->hash = name_registry_hash(registry, name_str);
         memcpy(name->name, name_str, n_name + 1);
 
         *namep = name;
@@ -227,6 +276,12 @@ void name_free(_Atomic unsigned long *n_refs, void *userdata) {
         assert(c_list_is_empty(&name->ownership_list));
         assert(!name->activation);
 
+        if (c_rbnode_is_linked(&name->registry_node)) {
+                c_list_unlink_init(&name->registry_link);
+                --name->registry->n_names;
+                ++name->registry->generation;
+        }
+
         match_registry_deinit(&name->matches);
         c_rbtree_remove_init(&name->registry->name_tree, &name->registry_node);
         free(name);
@@ -272,6 +327,11 @@ void name_registry_init(NameRegistry *registry) {
  */
 void name_registry_deinit(NameRegistry *registry) {
         assert(c_rbtree_is_empty(&registry->name_tree));
+        assert(!registry->n_names);
+
+        free(registry->name_buckets);
+        registry->name_buckets = NULL;
+        registry->n_name_buckets = 0;
 }
 
 /**
@@ -289,19 +349,27 @@ void name_registry_deinit(NameRegistry *registry) {
  */
 int name_registry_ref_name(NameRegistry *registry, Name **namep, const char *name_str) {
         CRBNode **slot, *parent;
+        Name *name;
         int r;
 
+        name = name_registry_find_name(registry, name_str);
+        if (name) {
+                *namep = name_ref(name);
+                return 0;
+        }
+
+        r = name_registry_grow(registry);
+        if (r)
+                return error_trace(r);
+
         slot = c_rbtree_find_slot(&registry->name_tree, name_compare, name_str, &parent);
-        if (!slot) {
-                *namep = name_ref(c_container_of(parent, Name, registry_node));
-        } else {
-                r = name_new(namep, registry, name_str);
-                if (r)
-                        return error_trace(r);
+        assert(slot);
 
-                name_link(*namep, parent, slot);
-        }
+        r = name_new(namep, registry, name_str);
+        if (r)
+                return error_trace(r);
 
+        name_link(*namep, parent, slot);
         return 0;
 }
 
@@ -310,12 +378,28 @@ int name_registry_ref_name(NameRegistry *registry, Name **namep, const char *nam
  * @registry:           registry to operate on
  * @name_str:           name to lookup
  *
- * This looks for a name-entry for name @name_str and returns it.
+ * This looks for a name-entry for name @name_str and returns it. The lookup
+ * uses the hash-table of the registry, so it costs a single hash computation
+ * and, usually, a single string comparison.
  *
  * Return: Pointer to name-entry, or NULL if not found.
  */
 Name *name_registry_find_name(NameRegistry *registry, const char *name_str) {
-        return c_rbtree_find_entry(&registry->name_tree, name_compare, name_str, Name, registry_node);
+        CList *bucket;
+        uint64_t hash;
+        Name *name;
+
+        if (!registry->n_names)
+                return NULL;
+
+        hash = name_registry_hash(registry, name_str);
+        bucket = name_registry_bucket(registry, hash);
+
+        c_list_for_each_entry(name, bucket, registry_link)
+                if (name->hash == hash && !strcmp(name->name, name_str))
+                        return name;
+
+        return NULL;
 }
 
 /**
@@ -8,6 +8,7 @@
 #include <c-ref.h>
 #include <stdlib.h>
 #include "bus/match.h"
+#include "util/siphash.h"
 #include "util/user.h"
 
 typedef struct Activation Activation;
@@ -58,6 +59,8 @@ struct Name {
         _Atomic unsigned long n_refs;
         NameRegistry *registry;
         CRBNode registry_node;
+        CList registry_link;
+        uint64_t hash;
 
         Activation *activation;
         MatchRegistry matches;
@@ -69,6 +72,7 @@ struct Name {
 #define NAME_INIT(_x) {                                                         \
                 .n_refs = C_REF_INIT,                                           \
                 .registry_node = C_RBNODE_INIT((_x).registry_node),             \
+                .registry_link = C_LIST_INIT((_x).registry_link),               \
                 .matches = MATCH_REGISTRY_INIT((_x).matches),                   \
                 .ownership_list = C_LIST_INIT((_x).ownership_list),             \
         }
@@ -83,6 +87,11 @@ struct NameOwner {
 
 struct NameRegistry {
         CRBTree name_tree;
+        CList *name_buckets;
+        size_t n_name_buckets;
+        size_t n_names;
+        uint64_t generation;
+        uint8_t seed[SIPHASH_KEY_SIZE];
 };
 
 #define NAME_REGISTRY_INIT {                                                    \
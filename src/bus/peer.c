@@ -4,6 +4,7 @@
 
 #include <c-macro.h>
 #include <c-rbtree.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
@@ -11,6 +12,7 @@
 #include "bus/bus.h"
 #include "bus/driver.h"
 #include "bus/match.h"
+#include "bus/monitor.h"
 #include "bus/name.h"
 #include "bus/peer.h"
 #include "bus/policy.h"
@@ -25,6 +27,7 @@
 #include "util/metrics.h"
 #include "util/selinux.h"
 #include "util/sockopt.h"
+#include "util/timer.h"
 #include "util/user.h"
 
 static int peer_dispatch_connection(Peer *peer, uint32_t events) {
@@ -40,6 +43,15 @@ static int peer_dispatch_connection(Peer *peer, uint32_t events) {
         for (;;) {
                 _c_cleanup_(message_unrefp) Message *m = NULL;
 
+                /*
+                 * A throttled peer must not make progress on its input, even
+                 * if messages are already buffered. Once released, EPOLLIN is
+                 * re-scheduled and we continue where we left off. Peers that
+                 * are torn down are drained regardless, so they see EOF.
+                 */
+                if (_c_unlikely_(peer_is_throttled(peer) && connection_is_running(&peer->connection)))
+                        return 0;
+
                 r = connection_dequeue(&peer->connection, &m);
                 if (r || !m) {
                         if (r == CONNECTION_E_EOF)
@@ -62,12 +74,125 @@ static int peer_dispatch_connection(Peer *peer, uint32_t events) {
         return 0;
 }
 
+static int peer_flush_monitor(Peer *peer) {
+        int r;
+
+        while (!monitor_ring_is_empty(&peer->monitor_ring)) {
+                r = connection_queue(&peer->connection, NULL, &peer->bus->latency[BUS_LATENCY_MONITOR], monitor_ring_first(&peer->monitor_ring));
+                if (r == CONNECTION_E_QUOTA) {
+                        if (socket_has_output(&peer->connection.socket))
+                                return 0;
+
+                        /* the message does not even fit an idle socket */
+                        ++peer->monitor_ring.n_dropped;
+                } else if (r) {
+                        return error_fold(r);
+                }
+
+                monitor_ring_pop(&peer->monitor_ring);
+        }
+
+        /* the monitor caught up, report what it missed in the meantime */
+        if (peer->monitor_ring.n_dropped) {
+                fprintf(stderr, "Monitor :1.%llu dropped %llu messages.\n",
+                        (unsigned long long)peer->id,
+                        (unsigned long long)peer->monitor_ring.n_dropped);
+                peer->monitor_ring.n_dropped = 0;
+        }
+
+        return 0;
+}
+
+/*
+ * With flow control enabled, a sender that pushes a receiver over the high
+ * watermark stops being read from, until the receiver drained its queue below
+ * the low watermark again. Hence, bursts are absorbed by the kernel socket
+ * buffers of the sender, rather than by the quota of the receiver. The quota
+ * is still enforced as a last resort.
+ *
+ * Only traffic the receiver did not ask for is throttled, that is, unicast
+ * calls and signals, but neither replies nor broadcasts it subscribed to.
+ * Furthermore, only senders of the same user as the receiver are throttled.
+ * Otherwise, any client could stall a service by not reading the replies or
+ * signals it requested.
+ *
+ * Only EPOLLIN of a throttled sender is deselected, so a sender that hangs up
+ * is still noticed and released. A receiver that does not drain its queue
+ * within the throttle timeout is considered stuck and disconnected, which
+ * releases its senders as well. This way, a receiver cannot park its senders
+ * forever, nor can two peers that throttle each other deadlock.
+ */
+static void peer_unthrottle(Peer *sender) {
+        c_list_unlink_init(&sender->throttle_link);
+        dispatch_file_select(&sender->connection.socket_file, EPOLLIN);
+        dispatch_file_schedule(&sender->connection.socket_file, EPOLLIN);
+}
+
+static int peer_throttle(Peer *receiver, uint64_t sender_id) {
+        Bus *bus = receiver->bus;
+        Peer *sender;
+        int r;
+
+        if (_c_likely_(!bus->throttle_high || socket_get_queued(&receiver->connection.socket) <= bus->throttle_high))
+                return 0;
+
+        sender = peer_registry_find_peer(&bus->peers, sender_id);
+        if (!sender || sender == receiver || sender->user != receiver->user || peer_is_throttled(sender))
+                return 0;
+
+        if (c_list_is_empty(&receiver->throttled_senders) && bus->throttle_timeout) {
+                r = timer_arm(&receiver->throttle_timeout, bus->throttle_timeout);
+                if (r)
+                        return error_fold(r);
+        }
+
+        c_list_link_tail(&receiver->throttled_senders, &sender->throttle_link);
+        dispatch_file_deselect(&sender->connection.socket_file, EPOLLIN);
+        return 0;
+}
+
+static void peer_release_throttled(Peer *receiver) {
+        Peer *sender;
+
+        timer_disarm(&receiver->throttle_timeout);
+
+        while ((sender = c_list_first_entry(&receiver->throttled_senders, Peer, throttle_link)))
+                peer_unthrottle(sender);
+}
+
+static int peer_throttle_timeout(Timer *timer) {
+        Peer *receiver = c_container_of(timer, Peer, throttle_timeout);
+
+        /* all its senders hung up in the meantime */
+        if (c_list_is_empty(&receiver->throttled_senders))
+                return 0;
+
+        fprintf(stderr, "Peer :1.%llu did not drain its queue in time, disconnecting.\n",
+                (unsigned long long)receiver->id);
+
+        /*
+         * Treat the receiver as if it hung up: its input is discarded right
+         * away, and the pending EPOLLHUP discards its output. The regular
+         * teardown then happens on its next dispatch.
+         */
+        connection_close(&receiver->connection);
+        peer_release_throttled(receiver);
+
+        dispatch_file_select(&receiver->connection.socket_file, EPOLLHUP);
+        dispatch_file_schedule(&receiver->connection.socket_file, EPOLLHUP);
+        return 0;
+}
+
 int peer_dispatch(DispatchFile *file) {
         Peer *peer = c_container_of(file, Peer, connection.socket_file);
         static const uint32_t interest[] = { EPOLLIN | EPOLLHUP, EPOLLOUT };
         size_t i;
         int r;
 
+        /* a throttled sender that hung up is drained, so it sees EOF */
+        if (_c_unlikely_(peer_is_throttled(peer) && (dispatch_file_events(file) & EPOLLHUP)))
+                peer_unthrottle(peer);
+
         /*
          * Usually, we would just call
          * peer_dispatch_connection(peer, dispatch_file_events(file)) here.
@@ -103,6 +228,24 @@ int peer_dispatch(DispatchFile *file) {
                         break;
         }
 
+        if (!r && peer_is_monitor(peer))
+                r = peer_flush_monitor(peer);
+
+        /*
+         * Sample the output backlog left after each dispatch of a peer with
+         * queued data, in bytes, buffers and unreleased FDs. The exact
+         * per-peer depth is tracked on the socket itself.
+         */
+        if (!r && socket_has_output(&peer->connection.socket)) {
+                metrics_sample_value(&peer->bus->queue_metrics[BUS_QUEUE_BYTES], socket_get_queued(&peer->connection.socket));
+                metrics_sample_value(&peer->bus->queue_metrics[BUS_QUEUE_BUFFERS], socket_get_buffers(&peer->connection.socket));
+                metrics_sample_value(&peer->bus->queue_metrics[BUS_QUEUE_FDS], socket_get_fds(&peer->connection.socket));
+        }
+
+        if (!r && !c_list_is_empty(&peer->throttled_senders) &&
+            socket_get_queued(&peer->connection.socket) <= peer->bus->throttle_low)
+                peer_release_throttled(peer);
+
         if (r) {
                 if (r == PEER_E_EOF) {
                         r = driver_goodbye(peer, false);
@@ -120,6 +263,9 @@ int peer_dispatch(DispatchFile *file) {
                         return error_fold(r);
                 }
 
+                /* no more messages are queued on a peer that is torn down */
+                peer_release_throttled(peer);
+
                 if (!connection_is_running(&peer->connection))
                         peer_free(peer);
         }
@@ -194,9 +340,14 @@ int peer_new_with_fd(Peer **peerp,
         peer->charges[2] = (UserCharge)USER_CHARGE_INIT;
         peer->owned_names = (NameOwner)NAME_OWNER_INIT;
         peer->matches = (MatchRegistry)MATCH_REGISTRY_INIT(peer->matches);
+        peer->matches.seed = bus->names.seed;
         peer->owned_matches = (MatchOwner)MATCH_OWNER_INIT;
         peer->replies_outgoing = (ReplyRegistry)REPLY_REGISTRY_INIT;
         peer->owned_replies = (ReplyOwner)REPLY_OWNER_INIT(peer->owned_replies);
+        peer->monitor_ring = (MonitorRing)MONITOR_RING_NULL;
+        peer->throttled_senders = (CList)C_LIST_INIT(peer->throttled_senders);
+        peer->throttle_link = (CList)C_LIST_INIT(peer->throttle_link);
+        timer_init(&peer->throttle_timeout, &bus->timers, peer_throttle_timeout);
 
         r = bus_selinux_id_init(&peer->sid, peer->seclabel);
         if (r)
@@ -230,6 +381,7 @@ int peer_new_with_fd(Peer **peerp,
                 return error_fold(r);
 
         peer->id = bus->peers.ids++;
+        message_sender_init(&peer->sender, peer->id);
         slot = c_rbtree_find_slot(&bus->peers.peer_tree, peer_compare, &peer->id, &parent);
         assert(slot); /* peer->id is guaranteed to be unique */
         c_rbtree_add(&bus->peers.peer_tree, parent, slot, &peer->registry_node);
@@ -254,6 +406,17 @@ Peer *peer_free(Peer *peer) {
 
         fd = peer->connection.socket.fd;
 
+        peer_release_throttled(peer);
+        c_list_unlink(&peer->throttle_link);
+        timer_deinit(&peer->throttle_timeout);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(peer->destinations); ++i)
+                name_unref(peer->destinations[i].name);
+
+        if (peer->monitor)
+                --peer->bus->n_monitors;
+        monitor_ring_deinit(&peer->monitor_ring);
+
         reply_owner_deinit(&peer->owned_replies);
         reply_registry_deinit(&peer->replies_outgoing);
         match_owner_deinit(&peer->owned_matches);
@@ -282,6 +445,7 @@ void peer_register(Peer *peer) {
         assert(!peer->monitor);
 
         peer->registered = true;
+        ++peer->bus->peers.generation;
 }
 
 void peer_unregister(Peer *peer) {
@@ -289,6 +453,7 @@ void peer_unregister(Peer *peer) {
         assert(!peer->monitor);
 
         peer->registered = false;
+        ++peer->bus->peers.generation;
 }
 
 bool peer_is_privileged(Peer *peer) {
@@ -392,7 +557,7 @@ static int peer_link_match(Peer *peer, MatchRule *rule, bool monitor) {
                                  * also no reason to ever guess the ID of a
                                  * forthcoming peer.
                                  */
-                                rule->keys.filter.sender = addr.id;
+                                rule->keys.sender_id = addr.id;
                                 match_rule_link(rule, &peer->bus->wildcard_matches, monitor);
                         } else {
                                 /*
@@ -486,6 +651,10 @@ int peer_become_monitor(Peer *peer, MatchOwner *owned_matches) {
         assert(!peer->monitor);
         assert(c_rbtree_is_empty(&peer->owned_matches.rule_tree));
 
+        r = monitor_ring_init(&peer->monitor_ring, peer->user);
+        if (r)
+                return error_fold(r);
+
         /* only fatal errors may occur after this point */
         peer->owned_matches = *owned_matches;
         *owned_matches = (MatchOwner)MATCH_OWNER_INIT;
@@ -506,6 +675,7 @@ int peer_become_monitor(Peer *peer, MatchOwner *owned_matches) {
                 return poison;
 
         peer->monitor = true;
+        ++peer->bus->n_monitors;
 
         return 0;
 }
@@ -570,7 +740,18 @@ int peer_queue_call(PolicySnapshot *sender_policy, NameSet *sender_names, MatchR
                 return error_fold(r);
         }
 
-        r = connection_queue(&receiver->connection, sender_user, message);
+        /*
+         * Arm the timeout before the call is queued, as queueing cannot be
+         * undone. If queueing fails, the slot and its timer are dropped.
+         */
+        if (slot && receiver->bus->reply_timeout) {
+                timer_init(&slot->timeout, &receiver->bus->timers, driver_reply_timeout);
+                r = timer_arm(&slot->timeout, receiver->bus->reply_timeout);
+                if (r)
+                        return error_fold(r);
+        }
+
+        r = connection_queue(&receiver->connection, sender_user, &receiver->bus->latency[BUS_LATENCY_UNICAST], message);
         if (r) {
                 if (CONNECTION_E_QUOTA)
                         return PEER_E_QUOTA;
@@ -578,7 +759,53 @@ int peer_queue_call(PolicySnapshot *sender_policy, NameSet *sender_names, MatchR
                         return error_fold(r);
         }
 
+        /* the call was queued, the slot stays until the reply arrives */
         slot = NULL;
+
+        r = peer_throttle(receiver, sender_id);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+/**
+ * peer_queue_monitor() - queue a message on a monitor
+ * @receiver:           monitor to queue on
+ * @message:            message to queue
+ *
+ * Monitors see a copy of every message they match, so a slow monitor must
+ * neither stall the bus nor be disconnected for falling behind. If the
+ * message does not fit the outgoing socket queue of @receiver, a reference to
+ * it is parked in a fixed-size ring and flushed whenever the monitor makes
+ * progress. Parked messages are charged on the user of @receiver. Once the
+ * ring is full or out of quota, the oldest messages are dropped and accounted
+ * in the drop counter of the ring, which is logged when the monitor catches
+ * up.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int peer_queue_monitor(Peer *receiver, Message *message) {
+        int r;
+
+        /* driver messages are stamped on first use, see driver_send_unicast() */
+        connection_stamp(&receiver->connection, message);
+
+        if (monitor_ring_is_empty(&receiver->monitor_ring)) {
+                r = connection_queue(&receiver->connection, NULL, &receiver->bus->latency[BUS_LATENCY_MONITOR], message);
+                if (r != CONNECTION_E_QUOTA)
+                        return error_fold(r);
+
+                if (!socket_has_output(&receiver->connection.socket)) {
+                        ++receiver->monitor_ring.n_dropped;
+                        return 0;
+                }
+        }
+
+        r = monitor_ring_push(&receiver->monitor_ring, message);
+        if (r)
+                return error_fold(r);
+
         return 0;
 }
 
@@ -598,7 +825,7 @@ int peer_queue_reply(Peer *sender, const char *destination, uint32_t reply_seria
 
         receiver = c_container_of(slot->owner, Peer, owned_replies);
 
-        r = connection_queue(&receiver->connection, NULL, message);
+        r = connection_queue(&receiver->connection, NULL, &receiver->bus->latency[BUS_LATENCY_UNICAST], message);
         if (r) {
                 if (r == CONNECTION_E_QUOTA)
                         connection_shutdown(&receiver->connection);
@@ -609,10 +836,52 @@ int peer_queue_reply(Peer *sender, const char *destination, uint32_t reply_seria
         return 0;
 }
 
+/**
+ * peer_filter_set_args() - fill in match filter arguments
+ * @filter:                     filter to operate on
+ * @message:                    message to take the arguments from
+ *
+ * This copies the string and object-path arguments cached by
+ * message_parse_body() into @filter, so they can be matched against argument
+ * keys of match rules. The argument mask of @filter is updated accordingly,
+ * once per message, so rules with argument keys for absent slots are rejected
+ * without looking at their keys.
+ */
+void peer_filter_set_args(MatchFilter *filter, Message *message) {
+        static_assert(C_ARRAY_SIZE(filter->args) == 64, "Argument mask size mismatch");
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(filter->args); ++i) {
+                if (message->metadata.args[i].element == 's') {
+                        filter->args[i] = message->metadata.args[i].value;
+                        filter->argpaths[i] = message->metadata.args[i].value;
+                        filter->args_mask |= UINT64_C(1) << i;
+                } else if (message->metadata.args[i].element == 'o') {
+                        filter->argpaths[i] = message->metadata.args[i].value;
+                        filter->args_mask |= UINT64_C(1) << i;
+                }
+        }
+}
+
 static int peer_broadcast_to_matches(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *matches, MatchFilter *filter, uint64_t transaction_id, Message *message) {
         MatchRule *rule;
         int r;
 
+        /*
+         * If the body of the message was not parsed, yet, we defer it until
+         * we hit a registry with argument matches. Invalid bodies are only
+         * possible if body validation is disabled, in which case we simply
+         * treat them as if they had no arguments.
+         * Messages from the driver are not parsed at all, but the caller
+         * provides a filter for them.
+         */
+        if (matches->n_arg_rules && message->parsed && !message->parsed_body) {
+                r = message_parse_body(message);
+                if (r < 0)
+                        return error_fold(r);
+
+                peer_filter_set_args(filter, message);
+        }
+
         for (rule = match_rule_next_match(matches, NULL, filter); rule; rule = match_rule_next_match(matches, rule, filter)) {
                 Peer *receiver = c_container_of(rule->owner, Peer, owned_matches);
                 NameSet receiver_names = NAME_SET_INIT_FROM_OWNER(&receiver->owned_names);
@@ -654,7 +923,10 @@ static int peer_broadcast_to_matches(PolicySnapshot *sender_policy, NameSet *sen
                         return error_fold(r);
                 }
 
-                r = connection_queue(&receiver->connection, NULL, message);
+                /* driver signals are stamped on first use, see driver_send_unicast() */
+                connection_stamp(&receiver->connection, message);
+
+                r = connection_queue(&receiver->connection, NULL, &receiver->bus->latency[BUS_LATENCY_BROADCAST], message);
                 if (r) {
                         if (r == CONNECTION_E_QUOTA)
                                 connection_shutdown(&receiver->connection);
@@ -680,14 +952,8 @@ int peer_broadcast(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRe
                 filter->member = message->metadata.fields.member,
                 filter->path = message->metadata.fields.path;
 
-                for (size_t i = 0; i < 64; ++i) {
-                        if (message->metadata.args[i].element == 's') {
-                                filter->args[i] = message->metadata.args[i].value;
-                                filter->argpaths[i] = message->metadata.args[i].value;
-                        } else if (message->metadata.args[i].element == 'o') {
-                                filter->argpaths[i] = message->metadata.args[i].value;
-                        }
-                }
+                if (message->parsed_body)
+                        peer_filter_set_args(filter, message);
         }
 
         /* start a new transaction, to avoid duplicates */
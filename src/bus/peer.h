@@ -9,15 +9,19 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include "bus/match.h"
+#include "bus/monitor.h"
 #include "bus/name.h"
 #include "bus/policy.h"
 #include "bus/reply.h"
 #include "dbus/connection.h"
+#include "dbus/message.h"
+#include "util/timer.h"
 
 typedef struct Bus Bus;
 typedef struct BusSELinuxID BusSELinuxID;
 typedef struct DispatchContext DispatchContext;
 typedef struct Peer Peer;
+typedef struct PeerDestination PeerDestination;
 typedef struct PeerRegistry PeerRegistry;
 typedef struct Socket Socket;
 typedef struct User User;
@@ -51,6 +55,13 @@ enum {
         PEER_E_UNEXPECTED_REPLY,
 };
 
+#define PEER_DESTINATION_CACHE_SIZE 4
+
+struct PeerDestination {
+        Name *name;
+        size_t n_name;
+};
+
 struct Peer {
         Bus *bus;
         User *user;
@@ -61,6 +72,7 @@ struct Peer {
         UserCharge charges[3];
 
         uint64_t id;
+        MessageSender sender;
         CRBNode registry_node;
 
         Connection connection;
@@ -74,12 +86,22 @@ struct Peer {
         ReplyRegistry replies_outgoing;
         ReplyOwner owned_replies;
 
+        PeerDestination destinations[PEER_DESTINATION_CACHE_SIZE];
+        size_t i_destination;
+
+        MonitorRing monitor_ring;
+
+        CList throttled_senders;
+        CList throttle_link;
+        Timer throttle_timeout;
+
         uint64_t transaction_id;
 };
 
 struct PeerRegistry {
         CRBTree peer_tree;
         uint64_t ids;
+        uint64_t generation;
 };
 
 #define PEER_REGISTRY_INIT {}
@@ -105,7 +127,9 @@ int peer_become_monitor(Peer *peer, MatchOwner *owner);
 void peer_flush_matches(Peer *peer);
 
 int peer_queue_call(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, ReplyOwner *sender_replies, User *sender_user, uint64_t sender_id, Peer *receiver, Message *message);
+int peer_queue_monitor(Peer *receiver, Message *message);
 int peer_queue_reply(Peer *sender, const char *destination, uint32_t reply_serial, Message *message);
+void peer_filter_set_args(MatchFilter *filter, Message *message);
 int peer_broadcast(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, uint64_t sender_id, Peer *destination, Bus *bus, MatchFilter *filter, Message *message);
 
 void peer_registry_init(PeerRegistry *registry);
@@ -121,4 +145,8 @@ static inline bool peer_is_monitor(Peer *peer) {
         return peer->monitor;
 }
 
+static inline bool peer_is_throttled(Peer *peer) {
+        return c_list_is_linked(&peer->throttle_link);
+}
+
 C_DEFINE_CLEANUP(Peer *, peer_free);
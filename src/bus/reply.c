@@ -56,6 +56,7 @@ int reply_slot_new(ReplySlot **replyp, ReplyRegistry *registry, ReplyOwner *owne
         reply->charge = (UserCharge)USER_CHARGE_INIT;
         reply->registry_node = (CRBNode)C_RBNODE_INIT(reply->registry_node);
         reply->owner_link = (CList)C_LIST_INIT(reply->owner_link);
+        reply->timeout = (Timer)TIMER_NULL(reply->timeout);
         reply->id = id;
         reply->serial = serial;
 
@@ -75,6 +76,7 @@ ReplySlot *reply_slot_free(ReplySlot *slot) {
         if (!slot)
                 return NULL;
 
+        timer_deinit(&slot->timeout);
         user_charge_deinit(&slot->charge);
         c_list_unlink(&slot->owner_link);
         c_rbtree_remove_init(&slot->registry->reply_tree, &slot->registry_node);
@@ -8,6 +8,7 @@
 #include <c-macro.h>
 #include <c-rbtree.h>
 #include <stdlib.h>
+#include "util/timer.h"
 #include "util/user.h"
 
 typedef struct ReplySlot ReplySlot;
@@ -29,6 +30,7 @@ struct ReplySlot {
         uint32_t serial;
         CRBNode registry_node;
         CList owner_link;
+        Timer timeout;
 };
 
 struct ReplyRegistry {
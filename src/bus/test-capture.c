@@ -0,0 +1,231 @@
+/*
+ * Test Traffic Capture
+ */
+
+#include <c-macro.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "bus/capture.h"
+#include "dbus/message.h"
+#include "util/dispatch.h"
+
+static Message *test_new_message(size_t n_data) {
+        MessageHeader *header;
+        Message *message;
+        int r;
+
+        header = calloc(1, n_data);
+        assert(header);
+
+        header->endian = (__BYTE_ORDER == __BIG_ENDIAN) ? 'B' : 'l';
+        header->version = 1;
+
+        r = message_new_outgoing(&message, header, n_data);
+        assert(!r);
+
+        return message;
+}
+
+static void test_invalid(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext dispatcher = DISPATCH_CONTEXT_NULL(dispatcher);
+        Capture capture;
+        int r, fd, p[2];
+
+        r = dispatch_context_init(&dispatcher);
+        assert(!r);
+
+        /* regular files would block the broker */
+        fd = memfd_create("capture", MFD_CLOEXEC);
+        assert(fd >= 0);
+
+        r = capture_init(&capture, &dispatcher, fd);
+        assert(r == CAPTURE_E_INVALID_FD);
+        assert(!capture_is_running(&capture));
+        close(fd);
+
+        /* the read-end of a pipe cannot be written to */
+        r = pipe2(p, O_CLOEXEC);
+        assert(!r);
+
+        r = capture_init(&capture, &dispatcher, p[0]);
+        assert(r == CAPTURE_E_INVALID_FD);
+        assert(!capture_is_running(&capture));
+        close(p[1]);
+        close(p[0]);
+}
+
+static void test_pipe(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext dispatcher = DISPATCH_CONTEXT_NULL(dispatcher);
+        Capture capture;
+        Message *message;
+        uint32_t buffer[64];
+        ssize_t l;
+        int r, p[2];
+
+        r = dispatch_context_init(&dispatcher);
+        assert(!r);
+
+        r = pipe2(p, O_CLOEXEC);
+        assert(!r);
+
+        r = capture_init(&capture, &dispatcher, p[1]);
+        assert(!r);
+        assert(capture_is_running(&capture));
+
+        /* the file header is flushed once the pipe is writable */
+        r = dispatch_context_dispatch(&dispatcher);
+        assert(!r);
+        assert(!capture.n_buffer);
+
+        message = test_new_message(sizeof(MessageHeader) + 8);
+        capture_message(&capture, message);
+        assert(capture.n_captured == 1);
+        assert(!capture.n_buffer);
+
+        /* 24 bytes file header, 16 bytes record header, and the message */
+        l = read(p[0], buffer, sizeof(buffer));
+        assert(l == 24 + 16 + sizeof(MessageHeader) + 8);
+        assert(buffer[0] == 0xa1b2c3d4U);
+        assert(buffer[6 + 2] == sizeof(MessageHeader) + 8);
+        assert(buffer[6 + 3] == sizeof(MessageHeader) + 8);
+        assert(!memcmp(&buffer[10], message->data, sizeof(MessageHeader) + 8));
+
+        capture_deinit(&capture);
+        assert(!capture_is_running(&capture));
+
+        message_unref(message);
+        close(p[0]);
+}
+
+static void test_drop(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext dispatcher = DISPATCH_CONTEXT_NULL(dispatcher);
+        Capture capture;
+        Message *message;
+        size_t i;
+        int r, p[2];
+
+        r = dispatch_context_init(&dispatcher);
+        assert(!r);
+
+        r = pipe2(p, O_CLOEXEC);
+        assert(!r);
+
+        r = capture_init(&capture, &dispatcher, p[1]);
+        assert(!r);
+
+        r = dispatch_context_dispatch(&dispatcher);
+        assert(!r);
+
+        /*
+         * Nobody reads from the pipe, so the records are buffered until the
+         * buffer limit is reached. Further records are dropped, while the
+         * capture keeps running.
+         */
+        message = test_new_message(CAPTURE_BUFFER_MAX / 4);
+        for (i = 0; i < 8; ++i)
+                capture_message(&capture, message);
+
+        assert(capture_is_running(&capture));
+        assert(capture.n_captured == 8);
+        assert(capture.n_dropped > 0);
+        assert(capture.n_buffer <= CAPTURE_BUFFER_MAX);
+
+        capture_deinit(&capture);
+        message_unref(message);
+        close(p[0]);
+}
+
+static void test_hangup(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext dispatcher = DISPATCH_CONTEXT_NULL(dispatcher);
+        Capture capture;
+        Message *message;
+        int r, p[2], s[2];
+
+        r = dispatch_context_init(&dispatcher);
+        assert(!r);
+
+        message = test_new_message(sizeof(MessageHeader));
+
+        /* a pipe without readers stops the capture */
+        r = pipe2(p, O_CLOEXEC);
+        assert(!r);
+
+        r = capture_init(&capture, &dispatcher, p[1]);
+        assert(!r);
+
+        close(p[0]);
+
+        r = dispatch_context_dispatch(&dispatcher);
+        assert(!r);
+        assert(!capture_is_running(&capture));
+
+        capture_message(&capture, message);
+        assert(!capture.n_captured);
+
+        /* so does a socket without a peer */
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s);
+        assert(!r);
+
+        r = capture_init(&capture, &dispatcher, s[0]);
+        assert(!r);
+
+        r = dispatch_context_dispatch(&dispatcher);
+        assert(!r);
+        assert(capture_is_running(&capture));
+
+        close(s[1]);
+
+        capture_message(&capture, message);
+        assert(!capture_is_running(&capture));
+
+        message_unref(message);
+}
+
+static void test_new(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext dispatcher = DISPATCH_CONTEXT_NULL(dispatcher);
+        Capture *capture1 = NULL, *capture2 = NULL;
+        int r, fd, p[2];
+
+        r = dispatch_context_init(&dispatcher);
+        assert(!r);
+
+        r = pipe2(p, O_CLOEXEC);
+        assert(!r);
+
+        r = capture_new(&capture1, &dispatcher, p[1]);
+        assert(!r);
+        assert(capture_is_running(capture1));
+
+        /* a failed setup leaves the output argument and the fd untouched */
+        fd = memfd_create("capture", MFD_CLOEXEC);
+        assert(fd >= 0);
+
+        r = capture_new(&capture2, &dispatcher, fd);
+        assert(r == CAPTURE_E_INVALID_FD);
+        assert(!capture2);
+        assert(fcntl(fd, F_GETFD) >= 0);
+        close(fd);
+
+        capture1 = capture_free(capture1);
+        assert(!capture1);
+        close(p[0]);
+}
+
+int main(int argc, char **argv) {
+        /* as in the broker, rely on EPIPE rather than SIGPIPE */
+        signal(SIGPIPE, SIG_IGN);
+
+        test_invalid();
+        test_pipe();
+        test_drop();
+        test_hangup();
+        test_new();
+
+        return 0;
+}
@@ -3,11 +3,14 @@
  */
 
 #include <c-macro.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "bus/match.h"
 #include "dbus/protocol.h"
+#include "util/siphash.h"
+#include "util/user.h"
 
 static void test_arg(MatchOwner *owner,
                      const char *match,
@@ -17,7 +20,9 @@ static void test_arg(MatchOwner *owner,
 
         r = match_owner_ref_rule(owner, &rule, NULL, match);
         assert(r == 0);
-        assert(strcmp(rule->keys.filter.args[0], arg0) == 0);
+        assert(rule->keys.n_args == 1);
+        assert(rule->keys.args[0].index == 0 && !rule->keys.args[0].path);
+        assert(strcmp(rule->keys.args[0].value, arg0) == 0);
 }
 
 static void test_parse_key(MatchOwner *owner) {
@@ -37,10 +42,12 @@ static void test_args(MatchOwner *owner,
 
         r = match_owner_ref_rule(owner,  &rule, NULL, match);
         assert(r == 0);
-        assert(strcmp(rule->keys.filter.args[0], arg0) == 0);
-        assert(strcmp(rule->keys.filter.args[1], arg1) == 0);
-        assert(strcmp(rule->keys.filter.args[2], arg2) == 0);
-        assert(strcmp(rule->keys.filter.args[3], arg3) == 0);
+        assert(rule->keys.n_args == 4);
+        assert(rule->keys.args_mask == 0xf);
+        assert(strcmp(rule->keys.args[0].value, arg0) == 0);
+        assert(strcmp(rule->keys.args[1].value, arg1) == 0);
+        assert(strcmp(rule->keys.args[2].value, arg2) == 0);
+        assert(strcmp(rule->keys.args[3].value, arg3) == 0);
 }
 
 static void test_parse_value(MatchOwner *owner) {
@@ -194,6 +201,7 @@ static void test_individual_matches(void) {
         filter = (MatchFilter)MATCH_FILTER_INIT;
         assert(!test_match("arg0=/com/example/foo/", &filter));
         filter.args[0] = "/com/example/foo/";
+        filter.args_mask = 1;
         assert(test_match("arg0=/com/example/foo/", &filter));
         assert(!test_match("arg0=/com/example/foo/bar", &filter));
         assert(!test_match("arg0=/com/example/foobar", &filter));
@@ -215,6 +223,7 @@ static void test_individual_matches(void) {
         filter = (MatchFilter)MATCH_FILTER_INIT;
         assert(!test_match("arg0path=/com/example/foo/", &filter));
         filter.argpaths[0] = "/com/example/foo/";
+        filter.args_mask = 1;
         assert(test_match("arg0path=/com/example/foo/", &filter));
         assert(test_match("arg0path=/com/example/foo/bar", &filter));
         assert(!test_match("arg0path=/com/example/foobar", &filter));
@@ -225,6 +234,7 @@ static void test_individual_matches(void) {
         filter = (MatchFilter)MATCH_FILTER_INIT;
         assert(!test_match("arg0path=/com/example/foo", &filter));
         filter.argpaths[0] = "/com/example/foo";
+        filter.args_mask = 1;
         assert(test_match("arg0path=/com/example/foo", &filter));
         assert(!test_match("arg0path=/com/example/foo/bar", &filter));
         assert(!test_match("arg0path=/com/example/foobar", &filter));
@@ -235,12 +245,41 @@ static void test_individual_matches(void) {
         filter = (MatchFilter)MATCH_FILTER_INIT;
         assert(!test_match("arg0namespace=com.example.foo", &filter));
         filter.args[0] = "com.example.foo";
+        filter.args_mask = 1;
         assert(test_match("arg0namespace=com.example.foo", &filter));
         assert(test_match("arg0namespace=com.example.foo.bar", &filter));
         assert(!test_match("arg0namespace=com.example.foobar", &filter));
         assert(!test_match("arg0namespace=com.example", &filter));
 }
 
+static void test_args_mask(void) {
+        MatchFilter filter = MATCH_FILTER_INIT;
+
+        /*
+         * Rules with argument keys must only match filters that have those
+         * arguments set, as announced by the argument mask. Verify that rules
+         * for absent slots are rejected, and that the mask is trusted over
+         * the argument arrays.
+         */
+
+        filter.args[0] = "foo";
+        filter.args[2] = "bar";
+        filter.args_mask = 0x5;
+        assert(test_match("arg0=foo", &filter));
+        assert(test_match("arg2=bar", &filter));
+        assert(test_match("arg0=foo,arg2=bar", &filter));
+        assert(!test_match("arg1=foo", &filter));
+        assert(!test_match("arg0=foo,arg1=foo", &filter));
+        assert(!test_match("arg63=foo", &filter));
+
+        filter.args[63] = "foo";
+        filter.args_mask |= UINT64_C(1) << 63;
+        assert(test_match("arg63=foo", &filter));
+
+        filter.args_mask = 0x1;
+        assert(!test_match("arg2=bar", &filter));
+}
+
 static void test_iterator(void) {
         MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
         MatchFilter filter = MATCH_FILTER_INIT;
@@ -290,6 +329,158 @@ static void test_iterator(void) {
 
 }
 
+static void test_index(const uint8_t *seed) {
+        MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
+        MatchFilter filter = MATCH_FILTER_INIT;
+        MatchRule *rule, *rules[64], *wildcard;
+        MatchOwner owners[64], owner;
+        char buffer[64];
+        size_t i, n;
+        int r;
+
+        /*
+         * Link enough rules with member keys to get them indexed, plus one
+         * rule without member key. Verify that iteration yields exactly the
+         * rules matching the member, plus the wildcard, both before and after
+         * the index is created.
+         */
+
+        registry.seed = seed;
+        match_owner_init(&owner);
+
+        r = match_owner_ref_rule(&owner, &wildcard, NULL, "interface=org.example");
+        assert(!r);
+        match_rule_link(wildcard, &registry, false);
+
+        for (i = 0; i < C_ARRAY_SIZE(rules); ++i) {
+                match_owner_init(&owners[i]);
+                sprintf(buffer, "interface=org.example,member=Member%zu", i % 16);
+                r = match_owner_ref_rule(&owners[i], &rules[i], NULL, buffer);
+                assert(!r);
+                match_rule_link(rules[i], &registry, false);
+
+                filter.interface = "org.example";
+                filter.member = "Member3";
+
+                n = 0;
+                for (rule = match_rule_next_match(&registry, NULL, &filter); rule; rule = match_rule_next_match(&registry, rule, &filter)) {
+                        assert(rule == wildcard || !strcmp(rule->keys.member, "Member3"));
+                        ++n;
+                }
+                assert(n == 1 + (i + 13) / 16);
+        }
+
+        assert(registry.n_member_buckets);
+        assert(registry.n_rules == C_ARRAY_SIZE(rules) + 1);
+
+        filter.member = NULL;
+        rule = match_rule_next_match(&registry, NULL, &filter);
+        assert(rule == wildcard);
+        assert(!match_rule_next_match(&registry, rule, &filter));
+
+        match_registry_flush(&registry);
+        assert(!registry.n_rules);
+        assert(!registry.n_member_rules);
+
+        for (i = 0; i < C_ARRAY_SIZE(rules); ++i) {
+                match_rule_user_unref(rules[i]);
+                match_owner_deinit(&owners[i]);
+        }
+        match_rule_user_unref(wildcard);
+        match_owner_deinit(&owner);
+        match_registry_deinit(&registry);
+}
+
+static void test_arg_rules(void) {
+        MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
+        MatchRule *plain, *arg, *argpath, *namespace, *monitor;
+        MatchOwner owner;
+        int r;
+
+        /*
+         * Verify that the registry counts linked rules with argument keys, for
+         * regular and monitor rules alike, and that freeing a linked rule
+         * drops it from the counter.
+         */
+
+        match_owner_init(&owner);
+
+        r = match_owner_ref_rule(&owner, &plain, NULL, "member=Foo");
+        assert(!r);
+        r = match_owner_ref_rule(&owner, &arg, NULL, "arg3=foo");
+        assert(!r);
+        r = match_owner_ref_rule(&owner, &argpath, NULL, "arg0path=/foo/");
+        assert(!r);
+        r = match_owner_ref_rule(&owner, &namespace, NULL, "arg0namespace=com.example");
+        assert(!r);
+        r = match_owner_ref_rule(&owner, &monitor, NULL, "member=Bar,arg1=bar");
+        assert(!r);
+
+        match_rule_link(plain, &registry, false);
+        assert(!registry.n_arg_rules);
+
+        match_rule_link(arg, &registry, false);
+        match_rule_link(argpath, &registry, false);
+        match_rule_link(namespace, &registry, false);
+        match_rule_link(monitor, &registry, true);
+        assert(registry.n_arg_rules == 4);
+
+        /* linking twice must not count twice */
+        match_rule_link(arg, &registry, false);
+        assert(registry.n_arg_rules == 4);
+
+        match_rule_unlink(argpath);
+        match_rule_unlink(argpath);
+        assert(registry.n_arg_rules == 3);
+
+        /* drop the last reference while still linked */
+        match_rule_user_unref(monitor);
+        match_rule_user_unref(arg);
+        assert(registry.n_arg_rules == 1);
+
+        match_registry_flush(&registry);
+        assert(!registry.n_arg_rules);
+
+        match_rule_user_unref(namespace);
+        match_rule_user_unref(argpath);
+        match_rule_user_unref(plain);
+        match_owner_deinit(&owner);
+        match_registry_deinit(&registry);
+}
+
+static void test_charge(void) {
+        static const char *string = "arg0=foo,arg3path=/bar/";
+        MatchRule *rule;
+        MatchOwner owner;
+        UserRegistry registry;
+        User *user;
+        int r;
+
+        /* verify the argument array is charged along with the rule */
+
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ 1024 * 1024, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &user, 1);
+        assert(!r);
+
+        match_owner_init(&owner);
+
+        r = match_owner_ref_rule(&owner, &rule, user, string);
+        assert(!r);
+        assert(rule->keys.n_args == 2);
+        assert(user->slots[USER_SLOT_BYTES].n == 1024 * 1024 - sizeof(*rule) - strlen(string) - 1 - 2 * sizeof(MatchArg));
+        assert(user->slots[USER_SLOT_MATCHES].n == 1024 - 1);
+
+        match_rule_user_unref(rule);
+        assert(user->slots[USER_SLOT_BYTES].n == 1024 * 1024);
+        assert(user->slots[USER_SLOT_MATCHES].n == 1024);
+
+        match_owner_deinit(&owner);
+        user_unref(user);
+        user_registry_deinit(&registry);
+}
+
 int main(int argc, char **argv) {
         MatchOwner owner = {};
 
@@ -300,8 +491,13 @@ int main(int argc, char **argv) {
         test_validate_keys(&owner);
 
         test_individual_matches();
+        test_args_mask();
 
         test_iterator();
+        test_index(NULL);
+        test_index((const uint8_t[SIPHASH_KEY_SIZE]){ 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef });
+        test_arg_rules();
+        test_charge();
 
         match_owner_deinit(&owner);
         return 0;
@@ -0,0 +1,197 @@
+/*
+ * Test Monitor Ring
+ */
+
+#include <c-macro.h>
+#include <endian.h>
+#include <stdlib.h>
+#include "bus/monitor.h"
+#include "dbus/message.h"
+#include "util/user.h"
+
+#define TEST_MESSAGE_SIZE (sizeof(Message) + sizeof(MessageHeader))
+
+static Message *test_new_message(void) {
+        MessageHeader *header;
+        Message *message;
+        int r;
+
+        header = calloc(1, sizeof(*header));
+        assert(header);
+
+        header->endian = (__BYTE_ORDER == __BIG_ENDIAN) ? 'B' : 'l';
+        header->version = 1;
+
+        r = message_new_outgoing(&message, header, sizeof(*header));
+        assert(!r);
+
+        return message;
+}
+
+static void test_basic(void) {
+        UserRegistry registry;
+        MonitorRing ring;
+        Message *message1, *message2;
+        User *user;
+        int r;
+
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ 1024 * 1024, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &user, 1);
+        assert(!r);
+
+        r = monitor_ring_init(&ring, user);
+        assert(!r);
+        assert(monitor_ring_is_empty(&ring));
+        assert(!monitor_ring_first(&ring));
+
+        message1 = test_new_message();
+        message2 = test_new_message();
+
+        r = monitor_ring_push(&ring, message1);
+        assert(!r);
+        r = monitor_ring_push(&ring, message2);
+        assert(!r);
+        assert(user->slots[USER_SLOT_BYTES].n == 1024 * 1024 - 2 * TEST_MESSAGE_SIZE);
+
+        /* entries are returned in order, and release their charge */
+        assert(monitor_ring_first(&ring) == message1);
+        monitor_ring_pop(&ring);
+        assert(monitor_ring_first(&ring) == message2);
+        assert(user->slots[USER_SLOT_BYTES].n == 1024 * 1024 - TEST_MESSAGE_SIZE);
+
+        /* deinit releases the remaining entries */
+        monitor_ring_deinit(&ring);
+        assert(user->slots[USER_SLOT_BYTES].n == 1024 * 1024);
+        assert(!ring.n_dropped);
+
+        message_unref(message2);
+        message_unref(message1);
+        user_unref(user);
+        user_registry_deinit(&registry);
+}
+
+static void test_overflow(void) {
+        UserRegistry registry;
+        MonitorRing ring;
+        Message *messages[MONITOR_RING_SIZE + 1];
+        User *user;
+        size_t i;
+        int r;
+
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ 1024 * 1024, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &user, 1);
+        assert(!r);
+
+        r = monitor_ring_init(&ring, user);
+        assert(!r);
+
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i) {
+                messages[i] = test_new_message();
+                r = monitor_ring_push(&ring, messages[i]);
+                assert(!r);
+        }
+
+        /* the oldest message is dropped once the ring is full */
+        assert(ring.n_entries == MONITOR_RING_SIZE);
+        assert(ring.n_dropped == 1);
+        assert(monitor_ring_first(&ring) == messages[1]);
+        assert(user->slots[USER_SLOT_BYTES].n == 1024 * 1024 - MONITOR_RING_SIZE * TEST_MESSAGE_SIZE);
+
+        monitor_ring_deinit(&ring);
+        assert(user->slots[USER_SLOT_BYTES].n == 1024 * 1024);
+
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i)
+                message_unref(messages[i]);
+        user_unref(user);
+        user_registry_deinit(&registry);
+}
+
+static void test_quota(void) {
+        UserRegistry registry;
+        MonitorRing ring;
+        Message *message1, *message2, *message3;
+        User *user;
+        int r;
+
+        /* room for exactly two messages */
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ 2 * TEST_MESSAGE_SIZE, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &user, 1);
+        assert(!r);
+
+        r = monitor_ring_init(&ring, user);
+        assert(!r);
+
+        message1 = test_new_message();
+        message2 = test_new_message();
+        message3 = test_new_message();
+
+        r = monitor_ring_push(&ring, message1);
+        assert(!r);
+        r = monitor_ring_push(&ring, message2);
+        assert(!r);
+        assert(!user->slots[USER_SLOT_BYTES].n);
+        assert(!ring.n_dropped);
+
+        /* out of quota, the oldest message makes room */
+        r = monitor_ring_push(&ring, message3);
+        assert(!r);
+        assert(ring.n_entries == 2);
+        assert(ring.n_dropped == 1);
+        assert(monitor_ring_first(&ring) == message2);
+
+        monitor_ring_deinit(&ring);
+        assert(user->slots[USER_SLOT_BYTES].n == 2 * TEST_MESSAGE_SIZE);
+
+        message_unref(message3);
+        message_unref(message2);
+        message_unref(message1);
+        user_unref(user);
+        user_registry_deinit(&registry);
+}
+
+static void test_oversized(void) {
+        UserRegistry registry;
+        MonitorRing ring;
+        Message *message;
+        User *user;
+        int r;
+
+        /* a single message exceeds the quota */
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ TEST_MESSAGE_SIZE - 1, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &user, 1);
+        assert(!r);
+
+        r = monitor_ring_init(&ring, user);
+        assert(!r);
+
+        message = test_new_message();
+
+        r = monitor_ring_push(&ring, message);
+        assert(!r);
+        assert(monitor_ring_is_empty(&ring));
+        assert(ring.n_dropped == 1);
+        assert(user->slots[USER_SLOT_BYTES].n == TEST_MESSAGE_SIZE - 1);
+
+        monitor_ring_deinit(&ring);
+
+        message_unref(message);
+        user_unref(user);
+        user_registry_deinit(&registry);
+}
+
+int main(int argc, char **argv) {
+        test_basic();
+        test_overflow();
+        test_quota();
+        test_oversized();
+
+        return 0;
+}
@@ -3,6 +3,7 @@
  */
 
 #include <c-macro.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include "bus/name.h"
@@ -24,22 +25,27 @@ static void test_setup(void) {
         NameRegistry registry;
         NameOwner owner, *o;
         NameChange change;
+        uint64_t generation;
         int r;
 
         name_registry_init(&registry);
         name_owner_init(&owner);
         name_change_init(&change);
 
+        generation = registry.generation;
         r = name_registry_request_name(&registry, &owner, NULL, "foobar", 0, &change);
         assert(!r);
+        assert(registry.generation != generation);
         assert(strcmp(change.name->name, "foobar") == 0);
         assert(change.old_owner == NULL);
         assert(change.new_owner == &owner);
         name_change_deinit(&change);
         o = resolve_owner(&registry, "foobar");
         assert(o == &owner);
+        generation = registry.generation;
         r = name_registry_release_name(&registry, &owner, "foobar", &change);
         assert(r == 0);
+        assert(registry.generation != generation);
         assert(strcmp(change.name->name, "foobar") == 0);
         assert(change.old_owner == &owner);
         assert(change.new_owner == NULL);
@@ -219,9 +225,50 @@ static void test_queue(void) {
         name_registry_deinit(&registry);
 }
 
+static void test_lookup(void) {
+        NameRegistry registry;
+        Name *names[1024];
+        char buffer[64];
+        size_t i;
+        int r;
+
+        /*
+         * Create enough names to force the hash-table to be resized a couple
+         * of times, and verify that all names can still be found.
+         */
+
+        name_registry_init(&registry);
+
+        for (i = 0; i < C_ARRAY_SIZE(names); ++i) {
+                sprintf(buffer, "org.example.name%zu", i);
+                r = name_registry_ref_name(&registry, &names[i], buffer);
+                assert(!r);
+                assert(registry.n_names == i + 1);
+        }
+
+        assert(registry.n_name_buckets >= C_ARRAY_SIZE(names));
+
+        for (i = 0; i < C_ARRAY_SIZE(names); ++i) {
+                sprintf(buffer, "org.example.name%zu", i);
+                assert(name_registry_find_name(&registry, buffer) == names[i]);
+        }
+
+        assert(!name_registry_find_name(&registry, "org.example.name"));
+        assert(!name_registry_find_name(&registry, "org.example.name1024"));
+
+        for (i = 0; i < C_ARRAY_SIZE(names); ++i)
+                name_unref(names[i]);
+
+        assert(!registry.n_names);
+        assert(!name_registry_find_name(&registry, "org.example.name0"));
+
+        name_registry_deinit(&registry);
+}
+
 int main(int argc, char **argv) {
         test_setup();
         test_release();
         test_queue();
+        test_lookup();
         return 0;
 }
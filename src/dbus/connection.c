@@ -94,31 +94,9 @@ void connection_deinit(Connection *connection) {
         socket_deinit(&connection->socket);
 }
 
-static int connection_feed_sasl(Connection *connection, const char *input, size_t n_input) {
-        const char *output;
-        size_t n_output;
+static int connection_queue_sasl(Connection *connection, const char *output, size_t n_output) {
         int r;
 
-        /* client SASL allows NULL input as bootstrap */
-        assert(!connection->server || input);
-        assert(!connection->authenticated);
-
-        if (connection->server)
-                r = sasl_server_dispatch(&connection->sasl_server, input, n_input, &output, &n_output);
-        else
-                r = sasl_client_dispatch(&connection->sasl_client, input, n_input, &output, &n_output);
-
-        if (r > 0) {
-                connection_close(connection);
-                return CONNECTION_E_EOF;
-        } else if (r < 0) {
-                return error_fold(r);
-        }
-
-        connection->authenticated = connection->server ?
-                                    sasl_server_is_done(&connection->sasl_server) :
-                                    sasl_client_is_done(&connection->sasl_client);
-
         /*
          * If the SASL exchange triggered an outgoing message, we will queue it
          * on the socket. There're 3 things that might fail:
@@ -147,6 +125,61 @@ static int connection_feed_sasl(Connection *connection, const char *input, size_
         return 0;
 }
 
+static int connection_feed_sasl(Connection *connection, const char *input, size_t n_input) {
+        const char *output;
+        size_t n_output;
+        int r;
+
+        /* client SASL allows NULL input as bootstrap */
+        assert(!connection->server || input);
+        assert(!connection->authenticated);
+
+        if (connection->server)
+                r = sasl_server_dispatch(&connection->sasl_server, input, n_input, &output, &n_output);
+        else
+                r = sasl_client_dispatch(&connection->sasl_client, input, n_input, &output, &n_output);
+
+        if (r > 0) {
+                connection_close(connection);
+                return CONNECTION_E_EOF;
+        } else if (r < 0) {
+                return error_fold(r);
+        }
+
+        connection->authenticated = connection->server ?
+                                    sasl_server_is_done(&connection->sasl_server) :
+                                    sasl_client_is_done(&connection->sasl_client);
+
+        return error_trace(connection_queue_sasl(connection, output, n_output));
+}
+
+static int connection_feed_sasl_fast(Connection *connection) {
+        const char *input, *output;
+        size_t n_input, n_output;
+
+        assert(connection->server);
+        assert(!connection->authenticated);
+
+        /*
+         * Most clients pipeline their entire SASL exchange, usually followed
+         * by their Hello() call. Try to handle the exchange as a whole,
+         * rather than line by line. All replies end up in a single line
+         * buffer and are thus sent with a single write. Any trailing data is
+         * left in the input queue to be parsed as messages right away. If
+         * the input does not match, nothing is consumed and the caller falls
+         * back to the line-based parser.
+         */
+        socket_peek_lines(&connection->socket, &input, &n_input);
+        sasl_server_dispatch_fast(&connection->sasl_server, input, n_input, &n_input, &output, &n_output);
+        if (!n_input)
+                return 0;
+
+        socket_skip_lines(&connection->socket, n_input);
+        connection->authenticated = sasl_server_is_done(&connection->sasl_server);
+
+        return error_trace(connection_queue_sasl(connection, output, n_output));
+}
+
 /**
  * connection_open() - XXX
  */
@@ -221,7 +254,13 @@ int connection_dequeue(Connection *connection, Message **messagep) {
         int r;
 
         if (_c_unlikely_(!connection->authenticated)) {
-                do {
+                if (connection->server) {
+                        r = connection_feed_sasl_fast(connection);
+                        if (r)
+                                return error_trace(r);
+                }
+
+                while (!connection->authenticated) {
                         r = socket_dequeue_line(&connection->socket, &input, &n_input);
                         if (r)
                                 return (r == SOCKET_E_EOF) ? CONNECTION_E_EOF : error_fold(r);
@@ -234,20 +273,26 @@ int connection_dequeue(Connection *connection, Message **messagep) {
                         r = connection_feed_sasl(connection, input, n_input);
                         if (r)
                                 return error_trace(r);
-                } while (!connection->authenticated);
+                }
         }
 
         r = socket_dequeue(&connection->socket, messagep);
-        return (r == SOCKET_E_EOF) ? CONNECTION_E_EOF : error_fold(r);
+        if (r)
+                return (r == SOCKET_E_EOF) ? CONNECTION_E_EOF : error_fold(r);
+
+        if (*messagep)
+                connection_stamp(connection, *messagep);
+
+        return 0;
 }
 
 /**
  * connection_queue() - XXX
  */
-int connection_queue(Connection *connection, User *user, Message *message) {
+int connection_queue(Connection *connection, User *user, MetricsHistogram *latency, Message *message) {
         int r;
 
-        r = socket_queue(&connection->socket, user, message);
+        r = socket_queue(&connection->socket, user, latency, message);
         if (r == SOCKET_E_QUOTA)
                 return CONNECTION_E_QUOTA;
         else if (r == SOCKET_E_SHUTDOWN)
@@ -58,7 +58,7 @@ void connection_close(Connection *connection);
 int connection_dispatch(Connection *connection, uint32_t events);
 
 int connection_dequeue(Connection *connection, Message **messagep);
-int connection_queue(Connection *connection, User *user, Message *message);
+int connection_queue(Connection *connection, User *user, MetricsHistogram *latency, Message *message);
 
 C_DEFINE_CLEANUP(Connection *, connection_deinit);
 
@@ -67,3 +67,9 @@ C_DEFINE_CLEANUP(Connection *, connection_deinit);
 static inline bool connection_is_running(Connection *connection) {
         return socket_is_running(&connection->socket);
 }
+
+/* stamp @message with the current dispatch round, unless already stamped */
+static inline void connection_stamp(Connection *connection, Message *message) {
+        if (!message->timestamp && connection->socket_file.context)
+                message->timestamp = connection->socket_file.context->timestamp;
+}
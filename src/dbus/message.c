@@ -8,6 +8,7 @@
 #include <c-ref.h>
 #include <endian.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "dbus/message.h"
 #include "dbus/protocol.h"
 #include "util/fdlist.h"
@@ -25,13 +26,18 @@ static int message_new(Message **messagep, bool big_endian, size_t n_extra) {
         message->n_refs = C_REF_INIT;
         message->big_endian = big_endian;
         message->allocated_data = false;
+        message->mapped_data = false;
         message->parsed = false;
+        message->parsed_body = false;
         message->sender_id = ADDRESS_ID_INVALID;
+        message->timestamp = 0;
         message->fds = NULL;
         message->n_data = 0;
         message->n_copied = 0;
         message->n_header = 0;
         message->n_body = 0;
+        message->n_sealed = 0;
+        message->n_mapped = 0;
         message->data = NULL;
         message->header = NULL;
         message->metadata = (MessageMetadata){};
@@ -49,6 +55,7 @@ static int message_new(Message **messagep, bool big_endian, size_t n_extra) {
 int message_new_incoming(Message **messagep, MessageHeader header) {
         _c_cleanup_(message_unrefp) Message *message = NULL;
         uint64_t n_header, n_body, n_data;
+        void *data;
         int r;
 
         if (_c_likely_(header.endian == 'l')) {
@@ -65,14 +72,39 @@ int message_new_incoming(Message **messagep, MessageHeader header) {
         if (n_data > MESSAGE_SIZE_MAX)
                 return MESSAGE_E_TOO_LARGE;
 
-        r = message_new(&message, (header.endian == 'B'), n_data);
-        if (r)
-                return error_trace(r);
+        if (_c_unlikely_(n_data >= MESSAGE_MAP_MIN)) {
+                /*
+                 * Large messages get a dedicated anonymous mapping, rather
+                 * than a heap allocation. A burst of large messages would
+                 * otherwise fragment the heap, and it would retain its peak
+                 * size long after the messages are gone. A mapping is
+                 * returned to the kernel as soon as the last reference to the
+                 * message is dropped.
+                 */
+                data = mmap(NULL, n_data, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (data == MAP_FAILED)
+                        return error_origin(-errno);
+
+                r = message_new(&message, (header.endian == 'B'), 0);
+                if (r) {
+                        munmap(data, n_data);
+                        return error_trace(r);
+                }
+
+                message->data = data;
+                message->mapped_data = true;
+                message->n_mapped = n_data;
+        } else {
+                r = message_new(&message, (header.endian == 'B'), n_data);
+                if (r)
+                        return error_trace(r);
+
+                message->data = message + 1;
+        }
 
         message->n_data = n_data;
         message->n_header = n_header;
         message->n_body = n_body;
-        message->data = message + 1;
         message->header = (void *)message->data;
         message->body = message->data + c_align8(n_header);
         message->vecs[0] = (struct iovec){ message->header, c_align8(n_header) };
@@ -135,6 +167,8 @@ void message_free(_Atomic unsigned long *n_refs, void *userdata) {
 
         if (message->allocated_data)
                 free(message->data);
+        else if (message->mapped_data)
+                munmap(message->data, message->n_mapped);
         fdlist_free(message->fds);
         free(message);
 }
@@ -340,13 +374,287 @@ static int message_parse_header(Message *message, MessageMetadata *metadata) {
         return 0;
 }
 
-static int message_parse_body(Message *message, MessageMetadata *metadata) {
+static size_t message_type_size(char element) {
+        switch (element) {
+        case 'y':
+                return 1;
+        case 'n':
+        case 'q':
+                return 2;
+        case 'b':
+        case 'i':
+        case 'u':
+        case 'h':
+                return 4;
+        case 'x':
+        case 't':
+        case 'd':
+                return 8;
+        default:
+                return 0;
+        }
+}
+
+static bool message_signature_is_flat(const char *signature) {
+        /*
+         * A flat signature consists only of basic types other than 'g', and
+         * arrays thereof. Those are the types message_parse_args_flat() can
+         * validate on its own.
+         */
+        for ( ; *signature; ++signature) {
+                if (*signature == 'a')
+                        ++signature;
+
+                if (!message_type_size(*signature) && *signature != 's' && *signature != 'o')
+                        return false;
+        }
+
+        return true;
+}
+
+static bool message_validate_utf8(const char *string, size_t n_string) {
+        const uint64_t high = UINT64_C(0x8080808080808080), low = UINT64_C(0x0101010101010101);
+        const uint8_t *s = (const uint8_t *)string, *end = s + n_string;
+        uint32_t cp, min;
+        uint64_t word;
+        size_t i, n;
+
+        while (s < end) {
+                /*
+                 * Fast-path: Check 8 bytes at a time for ASCII without any
+                 * NUL. This covers almost all strings seen on the bus.
+                 */
+                if (end - s >= 8) {
+                        memcpy(&word, s, sizeof(word));
+                        if (!((word | ((word - low) & ~word)) & high)) {
+                                s += 8;
+                                continue;
+                        }
+                }
+
+                if (*s < 0x80) {
+                        if (!*s)
+                                return false;
+
+                        ++s;
+                        continue;
+                }
+
+                /*
+                 * Slow-path: Decode a single multi-byte sequence. Reject
+                 * overlong encodings, surrogates and anything beyond
+                 * U+10FFFF.
+                 */
+                if ((*s & 0xe0) == 0xc0) {
+                        n = 2;
+                        cp = *s & 0x1f;
+                        min = 0x80;
+                } else if ((*s & 0xf0) == 0xe0) {
+                        n = 3;
+                        cp = *s & 0x0f;
+                        min = 0x800;
+                } else if ((*s & 0xf8) == 0xf0) {
+                        n = 4;
+                        cp = *s & 0x07;
+                        min = 0x10000;
+                } else {
+                        return false;
+                }
+
+                if ((size_t)(end - s) < n)
+                        return false;
+
+                for (i = 1; i < n; ++i) {
+                        if ((s[i] & 0xc0) != 0x80)
+                                return false;
+
+                        cp = (cp << 6) | (s[i] & 0x3f);
+                }
+
+                if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+                        return false;
+
+                s += n;
+        }
+
+        return true;
+}
+
+static bool message_validate_path(const char *path, size_t n_path) {
+        size_t i;
+
+        if (!n_path || path[0] != '/')
+                return false;
+
+        for (i = 1; i < n_path; ++i) {
+                if (path[i] == '/') {
+                        if (path[i - 1] == '/')
+                                return false;
+                } else if (!((path[i] >= 'a' && path[i] <= 'z') ||
+                             (path[i] >= 'A' && path[i] <= 'Z') ||
+                             (path[i] >= '0' && path[i] <= '9') ||
+                             path[i] == '_')) {
+                        return false;
+                }
+        }
+
+        return n_path == 1 || path[n_path - 1] != '/';
+}
+
+static bool message_validate_align(const uint8_t *body, size_t n_body, size_t *posp, size_t alignment) {
+        size_t pos = *posp, to = C_ALIGN_TO(pos, alignment);
+
+        if (to > n_body)
+                return false;
+
+        for ( ; pos < to; ++pos)
+                if (body[pos])
+                        return false;
+
+        *posp = to;
+        return true;
+}
+
+static bool message_validate_u32(Message *message, const uint8_t *body, size_t n_body, size_t *posp, uint32_t *valuep) {
+        uint32_t v;
+
+        if (!message_validate_align(body, n_body, posp, 4) || n_body - *posp < 4)
+                return false;
+
+        memcpy(&v, body + *posp, sizeof(v));
+        *valuep = message->big_endian ? be32toh(v) : le32toh(v);
+        *posp += 4;
+        return true;
+}
+
+static bool message_validate_string(Message *message, const uint8_t *body, size_t n_body, size_t *posp, char element, const char **stringp) {
+        const char *string;
+        uint32_t n;
+
+        if (!message_validate_u32(message, body, n_body, posp, &n))
+                return false;
+        if (n >= n_body - *posp || body[*posp + n])
+                return false;
+
+        string = (const char *)body + *posp;
+
+        if (element == 'o') {
+                if (!message_validate_path(string, n))
+                        return false;
+        } else {
+                if (!message_validate_utf8(string, n))
+                        return false;
+        }
+
+        *posp += n + 1;
+        if (stringp)
+                *stringp = string;
+        return true;
+}
+
+static bool message_validate_array(Message *message, const uint8_t *body, size_t n_body, size_t *posp, char element) {
+        size_t end, size = message_type_size(element);
+        uint32_t n, v;
+
+        /*
+         * Arrays are limited to 64MiB by the spec. The padding to the
+         * element alignment follows the length, even if the array is empty.
+         * Arrays of fixed-size types are skipped in bulk, only booleans need
+         * to be verified one by one.
+         */
+        if (!message_validate_u32(message, body, n_body, posp, &n))
+                return false;
+        if (n > (1U << 26))
+                return false;
+        if (!message_validate_align(body, n_body, posp, size ?: 4))
+                return false;
+        if (n > n_body - *posp)
+                return false;
+
+        end = *posp + n;
+
+        if (size) {
+                if (n % size)
+                        return false;
+
+                if (element == 'b') {
+                        for ( ; *posp < end; *posp += 4) {
+                                memcpy(&v, body + *posp, sizeof(v));
+                                if (v && (message->big_endian ? be32toh(v) : le32toh(v)) != 1)
+                                        return false;
+                        }
+                }
+
+                *posp = end;
+                return true;
+        }
+
+        while (*posp < end)
+                if (!message_validate_string(message, body, end, posp, element, NULL))
+                        return false;
+
+        return true;
+}
+
+static int message_parse_args_flat(Message *message, MessageMetadata *metadata) {
+        const uint8_t *body = message->body;
+        const char *string, *signature = metadata->fields.signature;
+        size_t i, pos = 0, size;
+        uint32_t v;
+        char element;
+
+        /*
+         * This is a specialized validator for flat signatures, replacing the
+         * generic c_dvar_skip() for the common case. Strings are validated
+         * word-wise and fixed-size arrays are skipped in bulk. This is what
+         * large payloads (blobs, string lists) usually look like.
+         */
+
+        for (i = 0; *signature; ++i, ++signature) {
+                element = *signature;
+
+                if (element == 'a') {
+                        if (!message_validate_array(message, body, message->n_body, &pos, *++signature))
+                                return MESSAGE_E_INVALID_BODY;
+                } else if (element == 's' || element == 'o') {
+                        if (!message_validate_string(message, body, message->n_body, &pos, element, &string))
+                                return MESSAGE_E_INVALID_BODY;
+
+                        if (i < C_ARRAY_SIZE(metadata->args)) {
+                                metadata->args[i].element = element;
+                                metadata->args[i].value = string;
+                        }
+                } else {
+                        size = message_type_size(element);
+                        if (!message_validate_align(body, message->n_body, &pos, size) || message->n_body - pos < size)
+                                return MESSAGE_E_INVALID_BODY;
+
+                        if (element == 'b') {
+                                memcpy(&v, body + pos, sizeof(v));
+                                if (v && (message->big_endian ? be32toh(v) : le32toh(v)) != 1)
+                                        return MESSAGE_E_INVALID_BODY;
+                        }
+
+                        pos += size;
+                }
+        }
+
+        if (pos != message->n_body)
+                return MESSAGE_E_INVALID_BODY;
+
+        return 0;
+}
+
+static int message_parse_args(Message *message, MessageMetadata *metadata) {
         _c_cleanup_(c_dvar_deinit) CDVar v = C_DVAR_INIT;
         const char *signature = metadata->fields.signature;
         size_t i, n_signature, n_types;
         CDVarType *t, *types;
         int r;
 
+        if (message_signature_is_flat(signature))
+                return error_trace(message_parse_args_flat(message, metadata));
+
         /*
          * Parse body-signature into CDVarType array. We use a single array
          * with all the argument-types concatenated.
@@ -399,7 +707,15 @@ static int message_parse_body(Message *message, MessageMetadata *metadata) {
 }
 
 /**
- * message_parse_metadata() - XXX
+ * message_parse_metadata() - parse message header
+ * @message:                    message to operate on
+ *
+ * This parses and validates the header of @message, and caches its fields in
+ * @message->metadata. The body is not looked at. Use message_parse_body() to
+ * validate the body and fetch the arguments used by match-filters.
+ *
+ * Return: 0 on success, MESSAGE_E_INVALID_HEADER if the header is invalid,
+ *         negative error code on failure.
  */
 int message_parse_metadata(Message *message) {
         void *p;
@@ -424,16 +740,6 @@ int message_parse_metadata(Message *message) {
                 if (*(const uint8_t *)p)
                         return MESSAGE_E_INVALID_HEADER;
 
-        /*
-         * Now that the header is validated, we read through the message body.
-         * Again, this is required for compatibility with dbus-daemon(1), but
-         * also to fetch the arguments for match-filters used by eavesdropping
-         * and common broadcasts.
-         */
-        r = message_parse_body(message, &message->metadata);
-        if (r)
-                return error_trace(r);
-
         /*
          * dbus-daemon(1) only ever fetches the correct number of FDs from its
          * stream. This violates the D-Bus specification, which requires FDs to
@@ -445,14 +751,141 @@ int message_parse_metadata(Message *message) {
         if (message->fds)
                 fdlist_truncate(message->fds, message->metadata.fields.unix_fds);
 
+        /*
+         * Large payloads can be passed as sealed memfds, rather than inline.
+         * We never look at their content, but they pin memory for as long as
+         * the message is queued, so remember their size for accounting. This
+         * is done for every sender, regardless of whether it negotiated memfd
+         * passing, since the accounting must not be optional. Unsealed FDs
+         * only cost a single fcntl(2) each.
+         */
+        if (message->fds)
+                message->n_sealed = fdlist_get_sealed_size(message->fds);
+
         message->parsed = true;
         return 0;
 }
 
+/**
+ * message_parse_body() - parse message body
+ * @message:                    message to operate on
+ *
+ * This reads through the body of @message, validating it against the
+ * signature from the header, and caches all string and object-path arguments
+ * in @message->metadata, so the match rule processing can access them
+ * directly. This is required for compatibility with dbus-daemon(1), but can
+ * be deferred until the arguments are actually needed, as most unicast
+ * messages never need them.
+ *
+ * The header must have been parsed via message_parse_metadata() before. The
+ * body is only ever parsed once, further calls are no-ops. If the body is
+ * invalid, no arguments are cached.
+ *
+ * Return: 0 on success, MESSAGE_E_INVALID_HEADER if the signature is invalid,
+ *         MESSAGE_E_INVALID_BODY if the body is invalid, negative error code
+ *         on failure.
+ */
+int message_parse_body(Message *message) {
+        int r;
+
+        assert(message->parsed);
+
+        if (message->parsed_body)
+                return 0;
+
+        message->parsed_body = true;
+
+        r = message_parse_args(message, &message->metadata);
+        if (r > 0)
+                memset(message->metadata.args, 0, sizeof(message->metadata.args));
+
+        return error_trace(r);
+}
+
+/**
+ * message_marshal_string() - marshal string argument
+ * @data:                       buffer to marshal into, or NULL
+ * @pos:                        offset into @data
+ * @string:                     string to marshal
+ *
+ * This marshals @string as D-Bus type 's' into @data at offset @pos, in
+ * native endianness. Padding up to the 4-byte alignment of the length field
+ * is zeroed. If @data is NULL, nothing is written, but the end offset is still
+ * computed, so callers can size their buffer upfront. This is meant for the
+ * driver, to append bodies to pre-marshalled headers without the overhead of
+ * a full c-dvar serialization.
+ *
+ * Return: The offset following the marshalled string.
+ */
+size_t message_marshal_string(void *data, size_t pos, const char *string) {
+        size_t n_string = strlen(string), to = C_ALIGN_TO(pos, 4);
+        uint32_t length = n_string;
+
+        if (data) {
+                memset(data + pos, 0, to - pos);
+                memcpy(data + to, &length, sizeof(length));
+                memcpy(data + to + sizeof(length), string, n_string + 1);
+        }
+
+        return to + sizeof(length) + n_string + 1;
+}
+
+/**
+ * message_sender_init() - pre-marshal sender field
+ * @sender:                     sender to initialize
+ * @id:                         sender id
+ *
+ * This formats the unique name of @id and marshals the `(yv)' sender field
+ * for it, padded to 8 bytes, in both little- and big-endian. Senders are
+ * initialized once per peer, so stitching a message does not need to format
+ * or marshal anything. See message_stitch_sender().
+ */
+void message_sender_init(MessageSender *sender, uint64_t id) {
+        const char *name;
+        size_t n_name;
+
+        /*
+         * A string-field needs `1 + 3 + 4 + n + 1' bytes:
+         *
+         *     - length of 'y':                 1
+         *     - length of 'v':                 3 + 4 + n + 1
+         *       - type 'g' needs:
+         *         - size field byte:           1
+         *         - type string 's':           1
+         *         - zero termination:          1
+         *       - sender string needs:
+         *         - alignment to 4:            0
+         *         - size field int:            4
+         *         - sender string:             n
+         *         - zero termination:          1
+         */
+        name = address_to_string(&(Address)ADDRESS_INIT_ID(id));
+        n_name = strlen(name);
+
+        assert(n_name <= ADDRESS_ID_STRING_MAX);
+        static_assert(1 + 3 + 4 + ADDRESS_ID_STRING_MAX + 1 <= sizeof(sender->patch[0]),
+                      "Message patch buffer has insufficient size");
+
+        *sender = (MessageSender){};
+        sender->id = id;
+        sender->n_field = 1 + 3 + 4 + n_name + 1;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(sender->patch); ++i) {
+                sender->patch[i][0] = DBUS_MESSAGE_FIELD_SENDER;
+                sender->patch[i][1] = 1;
+                sender->patch[i][2] = 's';
+                sender->patch[i][3] = 0;
+                memcpy(sender->patch[i] + 8, name, n_name + 1);
+        }
+
+        memcpy(sender->patch[0] + 4, (uint32_t[1]){ htole32(n_name) }, sizeof(uint32_t));
+        memcpy(sender->patch[1] + 4, (uint32_t[1]){ htobe32(n_name) }, sizeof(uint32_t));
+}
+
 /**
  * message_stitch_sender() - stitch in new sender field
  * @message:                    message to operate on
- * @sender_id:                  sender id to stitch in
+ * @sender:                     sender to stitch in
  *
  * When the broker forwards messages, it needs to fill in the sender-field
  * reliably. Unfortunately, this requires modifying the fields-array of the
@@ -470,9 +903,8 @@ int message_parse_metadata(Message *message) {
  * relocated nor overwritten. That is, any cached pointer stays valid, though
  * maybe no longer part of the actual message.
  */
-void message_stitch_sender(Message *message, uint64_t sender_id) {
-        size_t n, n_stitch, n_field, n_sender;
-        const char *sender;
+void message_stitch_sender(Message *message, const MessageSender *sender) {
+        size_t n, n_stitch;
         void *end, *field;
 
         /*
@@ -484,46 +916,17 @@ void message_stitch_sender(Message *message, uint64_t sender_id) {
         assert(!message->vecs[1].iov_base && !message->vecs[1].iov_len);
         assert(!message->vecs[2].iov_base && !message->vecs[2].iov_len);
 
-        /*
-         * Convert the sender id to a unique name. This should never fail on
-         * a valid sender id.
-         */
-        sender = address_to_string(&(Address)ADDRESS_INIT_ID(sender_id));
-        message->sender_id = sender_id;
+        message->sender_id = sender->id;
 
         /*
-         * Calculate string, field, and buffer lengths. We need to possibly cut
-         * out a `(yv)' and insert another one at the end. See the D-Bus
-         * marshalling for details, but shortly this means:
-         *
-         *     - Tuples are always 8-byte aligned. Hence, we can reliably
-         *       calculate field offsets.
-         *
-         *     - A string-field needs `1 + 3 + 4 + n + 1' bytes:
-         *
-         *         - length of 'y':                 1
-         *         - length of 'v':                 3 + 4 + n + 1
-         *           - type 'g' needs:
-         *             - size field byte:           1
-         *             - type string 's':           1
-         *             - zero termination:          1
-         *           - sender string needs:
-         *             - alignment to 4:            0
-         *             - size field int:            4
-         *             - sender string:             n
-         *             - zero termination:          1
+         * We need to possibly cut out a `(yv)' and insert another one at the
+         * end. Tuples are always 8-byte aligned, hence, we can reliably
+         * calculate field offsets. See message_sender_init() for the size of
+         * the sender field.
          */
-        n_sender = strlen(sender);
-        n_field = 1 + 3 + 4 + n_sender + 1;
-        n_stitch = c_align8(n_field);
+        n_stitch = c_align8(sender->n_field);
 
-        /*
-         * The patch buffer is pre-allocated. Verify its size is sufficient to
-         * hold the stitched sender.
-         */
-        assert(n_stitch <= sizeof(message->patch));
-        assert(n_sender <= ADDRESS_ID_STRING_MAX);
-        static_assert(1 + 3 + 4 + ADDRESS_ID_STRING_MAX + 1 <= sizeof(message->patch),
+        static_assert(sizeof(sender->patch[0]) == sizeof(message->patch),
                       "Message patch buffer has insufficient size");
 
         if (message->original_sender) {
@@ -568,21 +971,16 @@ void message_stitch_sender(Message *message, uint64_t sender_id) {
          * purpose.
          */
 
+        /*
+         * The sender field is pre-marshalled, including its padding. The
+         * message might outlive the sender, so copy it rather than pointing
+         * to it.
+         */
+        memcpy(message->patch, sender->patch[message->big_endian], n_stitch);
+
         message->vecs[2].iov_base = message->patch;
         message->vecs[2].iov_len = n_stitch;
 
-        /* fill in `(yv)' with sender and padding */
-        message->patch[0] = DBUS_MESSAGE_FIELD_SENDER;
-        message->patch[1] = 1;
-        message->patch[2] = 's';
-        message->patch[3] = 0;
-        if (message->big_endian)
-                memcpy(message->patch + 4, (uint32_t[1]){ htobe32(n_sender) }, sizeof(uint32_t));
-        else
-                memcpy(message->patch + 4, (uint32_t[1]){ htole32(n_sender) }, sizeof(uint32_t));
-        memcpy(message->patch + 8, sender, n_sender + 1);
-        memset(message->patch + 8 + n_sender + 1, 0, n_stitch - n_field);
-
         /*
          * After we cut the previous sender field and inserted the new, adjust
          * all the size-counters in the message again.
@@ -590,7 +988,7 @@ void message_stitch_sender(Message *message, uint64_t sender_id) {
 
         message->n_header = message->vecs[0].iov_len +
                             message->vecs[1].iov_len +
-                            n_field;
+                            sender->n_field;
         message->n_data = c_align8(message->n_header) + message->n_body;
 
         if (message->big_endian)
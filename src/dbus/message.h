@@ -14,11 +14,13 @@ typedef struct FDList FDList;
 typedef struct Message Message;
 typedef struct MessageHeader MessageHeader;
 typedef struct MessageMetadata MessageMetadata;
+typedef struct MessageSender MessageSender;
 
 /* max message size; taken from spec */
 #define MESSAGE_SIZE_MAX (128UL * 1024UL * 1024UL)
+#define MESSAGE_MAP_MIN (256UL * 1024UL) /* randomly picked, no tuning done so far */
 
-/* max patch buffer size; see message_stitch_sender() */
+/* max patch buffer size; see message_sender_init() */
 #define MESSAGE_PATCH_MAX (C_ALIGN_TO(1 + 3 + 4 + ADDRESS_ID_STRING_MAX + 1, 8))
 
 enum {
@@ -62,9 +64,12 @@ struct Message {
 
         bool big_endian : 1;
         bool allocated_data : 1;
+        bool mapped_data : 1;
         bool parsed : 1;
+        bool parsed_body : 1;
 
         uint64_t sender_id;
+        uint64_t timestamp;
 
         FDList *fds;
 
@@ -72,6 +77,8 @@ struct Message {
         size_t n_copied;
         size_t n_header;
         size_t n_body;
+        size_t n_sealed;
+        size_t n_mapped;
 
         void *data;
         MessageHeader *header;
@@ -83,6 +90,12 @@ struct Message {
         alignas(uint64_t) uint8_t patch[MESSAGE_PATCH_MAX];
 };
 
+struct MessageSender {
+        uint64_t id;
+        size_t n_field;
+        alignas(uint64_t) uint8_t patch[2][MESSAGE_PATCH_MAX]; /* little-, big-endian */
+};
+
 struct MessageHeader {
         uint8_t endian;
         uint8_t type;
@@ -98,7 +111,10 @@ int message_new_outgoing(Message **messagep, void *data, size_t n_data);
 void message_free(_Atomic unsigned long *n_refs, void *userdata);
 
 int message_parse_metadata(Message *message);
-void message_stitch_sender(Message *message, uint64_t sender_id);
+int message_parse_body(Message *message);
+size_t message_marshal_string(void *data, size_t pos, const char *string);
+void message_sender_init(MessageSender *sender, uint64_t id);
+void message_stitch_sender(Message *message, const MessageSender *sender);
 
 /* inline helpers */
 
@@ -135,3 +151,13 @@ static inline uint32_t message_read_serial(Message *message) {
 }
 
 C_DEFINE_CLEANUP(Message *, message_unref);
+
+/**
+ * message_sender_get_name() - return unique name of sender
+ * @sender:             sender to query
+ *
+ * Return: The unique name of @sender, as stored in its sender field.
+ */
+static inline const char *message_sender_get_name(const MessageSender *sender) {
+        return (const char *)sender->patch[0] + 1 + 3 + 4;
+}
@@ -8,6 +8,43 @@
 #include "util/fdlist.h"
 #include "util/error.h"
 
+static void iqueue_discard_fds(IQueue *iq, size_t pos) {
+        IQueueFDSet *fdset;
+
+        /*
+         * Drop all FDs attached to bytes before @pos. This is used during
+         * line-handling, where FDs are silently ignored.
+         */
+        for ( ; iq->i_fdsets < iq->n_fdsets; ++iq->i_fdsets) {
+                fdset = &iq->fdsets[iq->i_fdsets];
+                if (fdset->end > pos)
+                        return;
+
+                fdset->fds = fdlist_free(fdset->fds);
+                user_charge_deinit(&fdset->charge);
+        }
+
+        if (pos >= iq->data_end) {
+                iq->fds = fdlist_free(iq->fds);
+                user_charge_deinit(&iq->charge_fds);
+        }
+}
+
+static int iqueue_attach_fds(IQueue *iq, FDList **fdsp, UserCharge *charge) {
+        if (!*fdsp)
+                return 0;
+
+        /* see iqueue_pop_data() for details */
+        if (_c_unlikely_(iq->pending.fds))
+                return IQUEUE_E_VIOLATION;
+
+        iq->pending.fds = *fdsp;
+        iq->pending.charge_fds = *charge;
+        *fdsp = NULL;
+        *charge = (UserCharge)USER_CHARGE_INIT;
+        return 0;
+}
+
 /**
  * iqueue_init() - XXX
  */
@@ -47,7 +84,9 @@ void iqueue_flush(IQueue *iq) {
         iq->data_start = 0;
         iq->data_end = 0;
         iq->data_cursor = 0;
-        iq->fds = fdlist_free(iq->fds);
+        iqueue_discard_fds(iq, SIZE_MAX);
+        iq->i_fdsets = 0;
+        iq->n_fdsets = 0;
 
         iq->pending.data = NULL;
         iq->pending.n_data = 0;
@@ -103,6 +142,7 @@ int iqueue_get_cursor(IQueue *iq,
                       size_t *top,
                       FDList ***fdsp,
                       UserCharge **charge_fdsp) {
+        size_t i;
         void *p;
         int r;
 
@@ -122,6 +162,8 @@ int iqueue_get_cursor(IQueue *iq,
                 iq->data_end - iq->data_start);
         iq->data_cursor -= iq->data_start;
         iq->data_end -= iq->data_start;
+        for (i = iq->i_fdsets; i < iq->n_fdsets; ++i)
+                iq->fdsets[i].end -= iq->data_start;
         iq->data_start = 0;
 
         /*
@@ -136,6 +178,11 @@ int iqueue_get_cursor(IQueue *iq,
         if (iq->data_cursor < iq->data_end)
                 return IQUEUE_E_PENDING;
 
+        /* all sealed FD-sets are consumed with the data they belong to */
+        assert(iq->i_fdsets == iq->n_fdsets);
+        iq->i_fdsets = 0;
+        iq->n_fdsets = 0;
+
         /*
          * In case our input buffer is full, we need to resize it. This can
          * only happen for the line-reader, since otherwise we always read into
@@ -217,11 +264,10 @@ int iqueue_get_cursor(IQueue *iq,
          * incoming messages we may have in the buffer at once.
          *
          * Note that the kernel always breaks recvmsg() calls after an SKB with
-         * file-descriptor payload. Hence, this could be improvded with
-         * recvmmsg() so we get multiple messages at all cost. However, FD
-         * passing is no fast-path and should never be, so there is little
-         * reason to resort to recvmmsg() (which would be non-trivial, anyway,
-         * since we would need multiple input buffers).
+         * file-descriptor payload. Callers can avoid a syscall per message
+         * by splitting the cursor into segments and filling them via
+         * recvmmsg(). In that case, they must call iqueue_seal_fds() after
+         * each segment that carried FDs, before appending the next one.
          */
         *bufferp = iq->data;
         *fromp = &iq->data_end;
@@ -231,6 +277,36 @@ int iqueue_get_cursor(IQueue *iq,
         return 0;
 }
 
+/**
+ * iqueue_seal_fds() - seal FDs at the current end of the input buffer
+ * @iq:                 input queue to operate on
+ *
+ * FDs received via the cursor returned by iqueue_get_cursor() are attached to
+ * the last byte of the input buffer. If a caller wants to append more data
+ * with the same cursor, it must first call this to pin the FDs to the data
+ * received so far. This way, each segment of a recvmmsg(2) call keeps its FDs
+ * attached to the right message boundary.
+ *
+ * This must not be called more than IQUEUE_SEGMENT_MAX times for a single
+ * cursor, and never for cursors pointing into a pending target.
+ */
+void iqueue_seal_fds(IQueue *iq) {
+        IQueueFDSet *fdset;
+
+        if (!iq->fds)
+                return;
+
+        assert(iq->n_fdsets < C_ARRAY_SIZE(iq->fdsets));
+        assert(!iq->n_fdsets || iq->fdsets[iq->n_fdsets - 1].end < iq->data_end);
+
+        fdset = &iq->fdsets[iq->n_fdsets++];
+        fdset->end = iq->data_end;
+        fdset->fds = iq->fds;
+        fdset->charge = iq->charge_fds;
+        iq->fds = NULL;
+        iq->charge_fds = (UserCharge)USER_CHARGE_INIT;
+}
+
 /**
  * iqueue_pop_line() - XXX
  */
@@ -246,20 +322,17 @@ int iqueue_pop_line(IQueue *iq, const char **linep, size_t *np) {
          */
         for ( ; iq->data_cursor < iq->data_end; ++iq->data_cursor) {
                 /*
-                 * If we are at the end of the input-queue, we must consume
+                 * If we are at the end of a received chunk, we must consume
                  * any possible FD array that we received alongside it.
                  * The kernel always breaks _after_ skbs with FDs, but not
-                 * before them. Hence, FDs are attached to the LAST byte of our
-                 * input-queue, rather than the first.
+                 * before them. Hence, FDs are attached to the LAST byte of a
+                 * chunk, rather than the first.
                  *
                  * During line-handling, we silently ignore any received FDs,
                  * and the DBus spec clearly states that no extension shall
                  * pass FDs during authentication.
                  */
-                if (iq->data_cursor + 1 >= iq->data_end) {
-                        iq->fds = fdlist_free(iq->fds);
-                        user_charge_deinit(&iq->charge_fds);
-                }
+                iqueue_discard_fds(iq, iq->data_cursor + 1);
 
                 /*
                  * If we find an \r\n, return the pointer and length to the
@@ -293,65 +366,113 @@ int iqueue_pop_line(IQueue *iq, const char **linep, size_t *np) {
         return IQUEUE_E_PENDING;
 }
 
+/**
+ * iqueue_peek_lines() - XXX
+ */
+void iqueue_peek_lines(IQueue *iq, const char **datap, size_t *np) {
+        assert(!iq->pending.data);
+
+        *datap = iq->data + iq->data_start;
+        *np = iq->data_end - iq->data_start;
+}
+
+/**
+ * iqueue_skip_lines() - XXX
+ */
+void iqueue_skip_lines(IQueue *iq, size_t n) {
+        assert(!iq->pending.data);
+        assert(n <= iq->data_end - iq->data_start);
+
+        /*
+         * Cut @n bytes off the front of the input-queue. The caller must have
+         * parsed them as full lines. The cursor is reset to the new start, so
+         * the line-parser might re-scan a partial line it already looked at,
+         * but that is fine, as it never contains an end-of-line.
+         */
+        iq->data_start += n;
+        iq->data_cursor = iq->data_start;
+
+        /* see iqueue_pop_line() for details on FDs during line-handling */
+        iqueue_discard_fds(iq, iq->data_cursor);
+}
+
 /**
  * iqueue_pop_data() - XXX
  */
 int iqueue_pop_data(IQueue *iq, FDList **fdsp) {
-        size_t n, n_data;
+        IQueueFDSet *fdset;
+        size_t n, end;
+        int r;
 
         assert(iq->pending.data);
         assert(iq->pending.n_copied <= iq->pending.n_data);
 
-        n_data = iq->data_end - iq->data_start;
+        for (;;) {
+                /*
+                 * The input-queue consists of chunks as returned by the
+                 * kernel, each ending either at a sealed FD-set or at the end
+                 * of the buffer. Copy data over until the end of the current
+                 * chunk, or until the pending buffer is full.
+                 */
+                fdset = (iq->i_fdsets < iq->n_fdsets) ? &iq->fdsets[iq->i_fdsets] : NULL;
+                end = fdset ? fdset->end : iq->data_end;
 
-        /*
-         * As long as there is data in our input-queue, and the pending buffer
-         * is not fully read, we continously copy over data from the
-         * input-queue into the pending buffer. Note that this step might be
-         * short-cut by the socket-layer by directly reading data into the
-         * pending buffer.
-         */
-        if (n_data > 0) {
-                n = c_min(n_data, iq->pending.n_data - iq->pending.n_copied);
+                /*
+                 * As long as there is data in our input-queue, and the
+                 * pending buffer is not fully read, we continously copy over
+                 * data from the input-queue into the pending buffer. Note
+                 * that this step might be short-cut by the socket-layer by
+                 * directly reading data into the pending buffer.
+                 */
+                n = c_min(end - iq->data_start, iq->pending.n_data - iq->pending.n_copied);
+                if (n > 0) {
+                        memcpy(iq->pending.data + iq->pending.n_copied,
+                               iq->data + iq->data_start,
+                               n);
+
+                        iq->data_start += n;
+                        iq->data_cursor += n;
+                        iq->pending.n_copied += n;
+                }
 
-                memcpy(iq->pending.data + iq->pending.n_copied,
-                       iq->data + iq->data_start,
-                       n);
+                if (iq->data_start < end)
+                        break;
 
-                n_data -= n;
-                iq->data_start += n;
-                iq->data_cursor += n;
-                iq->pending.n_copied += n;
-        }
+                /*
+                 * Auxiliary file-descriptors are returned by the kernel
+                 * together with message data. The kernel breaks the receiption
+                 * *after* each skbuff that carried FDs. Hence, FDs are always
+                 * attached to the *last* byte of the chunk they were returned
+                 * with.
+                 * D-Bus clients are required to send FDs together with the
+                 * bytes of their message. Hence, they cannot merge multiple
+                 * messages into a single buffer, if they carry FDs. The worst
+                 * that can happen is that many non-fd-carrying messages are
+                 * merged into a single SKB up until (and including) a last
+                 * message that carries FDs. Since we attribute FDs to the last
+                 * byte of our received chunks, we will correctly attribute the
+                 * FDs to the last message.
+                 *
+                 * So, whenever we copied over the last byte of a chunk into a
+                 * message, this means we also need to copy the FDs. Note that
+                 * the D-Bus spec does *NOT* allow multiple FD-Sets to be
+                 * transferred with a single message (all FDs must be
+                 * transferred in a single shot). It is, thus, a protocol
+                 * violation if there are multiple FDsets for a single message.
+                 */
+                if (!fdset) {
+                        r = iqueue_attach_fds(iq, &iq->fds, &iq->charge_fds);
+                        if (r)
+                                return r;
 
-        /*
-         * Auxiliary file-descriptors are returned by the kernel together with
-         * message data. The kernel breaks the receiption *after* each skbuff
-         * that carried FDs. Hence, FDs are always attached to the *last* byte
-         * of the data-buffer they were returned with.
-         * D-Bus clients are required to send FDs together with the bytes of
-         * their message. Hence, they cannot merge multiple messages into a
-         * single buffer, if they carry FDs. The worst that can happen is that
-         * many non-fd-carrying messages are merged into a single SKB up until
-         * (and including) a last message that carries FDs. Since we attribute
-         * FDs to the last byte of our received chunks, we will correctly
-         * attribute the FDs to the last message.
-         *
-         * So, whenever we copied over the last byte from the input-queue into
-         * a message, this means we also need to copy the FDs. Note that the
-         * D-Bus spec does *NOT* allow multiple FD-Sets to be transferred with
-         * a single message (all FDs must be transferred in a single shot). It
-         * is, thus, a protocol violation if there are multiple FDsets for a
-         * single message.
-         */
-        if (_c_unlikely_(!n_data && iq->fds)) {
-                if (_c_unlikely_(iq->pending.fds))
-                        return IQUEUE_E_VIOLATION;
+                        break;
+                }
+
+                r = iqueue_attach_fds(iq, &fdset->fds, &fdset->charge);
+                if (r)
+                        return r;
 
-                iq->pending.fds = iq->fds;
-                iq->pending.charge_fds = iq->charge_fds;
-                iq->fds = NULL;
-                iq->charge_fds = (UserCharge)USER_CHARGE_INIT;
+                ++iq->i_fdsets;
         }
 
         /*
@@ -11,9 +11,11 @@
 #include "util/user.h"
 
 typedef struct IQueue IQueue;
+typedef struct IQueueFDSet IQueueFDSet;
 
 #define IQUEUE_LINE_MAX (16UL * 1024UL) /* taken from dbus-daemon(1) */
 #define IQUEUE_RECV_MAX (2UL * 1024UL) /* based on average message size */
+#define IQUEUE_SEGMENT_MAX (8UL) /* randomly picked, no tuning done so far */
 
 enum {
         _IQUEUE_E_SUCCESS,
@@ -23,6 +25,12 @@ enum {
         IQUEUE_E_VIOLATION,
 };
 
+struct IQueueFDSet {
+        size_t end;
+        UserCharge charge;
+        FDList *fds;
+};
+
 struct IQueue {
         User *user;
 
@@ -35,6 +43,10 @@ struct IQueue {
         size_t data_cursor;
         FDList *fds;
 
+        IQueueFDSet fdsets[IQUEUE_SEGMENT_MAX];
+        size_t i_fdsets;
+        size_t n_fdsets;
+
         struct {
                 UserCharge charge_data;
                 UserCharge charge_fds;
@@ -80,8 +92,11 @@ int iqueue_get_cursor(IQueue *iq,
                       size_t *top,
                       FDList ***fdsp,
                       UserCharge **charge_fdsp);
+void iqueue_seal_fds(IQueue *iq);
 
 int iqueue_pop_line(IQueue *iq, const char **linep, size_t *np);
+void iqueue_peek_lines(IQueue *iq, const char **datap, size_t *np);
+void iqueue_skip_lines(IQueue *iq, size_t n);
 int iqueue_pop_data(IQueue *iq, FDList **fds);
 
 /* inline helpers */
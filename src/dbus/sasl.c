@@ -132,17 +132,33 @@ void sasl_server_init(SASLServer *sasl, uid_t uid, const char *guid) {
         sasl->ok_response[1] = 'K';
         sasl->ok_response[2] = ' ';
         c_string_to_hex(guid, 16, &sasl->ok_response[3]);
+
+        memcpy(sasl->fast_response, "DATA\r\n", strlen("DATA\r\n"));
+        memcpy(sasl->fast_response + strlen("DATA\r\n"), sasl->ok_response, sizeof(sasl->ok_response));
+        memcpy(sasl->fast_response + strlen("DATA\r\n") + sizeof(sasl->ok_response),
+               "\r\nAGREE_UNIX_FD",
+               strlen("\r\nAGREE_UNIX_FD"));
 };
 
 void sasl_server_deinit(SASLServer *sasl) {
         *sasl = (SASLServer){};
 };
 
+static size_t sasl_server_get_hex_uid(SASLServer *sasl, char *hexbuf) {
+        char uidbuf[C_DECIMAL_MAX(uint32_t) + 1];
+        int n;
+
+        n = snprintf(uidbuf, sizeof(uidbuf), "%" PRIu32, sasl->uid);
+        assert(n >= 0 && (size_t)n < sizeof(uidbuf));
+
+        c_string_to_hex(uidbuf, n, hexbuf);
+        return 2 * (size_t)n;
+}
+
 static void sasl_server_handle_data(SASLServer *sasl, const char *input, size_t n_input, const char **outputp, size_t *n_outputp) {
         char hexbuf[2 * C_DECIMAL_MAX(uint32_t) + 1];
-        char uidbuf[C_DECIMAL_MAX(uint32_t) + 1];
         bool failed = false;
-        int n;
+        size_t n;
 
         /*
          * The EXTERNAL mechanism requires the UID to authenticate as as
@@ -150,11 +166,8 @@ static void sasl_server_handle_data(SASLServer *sasl, const char *input, size_t
          * which case we rely on the kernel to verify its correctness.
          */
         if (n_input) {
-                n = snprintf(uidbuf, sizeof(uidbuf), "%" PRIu32, sasl->uid);
-                assert(n >= 0 && (size_t)n < sizeof(uidbuf));
-
-                c_string_to_hex(uidbuf, n, hexbuf);
-                if (n_input != 2 * (size_t)n || memcmp(input, hexbuf, 2 * n))
+                n = sasl_server_get_hex_uid(sasl, hexbuf);
+                if (n_input != n || memcmp(input, hexbuf, n))
                         failed = true;
         }
 
@@ -243,6 +256,21 @@ int sasl_server_dispatch(SASLServer *sasl, const char *input, size_t n_input, co
                         *outputp = "AGREE_UNIX_FD";
                         *n_outputp = strlen("AGREE_UNIX_FD");
                         sasl->state = SASL_SERVER_STATE_NEGOTIATED_FDS;
+                } else if (n_cmd == strlen("NEGOTIATE_MEMFD") && !strncmp(cmd, "NEGOTIATE_MEMFD", n_cmd) && !n_arg) {
+                        /*
+                         * Non-standard extension: Large payloads may be
+                         * passed as sealed memfds, which are accounted by
+                         * their size rather than as plain FDs. This only
+                         * advertises support, it does not change the
+                         * protocol, and it requires FD passing.
+                         */
+                        if (sasl->state == SASL_SERVER_STATE_NEGOTIATED_FDS) {
+                                *outputp = "AGREE_MEMFD";
+                                *n_outputp = strlen("AGREE_MEMFD");
+                        } else {
+                                *outputp = "ERROR";
+                                *n_outputp = strlen("ERROR");
+                        }
                 } else if (n_cmd == strlen("BEGIN") && !strncmp(cmd, "BEGIN", n_cmd) && !n_arg) {
                         *outputp = NULL;
                         *n_outputp = 0;
@@ -265,3 +293,80 @@ int sasl_server_dispatch(SASLServer *sasl, const char *input, size_t n_input, co
 
         return 0;
 }
+
+static bool sasl_skip(const char **inputp, size_t *n_inputp, const char *token, size_t n_token) {
+        if (*n_inputp < n_token || memcmp(*inputp, token, n_token))
+                return false;
+
+        *inputp += n_token;
+        *n_inputp -= n_token;
+        return true;
+}
+
+/**
+ * sasl_server_dispatch_fast() - handle pipelined SASL exchange at once
+ * @sasl:               SASL server to operate on
+ * @input:              buffered, unparsed input
+ * @n_input:            length of @input
+ * @n_consumedp:        output argument for the number of consumed bytes
+ * @outputp:            output argument for the reply
+ * @n_outputp:          output argument for the length of the reply
+ *
+ * Most clients do not wait for replies during the SASL exchange, but send
+ * their entire exchange in one go (see the top of this file). This checks
+ * whether @input starts with such a canonical, complete exchange, that is:
+ *
+ *   "\0AUTH EXTERNAL\r\nDATA\r\n[NEGOTIATE_UNIX_FD\r\n]BEGIN\r\n"
+ *   "\0AUTH EXTERNAL <hex-uid>\r\n[NEGOTIATE_UNIX_FD\r\n]BEGIN\r\n"
+ *
+ * If it does, the exchange is handled as a whole and the server is done
+ * afterwards. The number of consumed bytes is returned in @n_consumedp, and
+ * all replies are returned as a single block of \r\n separated lines in
+ * @outputp (without trailing \r\n, just like sasl_server_dispatch()).
+ * Any data following the exchange is left untouched.
+ *
+ * If @input does not start with a complete canonical exchange, or if the
+ * exchange was already started, nothing is consumed and 0 is returned in
+ * @n_consumedp. The caller is expected to fall back to
+ * sasl_server_dispatch() in that case.
+ */
+void sasl_server_dispatch_fast(SASLServer *sasl, const char *input, size_t n_input, size_t *n_consumedp, const char **outputp, size_t *n_outputp) {
+        char hexbuf[2 * C_DECIMAL_MAX(uint32_t) + 1];
+        const char *cursor = input, *output;
+        size_t n_cursor = n_input, n_output;
+
+        *n_consumedp = 0;
+        *outputp = NULL;
+        *n_outputp = 0;
+
+        if (sasl->state != SASL_SERVER_STATE_INIT)
+                return;
+
+        if (!sasl_skip(&cursor, &n_cursor, "\0AUTH EXTERNAL", 1 + strlen("AUTH EXTERNAL")))
+                return;
+
+        if (sasl_skip(&cursor, &n_cursor, "\r\nDATA\r\n", strlen("\r\nDATA\r\n"))) {
+                output = sasl->fast_response;
+                n_output = strlen("DATA\r\n") + sizeof(sasl->ok_response);
+        } else {
+                if (!sasl_skip(&cursor, &n_cursor, " ", strlen(" ")) ||
+                    !sasl_skip(&cursor, &n_cursor, hexbuf, sasl_server_get_hex_uid(sasl, hexbuf)) ||
+                    !sasl_skip(&cursor, &n_cursor, "\r\n", strlen("\r\n")))
+                        return;
+
+                output = sasl->fast_response + strlen("DATA\r\n");
+                n_output = sizeof(sasl->ok_response);
+        }
+
+        if (sasl_skip(&cursor, &n_cursor, "NEGOTIATE_UNIX_FD\r\n", strlen("NEGOTIATE_UNIX_FD\r\n")))
+                n_output += strlen("\r\nAGREE_UNIX_FD");
+
+        if (!sasl_skip(&cursor, &n_cursor, "BEGIN\r\n", strlen("BEGIN\r\n")))
+                return;
+
+        sasl->state = SASL_SERVER_STATE_DONE;
+
+        *n_consumedp = n_input - n_cursor;
+        *outputp = output;
+        *n_outputp = n_output;
+}
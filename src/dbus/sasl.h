@@ -55,6 +55,7 @@ enum {
 struct SASLServer {
         unsigned int state;
         uid_t uid;
+        char fast_response[sizeof("DATA\r\nOK 0123456789abcdef0123456789abdcef\r\nAGREE_UNIX_FD") - 1];
         char ok_response[sizeof("OK 0123456789abcdef0123456789abdcef") - 1];
 };
 
@@ -64,6 +65,7 @@ void sasl_server_init(SASLServer *sasl, uid_t uid, const char *guid);
 void sasl_server_deinit(SASLServer *sasl);
 
 int sasl_server_dispatch(SASLServer *sasl, const char *input, size_t n_input, const char **outputp, size_t *n_outputp);
+void sasl_server_dispatch_fast(SASLServer *sasl, const char *input, size_t n_input, size_t *n_consumedp, const char **outputp, size_t *n_outputp);
 
 C_DEFINE_CLEANUP(SASLServer *, sasl_server_deinit);
 
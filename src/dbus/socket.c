@@ -13,6 +13,7 @@
 
 #include <c-list.h>
 #include <c-macro.h>
+#include <limits.h>
 #include <linux/sockios.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
@@ -25,13 +26,18 @@
 #include "dbus/socket.h"
 #include "util/error.h"
 #include "util/fdlist.h"
+#include "util/metrics.h"
 #include "util/user.h"
 
 struct SocketBuffer {
         CList link;
-        UserCharge charges[2];
+        UserCharge charges[3];
 
         size_t n_total;
+        size_t n_fds;
+        uint64_t n_mark;
+        uint64_t timestamp;
+        MetricsHistogram *latency;
         Message *message;
 
         size_t n_vecs;
@@ -47,6 +53,7 @@ static SocketBuffer *socket_buffer_free(SocketBuffer *buffer) {
         if (!buffer)
                 return NULL;
 
+        user_charge_deinit(&buffer->charges[2]);
         user_charge_deinit(&buffer->charges[1]);
         user_charge_deinit(&buffer->charges[0]);
         c_list_unlink_init(&buffer->link);
@@ -68,7 +75,12 @@ static int socket_buffer_new_internal(SocketBuffer **bufferp, size_t n_vecs, siz
         buffer->link = (CList)C_LIST_INIT(buffer->link);
         user_charge_init(&buffer->charges[0]);
         user_charge_init(&buffer->charges[1]);
+        user_charge_init(&buffer->charges[2]);
         buffer->n_total = n_line;
+        buffer->n_fds = 0;
+        buffer->n_mark = 0;
+        buffer->timestamp = 0;
+        buffer->latency = NULL;
         buffer->message = NULL;
         buffer->n_vecs = n_vecs;
         buffer->writer = NULL;
@@ -115,6 +127,7 @@ static int socket_buffer_new_message(SocketBuffer **bufferp,
                 return error_trace(r);
 
         buffer->message = message_ref(message);
+        buffer->n_fds = fdlist_count(message->fds);
         memcpy(buffer->vecs, message->vecs, sizeof(message->vecs));
 
         r = user_charge(socket->user,
@@ -129,7 +142,19 @@ static int socket_buffer_new_message(SocketBuffer **bufferp,
                         &buffer->charges[1],
                         user,
                         USER_SLOT_FDS,
-                        fdlist_count(buffer->message->fds));
+                        buffer->n_fds);
+        if (r)
+                return (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
+
+        /*
+         * Sealed memfds are charged as bytes, separately from the message,
+         * since they stay pinned by the kernel until the peer dequeued them.
+         */
+        r = user_charge(socket->user,
+                        &buffer->charges[2],
+                        user,
+                        USER_SLOT_BYTES,
+                        c_min(message->n_sealed, (size_t)UINT_MAX));
         if (r)
                 return (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
 
@@ -157,6 +182,15 @@ static void socket_buffer_get_line_cursor(SocketBuffer *buffer, char **datap, si
         *posp = &buffer->vecs[0].iov_len;
 }
 
+static size_t socket_buffer_get_size(SocketBuffer *buffer) {
+        size_t i, n = 0;
+
+        for (i = 0; i < buffer->n_vecs; ++i)
+                n += buffer->vecs[i].iov_len;
+
+        return n;
+}
+
 static bool socket_buffer_is_uncomsumed(SocketBuffer *buffer) {
         return !buffer->writer;
 }
@@ -190,11 +224,25 @@ static void socket_discard_input(Socket *socket) {
         socket->in.message = message_unref(socket->in.message);
 }
 
+static void socket_release_buffer(Socket *socket, SocketBuffer *buffer) {
+        socket->out.n_fds -= buffer->n_fds;
+        socket_buffer_free(buffer);
+}
+
+static void socket_account_output(Socket *socket, size_t n_queued, size_t n_buffers, size_t n_fds) {
+        socket->out.n_queued += n_queued;
+        socket->out.n_buffers += n_buffers;
+        socket->out.n_fds += n_fds;
+}
+
 static void socket_discard_output(Socket *socket) {
         SocketBuffer *buffer;
 
         while ((buffer = c_list_first_entry(&socket->out.queue, SocketBuffer, link)))
-                socket_buffer_free(buffer);
+                socket_release_buffer(socket, buffer);
+
+        socket->out.n_queued = 0;
+        socket->out.n_buffers = 0;
 }
 
 /**
@@ -235,7 +283,7 @@ void socket_deinit(Socket *socket) {
         socket_discard_output(socket);
 
         while ((buffer = c_list_first_entry(&socket->out.pending, SocketBuffer, link)))
-                socket_buffer_free(buffer);
+                socket_release_buffer(socket, buffer);
 
         assert(c_list_is_empty(&socket->out.pending));
         assert(c_list_is_empty(&socket->out.queue));
@@ -345,6 +393,39 @@ int socket_dequeue_line(Socket *socket, const char **linep, size_t *np) {
         return 0;
 }
 
+/**
+ * socket_peek_lines() - peek at buffered line input
+ * @socket:             socket to operate on
+ * @datap:              output argument for buffered data
+ * @np:                 output argument for length of buffered data
+ *
+ * This returns all data that is buffered in the input queue, but was not
+ * fetched via socket_dequeue_line(), yet. Nothing is consumed. The caller can
+ * use socket_skip_lines() to drop data it handled. This allows handling
+ * pipelined line-based exchanges in a single pass, rather than line by line.
+ *
+ * Just like socket_dequeue_line(), @datap points directly into the input
+ * buffer and is only valid until the next call to a socket function.
+ *
+ * This function must not be called once the socket has been put into
+ * message-mode.
+ */
+void socket_peek_lines(Socket *socket, const char **datap, size_t *np) {
+        iqueue_peek_lines(&socket->in.queue, datap, np);
+}
+
+/**
+ * socket_skip_lines() - drop buffered line input
+ * @socket:             socket to operate on
+ * @n:                  number of bytes to drop
+ *
+ * This drops the first @n bytes of the data returned by socket_peek_lines().
+ * The caller must make sure to only drop full lines.
+ */
+void socket_skip_lines(Socket *socket, size_t n) {
+        iqueue_skip_lines(&socket->in.queue, n);
+}
+
 /**
  * socket_dequeue() - fetch message from input buffer
  * @socket:             socket to operate on
@@ -465,6 +546,7 @@ int socket_queue_line(Socket *socket, User *user, const char *line_in, size_t n)
                         return error_trace(r);
 
                 c_list_link_tail(&socket->out.queue, &buffer->link);
+                socket_account_output(socket, 0, 1, 0);
         }
 
         socket_buffer_get_line_cursor(buffer, &line_out, &pos);
@@ -476,6 +558,7 @@ int socket_queue_line(Socket *socket, User *user, const char *line_in, size_t n)
         memcpy(line_out, "\r\n", strlen("\r\n"));
         *pos += strlen("\r\n");
 
+        socket_account_output(socket, n + strlen("\r\n"), 0, 0);
         return 0;
 }
 
@@ -483,15 +566,20 @@ int socket_queue_line(Socket *socket, User *user, const char *line_in, size_t n)
  * socket_queue() - queue socket buffer on socket
  * @socket:             socket to operate on
  * @user:               user to charge as
+ * @latency:            histogram to record the queue residency in, or NULL
  * @message:            message to queue
  *
  * This queues @message on the socket @socket, charging @user for the required
  * quota on the socket owner of @socket.
  *
+ * If @latency is given and @message carries a timestamp, the time from that
+ * timestamp until the message was fully written to the socket is recorded in
+ * @latency.
+ *
  * Return: 0 on success, SOCKET_E_QUOTA if quota failed, SOCKET_E_SHUTDOWN if
  *         write-side end is already shutdown, negative error code on failure.
  */
-int socket_queue(Socket *socket, User *user, Message *message) {
+int socket_queue(Socket *socket, User *user, MetricsHistogram *latency, Message *message) {
         _c_cleanup_(socket_buffer_freep) SocketBuffer *buffer = NULL;
         int r;
 
@@ -502,41 +590,19 @@ int socket_queue(Socket *socket, User *user, Message *message) {
         if (r)
                 return error_trace(r);
 
+        if (latency && message->timestamp) {
+                buffer->timestamp = message->timestamp;
+                buffer->latency = latency;
+        }
+
+        socket_account_output(socket, socket_buffer_get_size(buffer), 1, buffer->n_fds);
         c_list_link_tail(&socket->out.queue, &buffer->link);
         buffer = NULL;
         return 0;
 }
 
-static int socket_recvmsg(Socket *socket,
-                          void *buffer,
-                          size_t *from,
-                          size_t to,
-                          FDList **fdsp,
-                          UserCharge *charge_fds) {
-        union {
-                struct cmsghdr cmsg;
-                char buffer[CMSG_SPACE(sizeof(int) * SOCKET_FD_MAX)];
-        } control;
-        struct cmsghdr *cmsg;
-        struct msghdr msg;
-        int r, *fds = NULL;
-        size_t n_fds = 0;
-        ssize_t l;
-
-        assert(to > *from);
-
-        msg = (struct msghdr){
-                .msg_iov = &(struct iovec){
-                        .iov_base = buffer + *from,
-                        .iov_len = to - *from,
-                },
-                .msg_iovlen = 1,
-                .msg_control = &control,
-                .msg_controllen = sizeof(control),
-        };
-
-        l = recvmsg(socket->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
-        if (_c_unlikely_(!l)) {
+static int socket_recv_failed(Socket *socket, ssize_t l) {
+        if (!l) {
                 /*
                  * A 0 return of recvmsg() signals end-of-file. Hence, hangup
                  * the input side, but keep the output alive. We might still
@@ -544,37 +610,62 @@ static int socket_recvmsg(Socket *socket,
                  */
                 socket_hangup_input(socket);
                 return SOCKET_E_LOST_INTEREST;
-        } else if (_c_unlikely_(l < 0)) {
-                switch (errno) {
-                case EAGAIN:
-                        return 0;
-                case ECOMM:
-                case ECONNABORTED:
-                case ECONNRESET:
-                case EHOSTDOWN:
-                case EHOSTUNREACH:
-                case EIO:
-                case ENOBUFS:
-                case ENOMEM:
-                case EPIPE:
-                case EPROTO:
-                case EREMOTEIO:
-                case ESHUTDOWN:
-                case ETIMEDOUT:
-                        /*
-                         * If recvmsg(2) fails, this means both read-side *and*
-                         * write-side are shutdown. A mere read-side hangup is
-                         * signalled by a 0 return-value (handled above).
-                         */
-                        socket_hangup_input(socket);
-                        socket_hangup_output(socket);
-                        return SOCKET_E_LOST_INTEREST;
-                }
+        }
 
-                return error_origin(-errno);
+        switch (errno) {
+        case EAGAIN:
+                return 0;
+        case ECOMM:
+        case ECONNABORTED:
+        case ECONNRESET:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case EIO:
+        case ENOBUFS:
+        case ENOMEM:
+        case EPIPE:
+        case EPROTO:
+        case EREMOTEIO:
+        case ESHUTDOWN:
+        case ETIMEDOUT:
+                /*
+                 * If recvmsg(2) fails, this means both read-side *and*
+                 * write-side are shutdown. A mere read-side hangup is
+                 * signalled by a 0 return-value (handled above).
+                 */
+                socket_hangup_input(socket);
+                socket_hangup_output(socket);
+                return SOCKET_E_LOST_INTEREST;
         }
 
-        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        return error_origin(-errno);
+}
+
+static void socket_recv_discard(struct msghdr *msg) {
+        struct cmsghdr *cmsg;
+        size_t n_fds;
+        int *fds;
+
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_RIGHTS) {
+                        fds = (void *)CMSG_DATA(cmsg);
+                        n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                        while (n_fds)
+                                close(fds[--n_fds]);
+                }
+        }
+}
+
+static int socket_recv_fds(Socket *socket,
+                           struct msghdr *msg,
+                           FDList **fdsp,
+                           UserCharge *charge_fds) {
+        struct cmsghdr *cmsg;
+        int r, *fds = NULL;
+        size_t n_fds = 0;
+
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
                 if (cmsg->cmsg_level == SOL_SOCKET &&
                     cmsg->cmsg_type == SCM_RIGHTS) {
                         /*
@@ -588,7 +679,7 @@ static int socket_recvmsg(Socket *socket,
                 }
         }
 
-        if (msg.msg_flags & MSG_CTRUNC) {
+        if (msg->msg_flags & MSG_CTRUNC) {
                 /*
                  * This flag means the control-buffer was too small to retrieve
                  * all data. If this can be triggered remotely, it means a peer
@@ -662,10 +753,12 @@ static int socket_recvmsg(Socket *socket,
                         r = error_fold(r);
                         goto error;
                 }
+
+                /* this peer passes FDs, so batch its reads from now on */
+                socket->recv_mmsg = true;
         }
 
-        *from += l;
-        return SOCKET_E_PREEMPTED;
+        return 0;
 
 error:
         while (n_fds)
@@ -673,6 +766,117 @@ error:
         return r;
 }
 
+static int socket_recvmsg(Socket *socket,
+                          void *buffer,
+                          size_t *from,
+                          size_t to,
+                          FDList **fdsp,
+                          UserCharge *charge_fds) {
+        union {
+                struct cmsghdr cmsg;
+                char buffer[CMSG_SPACE(sizeof(int) * SOCKET_FD_MAX)];
+        } control;
+        struct msghdr msg;
+        ssize_t l;
+        int r;
+
+        assert(to > *from);
+
+        msg = (struct msghdr){
+                .msg_iov = &(struct iovec){
+                        .iov_base = buffer + *from,
+                        .iov_len = to - *from,
+                },
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+        };
+
+        l = recvmsg(socket->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (_c_unlikely_(l <= 0))
+                return socket_recv_failed(socket, l);
+
+        r = socket_recv_fds(socket, &msg, fdsp, charge_fds);
+        if (r)
+                return r;
+
+        *from += l;
+        return SOCKET_E_PREEMPTED;
+}
+
+static int socket_recvmmsg(Socket *socket,
+                           void *buffer,
+                           size_t *from,
+                           size_t to,
+                           FDList **fdsp,
+                           UserCharge *charge_fds) {
+        union {
+                struct cmsghdr cmsg;
+                char buffer[CMSG_SPACE(sizeof(int) * SOCKET_FD_MAX)];
+        } controls[IQUEUE_SEGMENT_MAX];
+        struct mmsghdr msgs[IQUEUE_SEGMENT_MAX];
+        struct iovec vecs[IQUEUE_SEGMENT_MAX];
+        size_t i, n_vecs, n_slice;
+        int r, n_msgs;
+
+        assert(to > *from);
+
+        /*
+         * The kernel breaks recvmsg(2) after each SKB with FDs, so FD-heavy
+         * streams would cost a syscall per message. Instead, split the input
+         * buffer into segments and fill them with a single recvmmsg(2) call.
+         * Each segment carries its own control data, and thus at most one
+         * FD-set, attached to its last byte.
+         * The segments are then compacted, and the FDs of each segment are
+         * sealed in the input-queue at the boundary they belong to, before
+         * the next segment is appended.
+         */
+        n_vecs = c_min(to - *from, IQUEUE_SEGMENT_MAX);
+        n_slice = (to - *from) / n_vecs;
+
+        for (i = 0; i < n_vecs; ++i) {
+                vecs[i] = (struct iovec){
+                        .iov_base = buffer + *from + i * n_slice,
+                        .iov_len = (i + 1 < n_vecs) ? n_slice : to - *from - i * n_slice,
+                };
+                msgs[i] = (struct mmsghdr){
+                        .msg_hdr = {
+                                .msg_iov = &vecs[i],
+                                .msg_iovlen = 1,
+                                .msg_control = &controls[i],
+                                .msg_controllen = sizeof(controls[i]),
+                        },
+                };
+        }
+
+        n_msgs = recvmmsg(socket->fd, msgs, n_vecs, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL);
+        if (_c_unlikely_(n_msgs < 0))
+                return socket_recv_failed(socket, -1);
+        else if (_c_unlikely_(!n_msgs || !msgs[0].msg_len))
+                return socket_recv_failed(socket, 0);
+
+        /*
+         * A 0-length segment signals end-of-file. Everything received before
+         * it is queued, the end-of-file is picked up by the next read.
+         */
+        for (i = 0; i < (size_t)n_msgs && msgs[i].msg_len; ++i) {
+                iqueue_seal_fds(&socket->in.queue);
+
+                memmove(buffer + *from, vecs[i].iov_base, msgs[i].msg_len);
+
+                r = socket_recv_fds(socket, &msgs[i].msg_hdr, fdsp, charge_fds);
+                if (r) {
+                        while (++i < (size_t)n_msgs)
+                                socket_recv_discard(&msgs[i].msg_hdr);
+                        return r;
+                }
+
+                *from += msgs[i].msg_len;
+        }
+
+        return SOCKET_E_PREEMPTED;
+}
+
 static int socket_dispatch_read(Socket *socket) {
         UserCharge *charge_fds;
         size_t *from, to;
@@ -699,6 +903,19 @@ static int socket_dispatch_read(Socket *socket) {
                 return error_fold(r);
         }
 
+        /*
+         * Peers that pass FDs get their reads batched via recvmmsg(2). This
+         * never applies to reads into a pending target, since those only
+         * ever carry a single message.
+         */
+        if (socket->recv_mmsg && buffer != iqueue_get_target(&socket->in.queue))
+                return socket_recvmmsg(socket,
+                                       buffer,
+                                       from,
+                                       to,
+                                       fds,
+                                       charge_fds);
+
         return socket_recvmsg(socket,
                               buffer,
                               from,
@@ -707,24 +924,56 @@ static int socket_dispatch_read(Socket *socket) {
                               charge_fds);
 }
 
+static int socket_outq(Socket *socket, uint64_t *np) {
+        int r, v;
+
+        r = ioctl(socket->fd, SIOCOUTQ, &v);
+        if (r < 0)
+                return error_origin(-errno);
+
+        *np = v;
+        return 0;
+}
+
 static int socket_dispatch_write(Socket *socket) {
         SocketBuffer *buffer, *safe;
         struct mmsghdr msgs[SOCKET_MMSG_MAX];
         struct msghdr *msg;
-        int r, i, v, n_msgs;
+        uint64_t outq_pre = 0, outq_post, now = 0;
+        bool track = false;
+        int r, i, n_msgs;
 
+        /*
+         * Messages with FDs stay accounted on the receiver until the kernel
+         * queue drained past them. The kernel only tells us how much data is
+         * still queued (SIOCOUTQ), so we keep a running estimate of how much
+         * data we ever queued in @socket->out.n_sent, and mark each message
+         * with FDs with the estimate at the time it was fully queued. Once
+         * the queued data is no more than what was queued after a message,
+         * that message was dequeued by the remote end.
+         *
+         * The estimate is taken as the growth of SIOCOUTQ across each write.
+         * If the remote end dequeues concurrently, the estimate falls short,
+         * which only ever delays the release of a message, but never releases
+         * it early. Once the queue is empty, everything is released, just
+         * like before. This allows us to pipeline any number of messages with
+         * FDs, while the FD quota still represents the client-controlled
+         * state.
+         */
         if (!c_list_is_empty(&socket->out.pending)) {
-                r = ioctl(socket->fd, SIOCOUTQ, &v);
-                if (r < 0)
-                        return error_origin(-errno);
+                r = socket_outq(socket, &outq_pre);
+                if (r)
+                        return error_trace(r);
 
-                if (v > 0) /* treat like EAGAIN */
-                        return 0;
+                c_list_for_each_entry_safe(buffer, safe, &socket->out.pending, link) {
+                        if (outq_pre > socket->out.n_sent - buffer->n_mark)
+                                break;
 
-                c_list_for_each_entry_safe(buffer, safe, &socket->out.pending, link)
-                        socket_buffer_free(buffer);
+                        socket_release_buffer(socket, buffer);
+                }
 
                 socket_might_reset(socket);
+                track = !c_list_is_empty(&socket->out.pending);
         }
 
         if (socket->hup_out)
@@ -749,33 +998,21 @@ static int socket_dispatch_write(Socket *socket) {
                 }
                 msg->msg_flags = 0;
 
-                if (++n_msgs >= (ssize_t)C_ARRAY_SIZE(msgs))
-                        break;
+                if (buffer->message && buffer->message->fds)
+                        track = true;
 
-                /*
-                 * Right now, the only information the kernel gives us about
-                 * outgoing queues is whether there is data queued or not. That
-                 * is, a boolean state. There is some other data, but we cannot
-                 * reliable deduce any useful state from it.
-                 *
-                 * Hence, we only ever queue at most 1 message with FDs on it.
-                 * This way, we can reliably get notified about FDs being
-                 * queued and dequeued.
-                 *
-                 * We could, technically, avoid this and just spam out
-                 * messages. However, we better be notified as early as
-                 * possible about dequeued FDs, so our accounting actually
-                 * represents the real client-controlled state. If we were
-                 * notified late (because we continued queueing), then a client
-                 * might have dequeued the FDs at fault, but we still consider
-                 * them queued and thus might exceed its quota.
-                 */
-                if (buffer->message && fdlist_count(buffer->message->fds))
+                if (++n_msgs >= (ssize_t)C_ARRAY_SIZE(msgs))
                         break;
         }
 
         if (!n_msgs)
-                return SOCKET_E_LOST_INTEREST;
+                return c_list_is_empty(&socket->out.pending) ? SOCKET_E_LOST_INTEREST : 0;
+
+        if (track && c_list_is_empty(&socket->out.pending)) {
+                r = socket_outq(socket, &outq_pre);
+                if (r)
+                        return error_trace(r);
+        }
 
         n_msgs = sendmmsg(socket->fd, msgs, n_msgs, MSG_DONTWAIT | MSG_NOSIGNAL);
         if (n_msgs < 0) {
@@ -829,17 +1066,49 @@ static int socket_dispatch_write(Socket *socket) {
                 return error_origin(-errno);
         }
 
+        if (track) {
+                r = socket_outq(socket, &outq_post);
+                if (r)
+                        return error_trace(r);
+
+                if (outq_post > outq_pre)
+                        socket->out.n_sent += outq_post - outq_pre;
+        }
+
         i = 0;
         c_list_for_each_entry_safe(buffer, safe, &socket->out.queue, link) {
                 if (i >= n_msgs)
                         break;
 
+                socket->out.n_queued -= msgs[i].msg_len;
+
                 if (socket_buffer_consume(buffer, msgs[i].msg_len)) {
+                        --socket->out.n_buffers;
+
+                        if (buffer->latency) {
+                                if (!now)
+                                        now = metrics_get_monotonic();
+
+                                metrics_histogram_sample(buffer->latency, c_max(now, buffer->timestamp) - buffer->timestamp);
+                        }
+
                         if (buffer->message && buffer->message->fds) {
+                                /*
+                                 * Only the FD charges stay with the pending
+                                 * buffer, including the size of sealed
+                                 * memfds. The data was handed to the kernel,
+                                 * so release the message and its byte charge
+                                 * right away, rather than pinning (possibly
+                                 * large) message bodies until the peer
+                                 * dequeued them.
+                                 */
+                                user_charge_deinit(&buffer->charges[0]);
+                                buffer->message = message_unref(buffer->message);
+                                buffer->n_mark = socket->out.n_sent;
                                 c_list_unlink(&buffer->link);
                                 c_list_link_tail(&socket->out.pending, &buffer->link);
                         } else {
-                                socket_buffer_free(buffer);
+                                socket_release_buffer(socket, buffer);
                         }
                 }
 
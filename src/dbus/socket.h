@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include "dbus/message.h"
 #include "dbus/queue.h"
+#include "util/metrics.h"
 #include "util/user.h"
 
 typedef struct FDList FDList;
@@ -42,6 +43,7 @@ struct Socket {
         bool reset : 1;
         bool hup_in : 1;
         bool hup_out : 1;
+        bool recv_mmsg : 1;
 
         struct {
                 IQueue queue;
@@ -52,6 +54,12 @@ struct Socket {
         struct SocketOut {
                 CList queue;
                 CList pending;
+                uint64_t n_sent;
+
+                /* unsent bytes and buffers on @queue, unreleased FDs */
+                size_t n_queued;
+                size_t n_buffers;
+                size_t n_fds;
         } out;
 };
 
@@ -66,10 +74,12 @@ void socket_init(Socket *socket, User *user, int fd);
 void socket_deinit(Socket *socket);
 
 int socket_dequeue_line(Socket *socket, const char **linep, size_t *np);
+void socket_peek_lines(Socket *socket, const char **datap, size_t *np);
+void socket_skip_lines(Socket *socket, size_t n);
 int socket_dequeue(Socket *socket, Message **messagep);
 
 int socket_queue_line(Socket *socket, User *user, const char *line, size_t n);
-int socket_queue(Socket *socket, User *user, Message *message);
+int socket_queue(Socket *socket, User *user, MetricsHistogram *latency, Message *message);
 
 int socket_dispatch(Socket *socket, uint32_t event);
 void socket_shutdown(Socket *socket);
@@ -82,3 +92,19 @@ C_DEFINE_CLEANUP(Socket *, socket_deinit);
 static inline bool socket_is_running(Socket *socket) {
         return !socket->reset;
 }
+
+static inline size_t socket_get_queued(Socket *socket) {
+        return socket->out.n_queued;
+}
+
+static inline size_t socket_get_buffers(Socket *socket) {
+        return socket->out.n_buffers;
+}
+
+static inline size_t socket_get_fds(Socket *socket) {
+        return socket->out.n_fds;
+}
+
+static inline bool socket_has_output(Socket *socket) {
+        return !c_list_is_empty(&socket->out.queue) || !c_list_is_empty(&socket->out.pending);
+}
@@ -2,9 +2,17 @@
  * Test D-Bus Message Abstraction
  */
 
+#include <c-dvar.h>
+#include <c-dvar-type.h>
 #include <c-macro.h>
+#include <endian.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "dbus/message.h"
+#include "dbus/protocol.h"
+#include "util/fdlist.h"
 
 static void test_setup(void) {
         _c_cleanup_(message_unrefp) Message *m1 = NULL, *m2, *m3;
@@ -61,8 +69,249 @@ static void test_size(void) {
         assert(r == MESSAGE_E_TOO_LARGE);
 }
 
+static Message *test_new_message(const char *signature, const void *body, size_t n_body) {
+        size_t n_signature = strlen(signature), n_fields = 1 + 3 + 1 + n_signature + 1;
+        Message *message;
+        uint8_t *data;
+        int r;
+
+        /*
+         * Create a little-endian message of an unknown type (so no header
+         * fields are mandatory), with only a signature field, and append the
+         * raw body.
+         */
+        data = calloc(1, 16 + c_align8(n_fields) + n_body);
+        assert(data);
+
+        memcpy(data, (uint8_t[]){ 'l', 128, 0, 1 }, 4);
+        memcpy(data + 8, &(uint32_t){ htole32(1) }, 4);
+        memcpy(data + 12, &(uint32_t){ htole32(n_fields) }, 4);
+        memcpy(data + 16, (uint8_t[]){ DBUS_MESSAGE_FIELD_SIGNATURE, 1, 'g', 0, n_signature }, 5);
+        memcpy(data + 16 + 5, signature, n_signature);
+        memcpy(data + 16 + c_align8(n_fields), body, n_body);
+
+        r = message_new_outgoing(&message, data, 16 + c_align8(n_fields) + n_body);
+        assert(!r);
+
+        r = message_parse_metadata(message);
+        assert(!r);
+
+        return message;
+}
+
+static void test_map(void) {
+        MessageHeader hdr = { .endian = 'l' };
+        Message *m;
+        int r;
+
+        /* verify messages of at least MESSAGE_MAP_MIN bytes get mapped */
+
+        hdr.n_body = MESSAGE_MAP_MIN - sizeof(MessageHeader) - 1;
+        r = message_new_incoming(&m, hdr);
+        assert(r == 0);
+        assert(m->n_data == MESSAGE_MAP_MIN - 1);
+        assert(!m->mapped_data && m->data == (void *)(m + 1));
+        message_unref(m);
+
+        hdr.n_body = MESSAGE_MAP_MIN - sizeof(MessageHeader);
+        r = message_new_incoming(&m, hdr);
+        assert(r == 0);
+        assert(m->n_data == MESSAGE_MAP_MIN);
+        assert(m->mapped_data && m->n_mapped == MESSAGE_MAP_MIN);
+        assert(!memcmp(m->header, &hdr, sizeof(hdr)));
+
+        /* the mapping is writable up to its last byte */
+        ((uint8_t *)m->body)[m->n_body - 1] = 0xff;
+        message_unref(m);
+}
+
+static void test_sealed(void) {
+        _c_cleanup_(message_unrefp) Message *m = NULL;
+        uint8_t *data;
+        int r, fd;
+
+        /*
+         * Sealed memfds are sized for accounting, whether the sender
+         * negotiated memfd passing or not. The message carries a single
+         * 'h' argument, with the memfd attached.
+         */
+
+        fd = memfd_create("test-message", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        assert(fd >= 0);
+        r = ftruncate(fd, 4096);
+        assert(r >= 0);
+        r = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+        assert(r >= 0);
+
+        data = calloc(1, 16 + 16 + 8);
+        assert(data);
+
+        memcpy(data, (uint8_t[]){ 'l', 128, 0, 1 }, 4);
+        memcpy(data + 8, &(uint32_t){ htole32(1) }, 4);
+        memcpy(data + 12, &(uint32_t){ htole32(16) }, 4);
+        memcpy(data + 16, (uint8_t[]){ DBUS_MESSAGE_FIELD_SIGNATURE, 1, 'g', 0, 1, 'h', 0 }, 7);
+        memcpy(data + 24, (uint8_t[]){ DBUS_MESSAGE_FIELD_UNIX_FDS, 1, 'u', 0 }, 4);
+        memcpy(data + 28, &(uint32_t){ htole32(1) }, 4);
+
+        r = message_new_outgoing(&m, data, 16 + 16 + 8);
+        assert(!r);
+
+        r = fdlist_new_with_fds(&m->fds, &fd, 1);
+        assert(!r);
+
+        r = message_parse_metadata(m);
+        assert(!r);
+        assert(m->n_sealed == 4096);
+
+        m = message_unref(m);
+        close(fd);
+}
+
+static void test_body(void) {
+        static const struct {
+                const char *signature;
+                const char *body;
+                size_t n_body;
+                bool valid;
+        } tests[] = {
+                { "",           "",                                                     0,      true },
+                { "ay",         "\3\0\0\0abc",                                          7,      true },
+                { "ab",         "\10\0\0\0\0\0\0\0\1\0\0\0",                            12,     true },
+                { "ab",         "\4\0\0\0\2\0\0\0",                                     8,      false },
+                { "at",         "\10\0\0\0\0\0\0\0\1\0\0\0\0\0\0\0",                    16,     true },
+                { "at",         "\4\0\0\0\0\0\0\0\1\0\0\0",                             12,     false },
+                { "as",         "\17\0\0\0\1\0\0\0a\0\0\0\2\0\0\0bc\0",                 19,     true },
+                { "yu",         "\1\0\0\0\2\0\0\0",                                     8,      true },
+                { "yu",         "\1\1\0\0\2\0\0\0",                                     8,      false },
+                { "yu",         "\1\0\0\0\2\0\0\0\0",                                   9,      false },
+                { "s",          "\2\0\0\0\303\274\0",                                   7,      true },
+                { "s",          "\2\0\0\0\303\50\0",                                    7,      false },
+                { "s",          "\3\0\0\0\355\240\200\0",                               8,      false },
+                { "s",          "\12\0\0\0abcdefghij\0",                                15,     true },
+                { "s",          "\11\0\0\0abcd\0efgh\0",                                14,     false },
+                { "s",          "\3\0\0\0abc",                                          7,      false },
+                { "o",          "\4\0\0\0/a_0\0",                                       9,      true },
+                { "o",          "\4\0\0\0/a//\0",                                       9,      false },
+        };
+        size_t i;
+        int r;
+
+        for (i = 0; i < C_ARRAY_SIZE(tests); ++i) {
+                _c_cleanup_(message_unrefp) Message *message = NULL;
+
+                message = test_new_message(tests[i].signature, tests[i].body, tests[i].n_body);
+
+                r = message_parse_body(message);
+                assert(tests[i].valid ? !r : r == MESSAGE_E_INVALID_BODY);
+        }
+}
+
+static void test_args(void) {
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        int r;
+
+        message = test_new_message("ysauo", "\1\0\0\0\3\0\0\0foo\0\0\0\0\0\3\0\0\0/ab\0", 24);
+
+        r = message_parse_body(message);
+        assert(!r);
+
+        assert(!message->metadata.args[0].element);
+        assert(message->metadata.args[1].element == 's');
+        assert(!strcmp(message->metadata.args[1].value, "foo"));
+        assert(!message->metadata.args[2].element);
+        assert(message->metadata.args[3].element == 'o');
+        assert(!strcmp(message->metadata.args[3].value, "/ab"));
+}
+
+static void test_lazy_body(void) {
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        int r;
+
+        /* parsing the header must not touch the body */
+
+        message = test_new_message("s", "\3\0\0\0foo\0", 8);
+        assert(message->parsed && !message->parsed_body);
+        assert(!message->metadata.args[0].element);
+
+        r = message_parse_body(message);
+        assert(!r && message->parsed_body);
+        assert(message->metadata.args[0].element == 's');
+        assert(!strcmp(message->metadata.args[0].value, "foo"));
+
+        /* further calls are no-ops */
+
+        r = message_parse_body(message);
+        assert(!r && message->metadata.args[0].element == 's');
+
+        message = message_unref(message);
+
+        /* invalid bodies are reported once, and yield no arguments */
+
+        message = test_new_message("ss", "\3\0\0\0foo\0\0\0\11\0\0\0", 12);
+
+        r = message_parse_body(message);
+        assert(r == MESSAGE_E_INVALID_BODY);
+        assert(!message->metadata.args[0].element);
+
+        r = message_parse_body(message);
+        assert(!r && !message->metadata.args[0].element);
+}
+
+static void test_marshal_string(void) {
+        static const CDVarType type[] = {
+                C_DVAR_T_INIT(
+                        C_DVAR_T_TUPLE4(
+                                C_DVAR_T_y,
+                                C_DVAR_T_s,
+                                C_DVAR_T_s,
+                                C_DVAR_T_s
+                        )
+                )
+        };
+        static const char *strings[] = { "", "foo", "com.example.foobar" };
+        _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
+        alignas(uint64_t) uint8_t buffer[64];
+        size_t i, n_data, n_buffer;
+        void *data;
+        int r;
+
+        /*
+         * Verify that hand-marshalled strings are identical to what c-dvar
+         * produces, including the padding in front of unaligned strings.
+         */
+
+        c_dvar_begin_write(&var, type, 1);
+        c_dvar_write(&var, "(ysss)", 7, strings[0], strings[1], strings[2]);
+        r = c_dvar_end_write(&var, &data, &n_data);
+        assert(!r);
+
+        memset(buffer, 0xff, sizeof(buffer));
+        buffer[0] = 7;
+
+        n_buffer = message_marshal_string(NULL, 1, strings[0]);
+        n_buffer = message_marshal_string(NULL, n_buffer, strings[1]);
+        n_buffer = message_marshal_string(NULL, n_buffer, strings[2]);
+        assert(n_buffer == n_data);
+        assert(n_buffer <= sizeof(buffer));
+
+        n_buffer = 1;
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                n_buffer = message_marshal_string(buffer, n_buffer, strings[i]);
+
+        assert(n_buffer == n_data);
+        assert(!memcmp(buffer, data, n_data));
+
+        free(data);
+}
+
 int main(int argc, char **argv) {
         test_setup();
         test_size();
+        test_map();
+        test_sealed();
+        test_body();
+        test_args();
+        test_lazy_body();
+        test_marshal_string();
         return 0;
 }
@@ -221,6 +221,95 @@ static void test_in_special(void) {
                 assert(fdlist_get(f, 0) == 0);
                 fdlist_free(f);
         }
+
+        iqueue_deinit(&iq);
+        iqueue_init(&iq, NULL);
+
+        /*
+         * Test sealed FD-sets. We push two segments with a single cursor, as
+         * done for recvmmsg(2), each with its own FD, and seal the first one
+         * before appending the second. We then verify each FD is attached to
+         * the last byte of its own segment, and that a target spanning both
+         * segments is rejected.
+         */
+        {
+                char data[128];
+                UserCharge *charge_fds;
+                size_t *from, to;
+                void *buffer;
+                FDList **fds, *f;
+
+                /* push in 1 byte with 1 fd, seal, and 2 bytes with 1 fd */
+                r = iqueue_get_cursor(&iq,
+                                      &buffer,
+                                      &from,
+                                      &to,
+                                      &fds,
+                                      &charge_fds);
+                assert(!r);
+                assert(to - *from >= 128);
+
+                memcpy(buffer + *from, (char [1]){}, 1);
+                *from += 1;
+                r = fdlist_new_with_fds(fds, (int [1]){}, 1);
+                assert(!r);
+
+                iqueue_seal_fds(&iq);
+                assert(!*fds);
+
+                memcpy(buffer + *from, (char [2]){}, 2);
+                *from += 2;
+                r = fdlist_new_with_fds(fds, (int [1]){ 1 }, 1);
+                assert(!r);
+
+                /* fetch 1 byte target and verify it got the *FIRST* fd */
+                r = iqueue_set_target(&iq, data, 1);
+                assert(!r);
+
+                r = iqueue_pop_data(&iq, &f);
+                assert(!r);
+                assert(fdlist_count(f) == 1);
+                assert(fdlist_get(f, 0) == 0);
+                fdlist_free(f);
+
+                /* fetch 2 byte target and verify it got the *SECOND* fd */
+                r = iqueue_set_target(&iq, data, 2);
+                assert(!r);
+
+                r = iqueue_pop_data(&iq, &f);
+                assert(!r);
+                assert(fdlist_count(f) == 1);
+                assert(fdlist_get(f, 0) == 1);
+                fdlist_free(f);
+
+                /* push the same segments again */
+                r = iqueue_get_cursor(&iq,
+                                      &buffer,
+                                      &from,
+                                      &to,
+                                      &fds,
+                                      &charge_fds);
+                assert(!r);
+
+                memcpy(buffer + *from, (char [1]){}, 1);
+                *from += 1;
+                r = fdlist_new_with_fds(fds, (int [1]){}, 1);
+                assert(!r);
+
+                iqueue_seal_fds(&iq);
+
+                memcpy(buffer + *from, (char [2]){}, 2);
+                *from += 2;
+                r = fdlist_new_with_fds(fds, (int [1]){ 1 }, 1);
+                assert(!r);
+
+                /* fetch 3 byte target and verify it is rejected */
+                r = iqueue_set_target(&iq, data, 3);
+                assert(!r);
+
+                r = iqueue_pop_data(&iq, &f);
+                assert(r == IQUEUE_E_VIOLATION);
+        }
 }
 
 static void test_in_lines(void) {
@@ -68,6 +68,15 @@ static void test_server_conversations(void) {
                 "NEGOTIATE_UNIX_FD",
                 "BEGIN",
 
+                /* test memfd negotiation */
+                NULL,
+                "\0AUTH EXTERNAL",
+                "DATA",
+                "NEGOTIATE_MEMFD",
+                "NEGOTIATE_UNIX_FD",
+                "NEGOTIATE_MEMFD",
+                "BEGIN",
+
                 /* end */
                 NULL,
         };
@@ -107,6 +116,14 @@ static void test_server_conversations(void) {
                 "AGREE_UNIX_FD",
                 NULL,
 
+                NULL,
+                "DATA",
+                "OK 30313233343536373839616263646566",
+                "ERROR",
+                "AGREE_UNIX_FD",
+                "AGREE_MEMFD",
+                NULL,
+
                 NULL,
         };
         _c_cleanup_(sasl_server_deinit) SASLServer sasl = SASL_SERVER_NULL;
@@ -145,6 +162,65 @@ static void test_server_conversations(void) {
         }
 }
 
+static void test_server_fast(void) {
+        static const struct {
+                const char *request;
+                size_t n_request;
+                size_t n_consumed;
+                const char *reply;
+        } tests[] = {
+                {
+                        "\0AUTH EXTERNAL\r\nDATA\r\nNEGOTIATE_UNIX_FD\r\nBEGIN\r\nl\1",
+                        50,
+                        48,
+                        "DATA\r\nOK 30313233343536373839616263646566\r\nAGREE_UNIX_FD",
+                },
+                {
+                        "\0AUTH EXTERNAL 31\r\nNEGOTIATE_UNIX_FD\r\nBEGIN\r\n",
+                        45,
+                        45,
+                        "OK 30313233343536373839616263646566\r\nAGREE_UNIX_FD",
+                },
+                {
+                        "\0AUTH EXTERNAL\r\nDATA\r\nBEGIN\r\n",
+                        29,
+                        29,
+                        "DATA\r\nOK 30313233343536373839616263646566",
+                },
+                /* partial, mismatching uid, and non-canonical exchanges */
+                { "\0AUTH EXTERNAL\r\nDATA\r\nNEGOTIATE_UNIX_FD\r\n", 41, 0, NULL },
+                { "\0AUTH EXTERNAL 30\r\nBEGIN\r\n", 26, 0, NULL },
+                { "\0AUTH EXTERNAL\r\nDATA 31\r\nBEGIN\r\n", 32, 0, NULL },
+                { "\0AUTH\r\n", 7, 0, NULL },
+        };
+        _c_cleanup_(sasl_server_deinit) SASLServer sasl = SASL_SERVER_NULL;
+        const char *reply;
+        size_t i, n_consumed, n_reply;
+
+        for (i = 0; i < C_ARRAY_SIZE(tests); ++i) {
+                sasl_server_init(&sasl, 1, "0123456789abcdef");
+
+                sasl_server_dispatch_fast(&sasl,
+                                          tests[i].request,
+                                          tests[i].n_request,
+                                          &n_consumed,
+                                          &reply,
+                                          &n_reply);
+                assert(n_consumed == tests[i].n_consumed);
+
+                if (tests[i].reply) {
+                        assert(n_reply == strlen(tests[i].reply));
+                        assert(!memcmp(reply, tests[i].reply, n_reply));
+                        assert(sasl_server_is_done(&sasl));
+                } else {
+                        assert(!reply && !n_reply);
+                        assert(!sasl_server_is_done(&sasl));
+                }
+
+                sasl_server_deinit(&sasl);
+        }
+}
+
 static void test_client_run(void) {
         _c_cleanup_(sasl_client_deinit) SASLClient sasl = SASL_CLIENT_NULL;
         const char *output;
@@ -172,6 +248,7 @@ int main(int argc, char **argv) {
         test_server_setup();
         test_client_setup();
         test_server_conversations();
+        test_server_fast();
         test_client_run();
         return 0;
 }
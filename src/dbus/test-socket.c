@@ -7,8 +7,12 @@
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include "dbus/message.h"
 #include "dbus/socket.h"
+#include "util/fdlist.h"
+#include "util/metrics.h"
+#include "util/user.h"
 
 static void test_setup(void) {
         _c_cleanup_(socket_deinit) Socket server = SOCKET_NULL(server), client = SOCKET_NULL(client);
@@ -38,8 +42,13 @@ static void test_line(void) {
         r = socket_queue_line(&client, NULL, test, strlen(test));
         assert(r == 0);
 
+        /* both lines share a single buffer */
+        assert(client.out.n_queued == 2 * strlen("TEST\r\n"));
+        assert(client.out.n_buffers == 1);
+
         r = socket_dispatch(&client, EPOLLOUT);
         assert(r == SOCKET_E_LOST_INTEREST);
+        assert(!client.out.n_queued && !client.out.n_buffers);
         r = socket_dispatch(&server, EPOLLIN);
         assert(!r || r == SOCKET_E_PREEMPTED);
 
@@ -60,6 +69,7 @@ static void test_line(void) {
 static void test_message(void) {
         _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
         _c_cleanup_(message_unrefp) Message *message1 = NULL, *message2 = NULL;
+        MetricsHistogram latency = METRICS_HISTOGRAM_INIT;
         MessageHeader header = {
                 .endian = 'l',
         };
@@ -77,11 +87,17 @@ static void test_message(void) {
         r = message_new_incoming(&message1, header);
         assert(r == 0);
 
-        r = socket_queue(&client, NULL, message1);
+        message1->timestamp = metrics_get_monotonic();
+
+        r = socket_queue(&client, NULL, &latency, message1);
         assert(!r);
+        assert(client.out.n_queued == message1->n_data);
+        assert(client.out.n_buffers == 1 && !client.out.n_fds);
 
         r = socket_dispatch(&client, EPOLLOUT);
         assert(r == SOCKET_E_LOST_INTEREST);
+        assert(!client.out.n_queued && !client.out.n_buffers);
+        assert(latency.metrics.count == 1);
         r = socket_dispatch(&server, EPOLLIN);
         assert(!r || r == SOCKET_E_PREEMPTED);
 
@@ -89,11 +105,207 @@ static void test_message(void) {
         assert(!r && message2);
 
         assert(memcmp(message1->header, message2->header, sizeof(header)) == 0);
+
+        metrics_histogram_deinit(&latency);
+}
+
+static void test_pending(void) {
+        Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        Message *message1, *message2;
+        MessageHeader header = {
+                .endian = 'l',
+                .n_body = 8,
+        };
+        UserRegistry registry;
+        User *user;
+        unsigned int n_bytes, n_fds;
+        int pair[2], fds[2], r;
+
+        /*
+         * A message with FDs stays pending until the peer dequeued it, but
+         * only its FDs stay charged. The message itself and its bytes are
+         * released as soon as it was handed to the kernel.
+         */
+
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ 1024 * 1024, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &user, 1);
+        assert(!r);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        r = pipe(fds);
+        assert(r >= 0);
+
+        socket_init(&client, user, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        n_bytes = user->slots[USER_SLOT_BYTES].n;
+        n_fds = user->slots[USER_SLOT_FDS].n;
+
+        r = message_new_incoming(&message1, header);
+        assert(!r);
+
+        r = fdlist_new_with_fds(&message1->fds, fds, 1);
+        assert(!r);
+
+        r = socket_queue(&client, NULL, NULL, message1);
+        assert(!r);
+        assert(message1->n_refs == 2);
+        assert(user->slots[USER_SLOT_BYTES].n < n_bytes);
+        assert(user->slots[USER_SLOT_FDS].n == n_fds - 1);
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(!r);
+        assert(!client.out.n_queued && !client.out.n_buffers);
+        assert(!c_list_is_empty(&client.out.pending));
+        assert(message1->n_refs == 1);
+        assert(user->slots[USER_SLOT_BYTES].n == n_bytes);
+        assert(user->slots[USER_SLOT_FDS].n == n_fds - 1);
+
+        /* once the peer dequeued the message, its FDs are released */
+
+        r = socket_dispatch(&server, EPOLLIN);
+        assert(!r || r == SOCKET_E_PREEMPTED);
+
+        r = socket_dequeue(&server, &message2);
+        assert(!r && message2);
+        assert(fdlist_count(message2->fds) == 1);
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        assert(c_list_is_empty(&client.out.pending));
+        assert(!client.out.n_fds);
+        assert(user->slots[USER_SLOT_FDS].n == n_fds);
+
+        message_unref(message2);
+        message_unref(message1);
+        socket_deinit(&server);
+        socket_deinit(&client);
+        user_unref(user);
+        user_registry_deinit(&registry);
+        close(fds[1]);
+        close(fds[0]);
+        close(pair[1]);
+        close(pair[0]);
+}
+
+static void test_pipeline(void) {
+        Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        Message *messages[4], *message;
+        MessageHeader header = {
+                .endian = 'l',
+                .n_body = 8,
+        };
+        UserRegistry registry;
+        User *user;
+        unsigned int n_fds;
+        size_t i;
+        int pair[2], fds[2], r;
+
+        /*
+         * Several messages with FDs can be written without waiting for the
+         * peer to dequeue each of them. They all stay pending, with their FDs
+         * charged, until the peer read past them. Each message is written
+         * separately here, so each gets its own mark, and reading only some
+         * of them releases just those.
+         */
+
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ 1024 * 1024, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &user, 1);
+        assert(!r);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        r = pipe(fds);
+        assert(r >= 0);
+
+        socket_init(&client, user, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        n_fds = user->slots[USER_SLOT_FDS].n;
+
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i) {
+                r = message_new_incoming(&messages[i], header);
+                assert(!r);
+
+                r = fdlist_new_with_fds(&messages[i]->fds, fds, 2);
+                assert(!r);
+
+                r = socket_queue(&client, NULL, NULL, messages[i]);
+                assert(!r);
+
+                r = socket_dispatch(&client, EPOLLOUT);
+                assert(!r);
+                assert(!client.out.n_queued && !client.out.n_buffers);
+        }
+
+        /* all messages were written, and stay pending */
+
+        assert(client.out.n_fds == 2 * C_ARRAY_SIZE(messages));
+        assert(user->slots[USER_SLOT_FDS].n == n_fds - 2 * C_ARRAY_SIZE(messages));
+
+        /* nothing is released while the peer did not read anything */
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(!r);
+        assert(client.out.n_fds == 2 * C_ARRAY_SIZE(messages));
+
+        /* the kernel never merges messages with FDs, so this reads exactly one */
+
+        r = socket_dispatch(&server, EPOLLIN);
+        assert(!r || r == SOCKET_E_PREEMPTED);
+
+        r = socket_dequeue(&server, &message);
+        assert(!r && message);
+        assert(fdlist_count(message->fds) == 2);
+        message_unref(message);
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(!r);
+        assert(client.out.n_fds == 2 * (C_ARRAY_SIZE(messages) - 1));
+        assert(user->slots[USER_SLOT_FDS].n == n_fds - 2 * (C_ARRAY_SIZE(messages) - 1));
+
+        /* once the peer read everything, all charges are gone */
+
+        for (i = 1; i < C_ARRAY_SIZE(messages); ++i) {
+                r = socket_dispatch(&server, EPOLLIN);
+                assert(!r || r == SOCKET_E_PREEMPTED);
+
+                r = socket_dequeue(&server, &message);
+                assert(!r && message);
+                assert(fdlist_count(message->fds) == 2);
+                message_unref(message);
+        }
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        assert(c_list_is_empty(&client.out.pending));
+        assert(!client.out.n_fds);
+        assert(user->slots[USER_SLOT_FDS].n == n_fds);
+
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i)
+                message_unref(messages[i]);
+        socket_deinit(&server);
+        socket_deinit(&client);
+        user_unref(user);
+        user_registry_deinit(&registry);
+        close(fds[1]);
+        close(fds[0]);
+        close(pair[1]);
+        close(pair[0]);
 }
 
 int main(int argc, char **argv) {
         test_setup();
         test_line();
         test_message();
+        test_pending();
+        test_pipeline();
         return 0;
 }
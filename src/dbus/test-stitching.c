@@ -135,6 +135,7 @@ static void test_assert_message(Message *message, size_t before, const char *sen
 }
 
 static void test_stitching(void) {
+        MessageSender sender;
         Message *message;
         Address addr;
         size_t i, n;
@@ -172,8 +173,11 @@ static void test_stitching(void) {
                 address_from_string(&addr, to);
                 assert(addr.type == ADDRESS_TYPE_ID);
 
+                message_sender_init(&sender, addr.id);
+                assert(!strcmp(message_sender_get_name(&sender), to));
+
                 message = test_new_message(i % 13, from, i / 17, NULL);
-                message_stitch_sender(message, addr.id);
+                message_stitch_sender(message, &sender);
                 test_assert_message(message, i % 13, to, i / 17);
                 message_unref(message);
 
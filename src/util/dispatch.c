@@ -49,6 +49,7 @@
 #include <sys/epoll.h>
 #include "util/dispatch.h"
 #include "util/error.h"
+#include "util/metrics.h"
 
 /**
  * dispatch_file_init() - initialize dispatch file
@@ -209,6 +210,25 @@ void dispatch_file_clear(DispatchFile *file, uint32_t mask) {
                 c_list_unlink_init(&file->ready_link);
 }
 
+/**
+ * dispatch_file_schedule() - mark kernel event mask
+ * @file:               dispatch file
+ * @mask:               event mask
+ *
+ * This is the inverse of dispatch_file_clear() and marks the events in @mask
+ * as pending, as if the kernel signalled them. This is needed if the user
+ * stopped handling an event before it was fully handled (e.g., data was read
+ * but not yet processed), and wants to be notified again once it resumes.
+ * As usual, the callback must be prepared for spurious events.
+ */
+void dispatch_file_schedule(DispatchFile *file, uint32_t mask) {
+        assert(!(mask & ~file->kernel_mask));
+
+        file->events |= mask;
+        if ((file->user_mask & file->events) && !c_list_is_linked(&file->ready_link))
+                c_list_link_tail(&file->context->ready_list, &file->ready_link);
+}
+
 /**
  * dispatch_context_init() - initialize dispatch context
  * @ctx:                dispatch context
@@ -241,6 +261,10 @@ void dispatch_context_deinit(DispatchContext *ctx) {
         assert(!ctx->n_files);
         assert(c_list_is_empty(&ctx->ready_list));
 
+        free(ctx->events);
+        ctx->events = NULL;
+        ctx->n_events = 0;
+        metrics_deinit(&ctx->metrics);
         ctx->epoll_fd = c_close(ctx->epoll_fd);
 }
 
@@ -257,27 +281,39 @@ void dispatch_context_deinit(DispatchContext *ctx) {
  * dispatch-files. Nothing is dispatched! The data is merely fetched from the
  * kernel.
  *
+ * At most @ctx->max_events events are fetched at once. Since all files are
+ * edge-triggered, any further events stay queued in the kernel and are fetched
+ * by the next call. This bounds the time until the first fetched events are
+ * dispatched, regardless of how many files are registered. The number of
+ * events fetched per call is recorded in @ctx->metrics.
+ *
  * Return: 0 on success, negative error code on failure.
  */
 int dispatch_context_poll(DispatchContext *ctx, int timeout) {
-        _c_cleanup_(c_freep) void *buffer = NULL;
         struct epoll_event *events, *e;
         DispatchFile *f;
-        size_t n;
+        size_t n, n_max, n_events;
         int r;
 
-        n = ctx->n_files * sizeof(*events);
-        if (n > 128UL * 1024UL) {
-                buffer = malloc(n);
-                if (!buffer)
+        /*
+         * The event array is kept across calls and only ever grown, up to
+         * @ctx->max_events entries. There is no point in fetching more events
+         * than there are files, so its size follows the number of files.
+         */
+        n_max = c_max(ctx->max_events, 1UL);
+        n = c_min(c_max(ctx->n_files, 1UL), n_max);
+        if (_c_unlikely_(n > ctx->n_events)) {
+                n_events = c_min(c_max(n, ctx->n_events * 2), n_max);
+
+                events = realloc(ctx->events, n_events * sizeof(*events));
+                if (!events)
                         return error_origin(-ENOMEM);
 
-                events = buffer;
-        } else {
-                events = alloca(n);
+                ctx->events = events;
+                ctx->n_events = n_events;
         }
 
-        r = epoll_wait(ctx->epoll_fd, events, ctx->n_files, timeout);
+        r = epoll_wait(ctx->epoll_fd, ctx->events, n, timeout);
         if (r < 0) {
                 if (errno == EINTR)
                         return 0;
@@ -285,8 +321,10 @@ int dispatch_context_poll(DispatchContext *ctx, int timeout) {
                 return error_origin(-errno);
         }
 
+        metrics_sample_value(&ctx->metrics, r);
+
         while (r > 0) {
-                e = &events[--r];
+                e = &ctx->events[--r];
                 f = e->data.ptr;
 
                 assert(f->context == ctx);
@@ -322,6 +360,12 @@ int dispatch_context_dispatch(DispatchContext *ctx) {
         if (r)
                 return error_fold(r);
 
+        /*
+         * Everything handled in this round became ready no later than now, so
+         * a single clock read suffices to timestamp all of it.
+         */
+        ctx->timestamp = metrics_get_monotonic();
+
         /*
          * We want to dispatch @ctx->ready_list exactly once here. The trivial
          * approach would be to iterate it via c_list_for_each(). However, we
@@ -8,6 +8,11 @@
 #include <c-macro.h>
 #include <c-ref.h>
 #include <stdlib.h>
+#include "util/metrics.h"
+
+struct epoll_event;
+
+#define DISPATCH_CONTEXT_EVENTS_MAX (512UL) /* randomly picked, no tuning done so far */
 
 enum {
         _DISPATCH_E_SUCCESS,
@@ -49,6 +54,7 @@ void dispatch_file_deinit(DispatchFile *file);
 void dispatch_file_select(DispatchFile *file, uint32_t mask);
 void dispatch_file_deselect(DispatchFile *file, uint32_t mask);
 void dispatch_file_clear(DispatchFile *file, uint32_t mask);
+void dispatch_file_schedule(DispatchFile *file, uint32_t mask);
 
 /* contexts */
 
@@ -56,11 +62,20 @@ struct DispatchContext {
         CList ready_list;
         int epoll_fd;
         size_t n_files;
+
+        struct epoll_event *events;
+        size_t n_events;
+        size_t max_events;
+
+        uint64_t timestamp;
+        Metrics metrics;
 };
 
 #define DISPATCH_CONTEXT_NULL(_x) {                             \
                 .ready_list = C_LIST_INIT((_x).ready_list),     \
                 .epoll_fd = -1,                                 \
+                .max_events = DISPATCH_CONTEXT_EVENTS_MAX,      \
+                .metrics = METRICS_INIT,                        \
         }
 
 int dispatch_context_init(DispatchContext *ctx);
@@ -10,8 +10,10 @@
  */
 
 #include <c-macro.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include "util/error.h"
 #include "util/fdlist.h"
 
@@ -146,3 +148,37 @@ int fdlist_steal(FDList *list, size_t index) {
 
         return fd;
 }
+
+/**
+ * fdlist_get_sealed_size() - sum up size of sealed memfds
+ * @list:               fdlist to operate on
+ *
+ * This iterates all FDs in @list and sums up the file-sizes of all FDs that
+ * are sealed against shrinking and growing. Only those have a size that
+ * cannot change while the FD is in flight, and hence can be accounted
+ * reliably. Any other FD (including FDs that do not support sealing at all) is
+ * ignored.
+ *
+ * Return: Total size of all sealed FDs in bytes.
+ */
+size_t fdlist_get_sealed_size(FDList *list) {
+        size_t i, n, size = 0;
+        struct stat st;
+        int *p, seals;
+
+        p = fdlist_data(list);
+        n = fdlist_count(list);
+
+        for (i = 0; i < n; ++i) {
+                seals = fcntl(p[i], F_GET_SEALS);
+                if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW))
+                        continue;
+
+                if (fstat(p[i], &st) < 0 || st.st_size < 0)
+                        continue;
+
+                size += st.st_size;
+        }
+
+        return size;
+}
@@ -20,6 +20,7 @@ int fdlist_new_consume_fds(FDList **listp, const int *fds, size_t n_fds);
 FDList *fdlist_free(FDList *list);
 void fdlist_truncate(FDList *list, size_t n_fds);
 int fdlist_steal(FDList *list, size_t index);
+size_t fdlist_get_sealed_size(FDList *list);
 
 C_DEFINE_CLEANUP(FDList *, fdlist_free);
 
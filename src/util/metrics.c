@@ -1,8 +1,19 @@
 /*
  * Metrics Helper
  *
- * The metrics object is used to compute the min/max/avg/std deviation of samples of
- * CPU time, in fixed size and without memory allocations.
+ * The metrics object is used to compute the min/max/avg/std deviation of samples,
+ * in fixed size and without memory allocations. Samples are either durations
+ * measured on a configurable clock, or arbitrary values.
+ *
+ * By default, durations are sampled on every run with CLOCK_THREAD_CPUTIME_ID,
+ * which measures CPU time precisely, but is not accelerated by the vDSO on many
+ * kernels. For hot paths, a metrics object can be configured to use a cheaper
+ * clock (e.g., CLOCK_MONOTONIC_COARSE), and to only sample one in every N runs.
+ * A coarse clock measures wall-clock time, quantized to its resolution of a
+ * jiffy. Runs much shorter than that are mostly sampled as 0 and sometimes as a
+ * full jiffy, so min/max/std deviation are meaningless in that mode. Only the
+ * average is, since runs are not aligned to clock ticks and it thus converges
+ * to the real duration.
  *
  * The values of min/max/avg are meant to be read out of the struct directly, whereas
  * the standard deviation can only be accessed using a helper function (as it is not
@@ -21,6 +32,8 @@
 #include <time.h>
 #include "util/metrics.h"
 
+#define METRICS_SKIPPED ((uint64_t)-1)
+
 void metrics_init(Metrics *metrics) {
         *metrics = (Metrics)METRICS_INIT;
 }
@@ -31,34 +44,62 @@ void metrics_deinit(Metrics *metrics) {
 }
 
 /**
- * metrics_get_time() - get the current thread CPU time
+ * metrics_configure() - configure sampling
+ * @metrics:            object to operate on
+ * @clock:              clock to sample
+ * @interval:           sample one in every @interval runs
+ *
+ * This configures the clock used by metrics_sample_start() and
+ * metrics_sample_end(), and how many runs are skipped between two samples. An
+ * @interval of 0 or 1 samples every run. No sample must be running.
+ */
+void metrics_configure(Metrics *metrics, clockid_t clock, unsigned int interval) {
+        assert(!metrics->timestamp);
+
+        metrics->clock = clock;
+        metrics->interval = interval;
+        metrics->n_skipped = 0;
+}
+
+static uint64_t metrics_read_clock(Metrics *metrics) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(metrics->clock, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/**
+ * metrics_get_monotonic() - get the current monotonic time
  *
- * Read the current thread CPU time to be used to record samples.
+ * Read the current time of CLOCK_MONOTONIC. Unlike the clock of a metrics
+ * object, this is suitable to measure durations that span more than a single
+ * sample, like the time a message spends queued in the broker.
  *
  * Return: the timestamp in nano seconds.
  */
-uint64_t metrics_get_time(void) {
+uint64_t metrics_get_monotonic(void) {
         struct timespec ts;
         int r;
 
-        r = clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
         assert(r >= 0);
 
         return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
 }
 
 /**
- * metrics_sample_add() - add one sample
+ * metrics_sample_value() - add one sample value
  * @metrics:            object to operate on
- * @timestamp:          time the sample was started
+ * @sample:             value of the sample
  *
- * Update the internal state with a new sample, started at @timestamp
- * and ending at the time the function is called.
+ * Update the internal state with a new sample with the value @sample. This
+ * can be used to record samples other than durations.
  */
-void metrics_sample_add(Metrics *metrics, uint64_t timestamp) {
-        uint64_t sample, average_old;
-
-        sample = metrics_get_time() - timestamp;
+void metrics_sample_value(Metrics *metrics, uint64_t sample) {
+        uint64_t average_old;
 
         metrics->count ++;
         metrics->sum += sample;
@@ -74,16 +115,37 @@ void metrics_sample_add(Metrics *metrics, uint64_t timestamp) {
                 metrics->maximum = sample;
 }
 
+/**
+ * metrics_sample_add() - add one sample
+ * @metrics:            object to operate on
+ * @timestamp:          time the sample was started
+ *
+ * Update the internal state with a new sample, started at @timestamp
+ * and ending at the time the function is called. @timestamp must have been
+ * taken from the clock configured on @metrics.
+ */
+void metrics_sample_add(Metrics *metrics, uint64_t timestamp) {
+        metrics_sample_value(metrics, metrics_read_clock(metrics) - timestamp);
+}
+
 /**
  * metrics_sample_start() - start a new sample
  * @metrics:            object to operate on
  *
  * Start a new sample by recording the current timestamp, verifying that
- * a sample is not currently running.
+ * a sample is not currently running. If the configured interval says this
+ * run is to be skipped, the clock is not read at all.
  */
 void metrics_sample_start(Metrics *metrics) {
         assert(!metrics->timestamp);
-        metrics->timestamp = metrics_get_time();
+
+        if (++metrics->n_skipped < metrics->interval) {
+                metrics->timestamp = METRICS_SKIPPED;
+                return;
+        }
+
+        metrics->n_skipped = 0;
+        metrics->timestamp = metrics_read_clock(metrics);
 }
 
 /**
@@ -95,7 +157,8 @@ void metrics_sample_start(Metrics *metrics) {
 void metrics_sample_end(Metrics *metrics) {
         assert(metrics->timestamp);
 
-        metrics_sample_add(metrics, metrics->timestamp);
+        if (metrics->timestamp != METRICS_SKIPPED)
+                metrics_sample_add(metrics, metrics->timestamp);
 
         metrics->timestamp = 0;
 }
@@ -119,3 +182,27 @@ double metrics_read_standard_deviation(Metrics *metrics) {
 
         return sqrt(metrics->sum_of_squares / metrics->count);
 }
+
+void metrics_histogram_deinit(MetricsHistogram *histogram) {
+        metrics_deinit(&histogram->metrics);
+        *histogram = (MetricsHistogram)METRICS_HISTOGRAM_INIT;
+}
+
+/**
+ * metrics_histogram_sample() - add one sample to a histogram
+ * @histogram:          object to operate on
+ * @sample:             value of the sample
+ *
+ * Update the metrics of @histogram with @sample, and count it in its bucket.
+ * Bucket N counts the samples in [2^N, 2^(N+1)), except for the first bucket,
+ * which also counts zero, and the last bucket, which counts everything beyond.
+ */
+void metrics_histogram_sample(MetricsHistogram *histogram, uint64_t sample) {
+        size_t bucket = 0;
+
+        if (sample)
+                bucket = c_min(63UL - __builtin_clzll(sample), METRICS_HISTOGRAM_BUCKETS - 1UL);
+
+        ++histogram->buckets[bucket];
+        metrics_sample_value(&histogram->metrics, sample);
+}
@@ -6,8 +6,12 @@
 
 #include <c-macro.h>
 #include <stdlib.h>
+#include <time.h>
 
 typedef struct Metrics Metrics;
+typedef struct MetricsHistogram MetricsHistogram;
+
+#define METRICS_HISTOGRAM_BUCKETS (32)
 
 struct Metrics {
         uint64_t count;
@@ -16,22 +20,43 @@ struct Metrics {
         uint64_t maximum;
         uint64_t average;
 
+        /* configuration */
+        clockid_t clock;
+        unsigned int interval;
+
         /* internal state */
         uint64_t timestamp;
         uint64_t sum_of_squares;
+        unsigned int n_skipped;
 };
 
-#define METRICS_INIT {                          \
-                .minimum = (uint64_t) -1,       \
+#define METRICS_INIT {                                  \
+                .minimum = (uint64_t) -1,               \
+                .clock = CLOCK_THREAD_CPUTIME_ID,       \
+                .interval = 1,                          \
+        }
+
+struct MetricsHistogram {
+        Metrics metrics;
+        uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
+#define METRICS_HISTOGRAM_INIT {                \
+                .metrics = METRICS_INIT,        \
         }
 
 void metrics_init(Metrics *metrics);
 void metrics_deinit(Metrics *metrics);
+void metrics_configure(Metrics *metrics, clockid_t clock, unsigned int interval);
 
-uint64_t metrics_get_time(void);
+uint64_t metrics_get_monotonic(void);
+void metrics_sample_value(Metrics *metrics, uint64_t sample);
 void metrics_sample_add(Metrics *metrics, uint64_t timestamp);
 
 void metrics_sample_start(Metrics *metrics);
 void metrics_sample_end(Metrics *metrics);
 
 double metrics_read_standard_deviation(Metrics *metrics);
+
+void metrics_histogram_deinit(MetricsHistogram *histogram);
+void metrics_histogram_sample(MetricsHistogram *histogram, uint64_t sample);
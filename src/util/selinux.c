@@ -25,6 +25,14 @@ struct BusSELinuxName {
 
 typedef struct BusSELinuxName BusSELinuxName;
 
+struct BusSELinuxCacheEntry {
+        security_id_t sender_sid;
+        security_id_t receiver_sid;
+        uint64_t generation;
+};
+
+typedef struct BusSELinuxCacheEntry BusSELinuxCacheEntry;
+
 #define BUS_SELINUX_SID_FROM_ID(id)     ((security_id_t) (id))
 #define BUS_SELINUX_SID_TO_ID(sid)      ((BusSELinuxID*) (sid))
 
@@ -33,11 +41,22 @@ typedef struct BusSELinuxName BusSELinuxName;
 #define BUS_SELINUX_PERMISSION_OWN      (1UL)
 #define BUS_SELINUX_PERMISSION_SEND     (2UL)
 
+#define BUS_SELINUX_CACHE_SIZE          (256UL) /* power of two */
+
 static struct security_class_mapping dbus_class_map[] = {
   { "dbus", { "acquire_svc", "send_msg", NULL } },
   { NULL }
 };
 
+/*
+ * The AVC is global, so is our cache of its decisions. It caches granted
+ * send-permissions by the pair of SIDs, and is flushed by bumping the
+ * generation counter whenever the policy or the enforcing mode changes.
+ * Entries with a stale generation are simply treated as empty.
+ */
+static BusSELinuxCacheEntry bus_selinux_cache[BUS_SELINUX_CACHE_SIZE];
+static uint64_t bus_selinux_cache_generation = 1;
+
 /** bus_selinux_is_enabled() - checks if SELinux is currently enabled
  *
  * Returns: true if SELinux is enabled, false otherwise.
@@ -180,6 +199,16 @@ BusSELinuxRegistry *bus_selinux_registry_unref(BusSELinuxRegistry *registry) {
         return NULL;
 }
 
+static BusSELinuxCacheEntry *bus_selinux_cache_find(security_id_t sender_sid, security_id_t receiver_sid) {
+        uint64_t hash;
+
+        hash = (uint64_t)(uintptr_t)sender_sid * UINT64_C(0x9e3779b97f4a7c15);
+        hash ^= (uint64_t)(uintptr_t)receiver_sid * UINT64_C(0xc2b2ae3d27d4eb4f);
+        hash ^= hash >> 32;
+
+        return &bus_selinux_cache[hash & (BUS_SELINUX_CACHE_SIZE - 1)];
+}
+
 static int name_compare(CRBTree *t, void *k, CRBNode *rb) {
         const char *name = (const char *)k;
         BusSELinuxName *selinux_name = c_container_of(rb, BusSELinuxName, rb);
@@ -293,39 +322,88 @@ int bus_selinux_check_own(BusSELinuxRegistry *registry,
  * old labels. In this case we treat this as if the transaction was
  * denied.
  *
+ * Granted transactions are cached by the pair of IDs, so repeated checks (e.g.,
+ * when broadcasting) do not need to query the AVC. The cache is flushed on
+ * policy reloads and enforcing mode changes.
+ *
  * Return: 0 if the transaction is allowed, SELINUX_E_DENIED if it is not,
  *         or a negative error code on failure.
  */
 int bus_selinux_check_send(BusSELinuxRegistry *registry,
                            BusSELinuxID *sender_id,
                            BusSELinuxID *receiver_id) {
-        security_id_t receiver_sid;
+        security_id_t sender_sid, receiver_sid;
+        BusSELinuxCacheEntry *entry;
+        struct av_decision avd;
         int r;
 
         if (!is_selinux_enabled())
                 return 0;
 
+        sender_sid = BUS_SELINUX_SID_FROM_ID(sender_id);
         receiver_sid = receiver_id ? BUS_SELINUX_SID_FROM_ID(receiver_id) : registry->fallback_sid;
 
-        r = avc_has_perm(BUS_SELINUX_SID_FROM_ID(sender_id),
-                         receiver_sid,
-                         BUS_SELINUX_CLASS_DBUS,
-                         BUS_SELINUX_PERMISSION_SEND,
-                         NULL, NULL);
+        /*
+         * Let the status page tell us about pending policy reloads. This
+         * invokes our callbacks, if necessary, which flush the cache. It is a
+         * plain memory access, unless the kernel lacks the status page.
+         */
+        selinux_status_updated();
+
+        entry = bus_selinux_cache_find(sender_sid, receiver_sid);
+        if (entry->generation == bus_selinux_cache_generation &&
+            entry->sender_sid == sender_sid &&
+            entry->receiver_sid == receiver_sid)
+                return 0;
+
+        r = avc_has_perm_noaudit(sender_sid,
+                                 receiver_sid,
+                                 BUS_SELINUX_CLASS_DBUS,
+                                 BUS_SELINUX_PERMISSION_SEND,
+                                 NULL, &avd);
         if (r < 0) {
                 /*
                  * Treat unknown contexts (possibly due to policy reload)
                  * as access denied.
                  */
-                if (errno == EACCES || errno == EINVAL)
+                if (errno == EINVAL)
                         return SELINUX_E_DENIED;
+                if (errno != EACCES)
+                        return error_origin(-errno);
+        }
 
-                return error_origin(-errno);
+        avc_audit(sender_sid,
+                  receiver_sid,
+                  BUS_SELINUX_CLASS_DBUS,
+                  BUS_SELINUX_PERMISSION_SEND,
+                  &avd, r, NULL);
+
+        if (r < 0)
+                return SELINUX_E_DENIED;
+
+        /*
+         * Only remember grants that do not need to be audited. Denials are
+         * no fast-path, so they are always forwarded to the AVC and logged.
+         */
+        if (!(avd.auditallow & BUS_SELINUX_PERMISSION_SEND)) {
+                entry->sender_sid = sender_sid;
+                entry->receiver_sid = receiver_sid;
+                entry->generation = bus_selinux_cache_generation;
         }
 
         return 0;
 }
 
+static int bus_selinux_policyload(int seqno) {
+        ++bus_selinux_cache_generation;
+        return 0;
+}
+
+static int bus_selinux_setenforce(int enforcing) {
+        ++bus_selinux_cache_generation;
+        return 0;
+}
+
 /**
  * bus_selinux_init_global() - initialize the global SELinux context
  *
@@ -348,6 +426,18 @@ int bus_selinux_init_global(void) {
         if (r)
                 return error_origin(-errno);
 
+        /*
+         * Access decisions are cached, so we must learn about policy reloads
+         * and enforcing mode changes. The status page allows polling for
+         * them cheaply, falling back to netlink if unavailable.
+         */
+        selinux_set_callback(SELINUX_CB_POLICYLOAD, (union selinux_callback){ .func_policyload = bus_selinux_policyload });
+        selinux_set_callback(SELINUX_CB_SETENFORCE, (union selinux_callback){ .func_setenforce = bus_selinux_setenforce });
+
+        r = selinux_status_open(1);
+        if (r < 0)
+                return error_origin(-errno);
+
         /* XXX: set logging callbacks? */
 
         return 0;
@@ -364,5 +454,7 @@ void bus_selinux_deinit_global(void) {
         if (!is_selinux_enabled())
                 return;
 
+        selinux_status_close();
         avc_destroy();
+        ++bus_selinux_cache_generation;
 }
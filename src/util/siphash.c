@@ -0,0 +1,89 @@
+/*
+ * SipHash
+ *
+ * This implements SipHash-2-4 as described by Jean-Philippe Aumasson and
+ * Daniel J. Bernstein. It is a keyed hash, meant for hash-tables that are
+ * indexed by untrusted input. With a random, secret key, remote peers cannot
+ * predict collisions and thus cannot degrade lookups to linear scans.
+ */
+
+#include <c-macro.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util/siphash.h"
+
+static inline uint64_t siphash_rotl(uint64_t x, unsigned int b) {
+        return (x << b) | (x >> (64 - b));
+}
+
+static inline uint64_t siphash_load(const uint8_t *p) {
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return le64toh(v);
+}
+
+static inline void siphash_round(uint64_t v[4]) {
+        v[0] += v[1];
+        v[1] = siphash_rotl(v[1], 13);
+        v[1] ^= v[0];
+        v[0] = siphash_rotl(v[0], 32);
+        v[2] += v[3];
+        v[3] = siphash_rotl(v[3], 16);
+        v[3] ^= v[2];
+        v[0] += v[3];
+        v[3] = siphash_rotl(v[3], 21);
+        v[3] ^= v[0];
+        v[2] += v[1];
+        v[1] = siphash_rotl(v[1], 17);
+        v[1] ^= v[2];
+        v[2] = siphash_rotl(v[2], 32);
+}
+
+static inline void siphash_compress(uint64_t v[4], uint64_t m) {
+        v[3] ^= m;
+        siphash_round(v);
+        siphash_round(v);
+        v[0] ^= m;
+}
+
+/**
+ * siphash24() - hash data with SipHash-2-4
+ * @data:               data to hash
+ * @n_data:             length of @data in bytes
+ * @key:                128-bit key to use
+ *
+ * This computes the SipHash-2-4 of @data, keyed by @key.
+ *
+ * Return: The 64-bit hash value.
+ */
+uint64_t siphash24(const void *data, size_t n_data, const uint8_t key[SIPHASH_KEY_SIZE]) {
+        const uint8_t *p = data, *end = p + (n_data & ~(size_t)7);
+        uint64_t k0, k1, v[4], m;
+        size_t i;
+
+        k0 = siphash_load(key);
+        k1 = siphash_load(key + 8);
+
+        v[0] = k0 ^ UINT64_C(0x736f6d6570736575);
+        v[1] = k1 ^ UINT64_C(0x646f72616e646f6d);
+        v[2] = k0 ^ UINT64_C(0x6c7967656e657261);
+        v[3] = k1 ^ UINT64_C(0x7465646279746573);
+
+        for ( ; p < end; p += 8)
+                siphash_compress(v, siphash_load(p));
+
+        m = (uint64_t)n_data << 56;
+        for (i = 0; i < (n_data & 7); ++i)
+                m |= (uint64_t)p[i] << (8 * i);
+
+        siphash_compress(v, m);
+
+        v[2] ^= 0xff;
+        for (i = 0; i < 4; ++i)
+                siphash_round(v);
+
+        return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
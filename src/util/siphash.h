@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * SipHash
+ */
+
+#include <c-macro.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SIPHASH_KEY_SIZE 16
+
+uint64_t siphash24(const void *data, size_t n_data, const uint8_t key[SIPHASH_KEY_SIZE]);
@@ -206,8 +206,109 @@ static void test_uds_edge(unsigned int run) {
         c_close(s[0]);
 }
 
+/*
+ * This test verifies that the number of events fetched per poll is capped, and
+ * that events beyond the cap are fetched by following polls, rather than being
+ * lost. We rely on edge-triggered epoll to keep them queued in the kernel.
+ */
+static void test_max_events(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchFile f[8];
+        size_t i, n;
+        int r, s[C_ARRAY_SIZE(f)][2];
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        c.max_events = 3;
+
+        for (i = 0; i < C_ARRAY_SIZE(f); ++i) {
+                f[i] = (DispatchFile)DISPATCH_FILE_NULL(f[i]);
+
+                r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s[i]);
+                assert(!r);
+
+                r = dispatch_file_init(&f[i], &c, NULL, s[i][0], EPOLLOUT, 0);
+                assert(!r);
+
+                dispatch_file_select(&f[i], EPOLLOUT);
+        }
+
+        /* all files are writable, but only 3 events are fetched at a time */
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+        assert(c.n_events == 3);
+        assert(c.metrics.count == 1 && c.metrics.maximum == 3);
+
+        for (n = 3; n < C_ARRAY_SIZE(f); n += 3) {
+                r = dispatch_context_poll(&c, 0);
+                assert(!r);
+        }
+
+        for (i = 0; i < C_ARRAY_SIZE(f); ++i)
+                assert(c_list_is_linked(&f[i].ready_link) && (f[i].events & EPOLLOUT));
+
+        assert(c.metrics.sum == C_ARRAY_SIZE(f));
+
+        /* cleanup */
+
+        for (i = 0; i < C_ARRAY_SIZE(f); ++i) {
+                dispatch_file_deinit(&f[i]);
+                c_close(s[i][1]);
+                c_close(s[i][0]);
+        }
+}
+
+/*
+ * This test verifies that events can be re-scheduled by the user, and that
+ * they are only reported while selected.
+ */
+static void test_schedule(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchFile f = DISPATCH_FILE_NULL(f);
+        int r, s[2];
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s);
+        assert(!r);
+
+        r = dispatch_file_init(&f, &c, NULL, s[0], EPOLLIN | EPOLLOUT, 0);
+        assert(!r);
+
+        /* nothing is readable, but a scheduled event is reported anyway */
+
+        dispatch_file_schedule(&f, EPOLLIN);
+        assert(!c_list_is_linked(&f.ready_link));
+        assert(!dispatch_file_events(&f));
+
+        dispatch_file_select(&f, EPOLLIN);
+        assert(c_list_is_linked(&f.ready_link));
+        assert(dispatch_file_events(&f) == EPOLLIN);
+
+        dispatch_file_deselect(&f, EPOLLIN);
+        assert(!c_list_is_linked(&f.ready_link));
+
+        dispatch_file_select(&f, EPOLLIN);
+        dispatch_file_clear(&f, EPOLLIN);
+        assert(!c_list_is_linked(&f.ready_link));
+
+        dispatch_file_schedule(&f, EPOLLIN);
+        assert(c_list_is_linked(&f.ready_link));
+
+        /* cleanup */
+
+        dispatch_file_deinit(&f);
+        c_close(s[1]);
+        c_close(s[0]);
+}
+
 int main(int argc, char **argv) {
         test_uds_edge(0);
         test_uds_edge(1);
+        test_max_events();
+        test_schedule();
         return 0;
 }
@@ -3,8 +3,10 @@
  */
 
 #include <c-macro.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include "util/fdlist.h"
 
 static void test_setup(void) {
@@ -84,9 +86,41 @@ static void test_consumer(void) {
         l = fdlist_free(l);
 }
 
+static void test_sealed(void) {
+        _c_cleanup_(fdlist_freep) FDList *l = NULL;
+        int r, p[3];
+
+        /*
+         * Verify that only memfds sealed against resizing are accounted, and
+         * that any other FD is silently ignored.
+         */
+
+        p[0] = memfd_create("test-fdlist", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        assert(p[0] >= 0);
+        r = ftruncate(p[0], 4096);
+        assert(!r);
+        r = fcntl(p[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+        assert(!r);
+
+        p[1] = memfd_create("test-fdlist", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        assert(p[1] >= 0);
+        r = ftruncate(p[1], 8192);
+        assert(!r);
+
+        p[2] = epoll_create1(EPOLL_CLOEXEC);
+        assert(p[2] >= 0);
+
+        r = fdlist_new_consume_fds(&l, p, C_ARRAY_SIZE(p));
+        assert(!r);
+
+        assert(fdlist_get_sealed_size(l) == 4096);
+        assert(fdlist_get_sealed_size(NULL) == 0);
+}
+
 int main(int argc, char **argv) {
         test_setup();
         test_dummy();
         test_consumer();
+        test_sealed();
         return 0;
 }
@@ -0,0 +1,75 @@
+/*
+ * Test Metrics Helper
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <time.h>
+#include "util/metrics.h"
+
+static void test_sample_value(void) {
+        Metrics m = METRICS_INIT;
+
+        metrics_sample_value(&m, 3);
+        metrics_sample_value(&m, 5);
+        assert(m.count == 2 && m.sum == 8);
+        assert(m.minimum == 3 && m.maximum == 5 && m.average == 4);
+        assert(m.sum_of_squares == 2);
+
+        metrics_deinit(&m);
+        assert(!m.count);
+}
+
+static void test_interval(void) {
+        Metrics m = METRICS_INIT;
+        size_t i;
+
+        /* only every 4th run is sampled, and the clock is cheap */
+
+        metrics_configure(&m, CLOCK_MONOTONIC_COARSE, 4);
+
+        for (i = 0; i < 16; ++i) {
+                metrics_sample_start(&m);
+                metrics_sample_end(&m);
+        }
+
+        assert(m.count == 4);
+
+        /* an interval of 0 or 1 samples every run */
+
+        metrics_configure(&m, CLOCK_THREAD_CPUTIME_ID, 0);
+
+        for (i = 0; i < 16; ++i) {
+                metrics_sample_start(&m);
+                metrics_sample_end(&m);
+        }
+
+        assert(m.count == 20);
+
+        metrics_deinit(&m);
+}
+
+static void test_histogram(void) {
+        MetricsHistogram h = METRICS_HISTOGRAM_INIT;
+
+        metrics_histogram_sample(&h, 0);
+        metrics_histogram_sample(&h, 1);
+        metrics_histogram_sample(&h, 1000);
+        metrics_histogram_sample(&h, 1023);
+        metrics_histogram_sample(&h, UINT64_MAX);
+
+        assert(h.buckets[0] == 2);
+        assert(h.buckets[9] == 2);
+        assert(h.buckets[METRICS_HISTOGRAM_BUCKETS - 1] == 1);
+        assert(h.metrics.count == 5);
+
+        metrics_histogram_deinit(&h);
+        assert(!h.buckets[0] && !h.metrics.count);
+}
+
+int main(int argc, char **argv) {
+        test_sample_value();
+        test_interval();
+        test_histogram();
+        return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Test SipHash
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/siphash.h"
+
+static void test_vectors(void) {
+        /*
+         * Test vectors from the SipHash reference implementation. The key is
+         * 00..0f, and the input of length n is 00..(n-1).
+         */
+        static const struct {
+                size_t n_data;
+                uint64_t hash;
+        } vectors[] = {
+                { 0,    UINT64_C(0x726fdb47dd0e0e31) },
+                { 1,    UINT64_C(0x74f839c593dc67fd) },
+                { 7,    UINT64_C(0xab0200f58b01d137) },
+                { 8,    UINT64_C(0x93f5f5799a932462) },
+                { 15,   UINT64_C(0xa129ca6149be45e5) },
+                { 63,   UINT64_C(0x958a324ceb064572) },
+        };
+        uint8_t key[SIPHASH_KEY_SIZE], data[64];
+        size_t i;
+
+        for (i = 0; i < sizeof(key); ++i)
+                key[i] = i;
+        for (i = 0; i < sizeof(data); ++i)
+                data[i] = i;
+
+        for (i = 0; i < C_ARRAY_SIZE(vectors); ++i)
+                assert(siphash24(data, vectors[i].n_data, key) == vectors[i].hash);
+}
+
+int main(int argc, char **argv) {
+        test_vectors();
+        return 0;
+}
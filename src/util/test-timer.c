@@ -0,0 +1,138 @@
+/*
+ * Test Timer Wheel
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <time.h>
+#include "util/dispatch.h"
+#include "util/timer.h"
+
+typedef struct TestTimer TestTimer;
+
+struct TestTimer {
+        Timer timer;
+        uint64_t armed;
+        uint64_t timeout;
+        size_t n_fired;
+        size_t *order;
+        size_t *n_order;
+};
+
+static uint64_t test_get_time(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int test_timer_fn(Timer *timer) {
+        TestTimer *t = c_container_of(timer, TestTimer, timer);
+
+        /* timers must never expire early, and be disarmed when called */
+        assert(test_get_time() >= t->armed + t->timeout);
+        assert(!timer_is_armed(timer));
+
+        ++t->n_fired;
+        t->order[(*t->n_order)++] = t->timeout;
+        return 0;
+}
+
+static void test_timer_arm(TestTimer *t, uint64_t timeout) {
+        int r;
+
+        t->armed = test_get_time();
+        t->timeout = timeout;
+
+        r = timer_arm(&t->timer, timeout);
+        assert(!r);
+        assert(timer_is_armed(&t->timer));
+}
+
+static void test_setup(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        TimerWheel w = TIMER_WHEEL_NULL(w);
+        Timer t = TIMER_NULL(t);
+        int r;
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        r = timer_wheel_init(&w, &c);
+        assert(!r);
+
+        timer_init(&t, &w, NULL);
+        assert(!timer_is_armed(&t));
+
+        r = timer_arm(&t, 1000ULL * 1000ULL * 1000ULL);
+        assert(!r);
+        assert(timer_is_armed(&t) && w.n_timers == 1);
+
+        timer_deinit(&t);
+        assert(!timer_is_armed(&t) && !w.n_timers);
+
+        timer_deinit(&t);
+        timer_wheel_deinit(&w);
+        timer_wheel_deinit(&w);
+}
+
+static void test_expire(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        TimerWheel w = TIMER_WHEEL_NULL(w);
+        static const uint64_t timeouts[] = {
+                /* in order of expiration, covering the first two levels */
+                0,
+                2ULL * 1000ULL * 1000ULL,
+                20ULL * 1000ULL * 1000ULL,
+                150ULL * 1000ULL * 1000ULL,
+        };
+        TestTimer t[C_ARRAY_SIZE(timeouts)], cancelled;
+        size_t i, order[C_ARRAY_SIZE(timeouts)], n_order = 0;
+        int r;
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        r = timer_wheel_init(&w, &c);
+        assert(!r);
+
+        /* arm timers in reverse order, and one that is disarmed again */
+
+        for (i = 0; i < C_ARRAY_SIZE(t); ++i) {
+                t[i] = (TestTimer){ .order = order, .n_order = &n_order };
+                timer_init(&t[i].timer, &w, test_timer_fn);
+        }
+
+        for (i = C_ARRAY_SIZE(t); i-- > 0; )
+                test_timer_arm(&t[i], timeouts[i]);
+
+        cancelled = (TestTimer){ .order = order, .n_order = &n_order };
+        timer_init(&cancelled.timer, &w, test_timer_fn);
+        test_timer_arm(&cancelled, timeouts[1]);
+        timer_disarm(&cancelled.timer);
+
+        /* dispatch until all timers fired, and verify their order */
+
+        while (w.n_timers) {
+                r = dispatch_context_dispatch(&c);
+                assert(!r);
+        }
+
+        assert(n_order == C_ARRAY_SIZE(timeouts));
+        for (i = 0; i < C_ARRAY_SIZE(t); ++i) {
+                assert(t[i].n_fired == 1);
+                assert(order[i] == timeouts[i]);
+        }
+        assert(!cancelled.n_fired);
+
+        timer_wheel_deinit(&w);
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+        test_expire();
+        return 0;
+}
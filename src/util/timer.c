@@ -0,0 +1,345 @@
+/*
+ * Timer Wheel
+ *
+ * A timer wheel tracks an arbitrary number of timers, each with its own
+ * deadline, while only ever using a single timerfd. Arming and disarming a
+ * timer is O(1), and so is expiring it.
+ *
+ * Time is measured in ticks of 2^TIMER_WHEEL_TICK_SHIFT nanoseconds on
+ * CLOCK_MONOTONIC. The wheel is hierarchical: each of its TIMER_WHEEL_LEVELS
+ * levels consists of TIMER_WHEEL_SLOTS slots, and each slot on level N covers
+ * TIMER_WHEEL_SLOTS^N ticks. A timer is linked into the lowest level that
+ * covers its deadline. Whenever the wheel passes the boundary of a slot on a
+ * higher level, the timers of that slot are cascaded into the lower levels.
+ * Once a slot on the lowest level is passed, all its timers are expired. This
+ * means every timer is moved at most TIMER_WHEEL_LEVELS times.
+ *
+ * Deadlines beyond the range of the wheel are linked into the last slot of the
+ * highest level, and simply re-linked when that slot is cascaded.
+ *
+ * The wheel does not run on every tick. Instead, the timerfd is armed for the
+ * next tick that has a non-empty slot to cascade or expire, and all ticks in
+ * between are skipped. Timers never expire early, but might expire up to one
+ * tick late.
+ */
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "util/dispatch.h"
+#include "util/error.h"
+#include "util/timer.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE (UINT64_C(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static uint64_t timer_wheel_get_time(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void timer_wheel_link(TimerWheel *wheel, Timer *timer) {
+        uint64_t expires;
+        size_t level;
+
+        /*
+         * Link the timer into the lowest level that covers its deadline,
+         * relative to the current position of the wheel. Deadlines that
+         * already passed are expired on the next tick, and deadlines beyond
+         * the range of the wheel are re-linked once they come into range.
+         */
+        expires = c_max(timer->deadline, wheel->now + 1);
+        expires = c_min(expires, wheel->now + TIMER_WHEEL_RANGE - 1);
+
+        for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level)
+                if (expires - wheel->now < (UINT64_C(1) << (TIMER_WHEEL_BITS * (level + 1))))
+                        break;
+
+        c_list_link_tail(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK],
+                         &timer->link);
+}
+
+static uint64_t timer_wheel_next(TimerWheel *wheel) {
+        uint64_t base, k, next = UINT64_MAX;
+        size_t level, i, shift;
+
+        /*
+         * Find the next tick that has work to do. On each level, this is the
+         * first non-empty slot following the current position. A slot on
+         * level N is processed on the tick its range starts at.
+         */
+        for (level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+                shift = TIMER_WHEEL_BITS * level;
+                base = wheel->now >> shift;
+
+                for (i = 1; i <= TIMER_WHEEL_SLOTS; ++i) {
+                        k = base + i;
+                        if ((k << shift) >= next)
+                                break;
+
+                        if (!c_list_is_empty(&wheel->slots[level][k & TIMER_WHEEL_MASK])) {
+                                next = k << shift;
+                                break;
+                        }
+                }
+        }
+
+        return next;
+}
+
+static int timer_wheel_arm(TimerWheel *wheel, uint64_t tick) {
+        struct itimerspec spec = {};
+        uint64_t nsec;
+        int r;
+
+        if (tick == wheel->armed)
+                return 0;
+
+        /* a zero timeout disarms the timerfd, which is used for UINT64_MAX */
+        if (tick != UINT64_MAX) {
+                nsec = tick << TIMER_WHEEL_TICK_SHIFT;
+                spec.it_value.tv_sec = nsec / UINT64_C(1000000000);
+                spec.it_value.tv_nsec = nsec % UINT64_C(1000000000);
+        }
+
+        r = timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+        if (r < 0)
+                return error_origin(-errno);
+
+        wheel->armed = tick;
+        return 0;
+}
+
+static int timer_wheel_tick(TimerWheel *wheel, uint64_t tick) {
+        CList todo = (CList)C_LIST_INIT(todo);
+        Timer *timer;
+        size_t level, shift;
+        int r;
+
+        wheel->now = tick;
+
+        /* cascade higher levels, whose slots start on this tick */
+        for (level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+                shift = TIMER_WHEEL_BITS * level;
+                if (tick & ((UINT64_C(1) << shift) - 1))
+                        continue;
+
+                c_list_swap(&todo, &wheel->slots[level][(tick >> shift) & TIMER_WHEEL_MASK]);
+                while ((timer = c_list_first_entry(&todo, Timer, link))) {
+                        c_list_unlink(&timer->link);
+                        timer_wheel_link(wheel, timer);
+                }
+        }
+
+        /*
+         * Expire the slot of this tick on the lowest level. Callbacks may arm
+         * and disarm arbitrary timers, including the ones left in @todo, so
+         * fetch them one by one.
+         */
+        c_list_swap(&todo, &wheel->slots[0][tick & TIMER_WHEEL_MASK]);
+        while ((timer = c_list_first_entry(&todo, Timer, link))) {
+                c_list_unlink_init(&timer->link);
+
+                if (_c_unlikely_(timer->deadline > tick)) {
+                        timer_wheel_link(wheel, timer);
+                        continue;
+                }
+
+                --wheel->n_timers;
+
+                r = timer->fn(timer);
+                if (error_trace(r)) {
+                        while ((timer = c_list_first_entry(&todo, Timer, link))) {
+                                c_list_unlink(&timer->link);
+                                timer_wheel_link(wheel, timer);
+                        }
+                        return r;
+                }
+        }
+
+        return 0;
+}
+
+static int timer_wheel_dispatch(DispatchFile *file) {
+        TimerWheel *wheel = c_container_of(file, TimerWheel, file);
+        uint64_t expirations, now, next;
+        ssize_t l;
+        int r;
+
+        /*
+         * The timerfd only signals that the wheel must be advanced, the
+         * expiration counter is irrelevant. Reading it drains the timerfd, so
+         * the kernel will notify us again on the next expiration.
+         */
+        l = read(wheel->fd, &expirations, sizeof(expirations));
+        if (l < 0 && errno != EAGAIN)
+                return error_origin(-errno);
+
+        dispatch_file_clear(file, EPOLLIN);
+
+        wheel->armed = UINT64_MAX;
+        now = timer_wheel_get_time() >> TIMER_WHEEL_TICK_SHIFT;
+
+        while ((next = timer_wheel_next(wheel)) <= now) {
+                r = timer_wheel_tick(wheel, next);
+                if (r)
+                        return error_trace(r);
+        }
+
+        /* nothing happens in between, so skip straight to the current tick */
+        wheel->now = c_max(wheel->now, now);
+
+        return error_trace(timer_wheel_arm(wheel, timer_wheel_next(wheel)));
+}
+
+/**
+ * timer_init() - initialize timer
+ * @timer:              timer to operate on
+ * @wheel:              timer wheel to use
+ * @fn:                 callback function
+ *
+ * This initializes a new, disarmed timer on the wheel @wheel. Once armed and
+ * expired, @fn is called with the timer as argument. The timer is disarmed
+ * when @fn is called, so it can be re-armed from within the callback.
+ */
+void timer_init(Timer *timer, TimerWheel *wheel, TimerFn fn) {
+        *timer = (Timer)TIMER_NULL(*timer);
+        timer->wheel = wheel;
+        timer->fn = fn;
+}
+
+/**
+ * timer_deinit() - deinitialize timer
+ * @timer:              timer to operate on
+ *
+ * This disarms and deinitializes the timer. It is safe to call this multiple
+ * times, as well as on timers initialized via TIMER_NULL.
+ */
+void timer_deinit(Timer *timer) {
+        timer_disarm(timer);
+        *timer = (Timer)TIMER_NULL(*timer);
+}
+
+/**
+ * timer_arm() - arm timer
+ * @timer:              timer to operate on
+ * @timeout:            relative timeout in nanoseconds
+ *
+ * This arms @timer to expire @timeout nanoseconds from now. If the timer is
+ * already armed, it is re-armed with the new timeout.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int timer_arm(Timer *timer, uint64_t timeout) {
+        TimerWheel *wheel = timer->wheel;
+        uint64_t now;
+        int r;
+
+        timer_disarm(timer);
+
+        now = timer_wheel_get_time();
+
+        /* an empty wheel has nothing to process, so catch up with the clock */
+        if (!wheel->n_timers)
+                wheel->now = c_max(wheel->now, now >> TIMER_WHEEL_TICK_SHIFT);
+
+        /* round up, so timers never expire early */
+        timer->deadline = (now + timeout + (UINT64_C(1) << TIMER_WHEEL_TICK_SHIFT) - 1) >> TIMER_WHEEL_TICK_SHIFT;
+        timer_wheel_link(wheel, timer);
+        ++wheel->n_timers;
+
+        /*
+         * If the timerfd fires after the deadline of this timer, pull it in.
+         * Any cascading due before that deadline is caught up with once the
+         * timerfd fires.
+         */
+        if (timer->deadline < wheel->armed) {
+                r = timer_wheel_arm(wheel, timer->deadline);
+                if (r) {
+                        timer_disarm(timer);
+                        return error_trace(r);
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * timer_disarm() - disarm timer
+ * @timer:              timer to operate on
+ *
+ * This disarms @timer, if armed. The timerfd of the wheel is left untouched,
+ * since a spurious wakeup is cheaper than re-arming it.
+ */
+void timer_disarm(Timer *timer) {
+        if (timer_is_armed(timer)) {
+                c_list_unlink_init(&timer->link);
+                --timer->wheel->n_timers;
+        }
+}
+
+/**
+ * timer_wheel_init() - initialize timer wheel
+ * @wheel:              timer wheel to operate on
+ * @dispatcher:         dispatch context to use
+ *
+ * This initializes a new timer wheel and registers its timerfd with
+ * @dispatcher.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int timer_wheel_init(TimerWheel *w, DispatchContext *dispatcher) {
+        _c_cleanup_(timer_wheel_deinitp) TimerWheel *wheel = w;
+        size_t level, i;
+        int r;
+
+        *wheel = (TimerWheel)TIMER_WHEEL_NULL(*wheel);
+
+        for (level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+                for (i = 0; i < TIMER_WHEEL_SLOTS; ++i)
+                        wheel->slots[level][i] = (CList)C_LIST_INIT(wheel->slots[level][i]);
+
+        wheel->now = timer_wheel_get_time() >> TIMER_WHEEL_TICK_SHIFT;
+
+        wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (wheel->fd < 0)
+                return error_origin(-errno);
+
+        r = dispatch_file_init(&wheel->file,
+                               dispatcher,
+                               timer_wheel_dispatch,
+                               wheel->fd,
+                               EPOLLIN,
+                               0);
+        if (r)
+                return error_fold(r);
+
+        dispatch_file_select(&wheel->file, EPOLLIN);
+
+        wheel = NULL;
+        return 0;
+}
+
+/**
+ * timer_wheel_deinit() - deinitialize timer wheel
+ * @wheel:              timer wheel to operate on
+ *
+ * This deinitializes the timer wheel. The caller must make sure no timer is
+ * armed on it. It is safe to call this multiple times.
+ */
+void timer_wheel_deinit(TimerWheel *wheel) {
+        assert(!wheel->n_timers);
+
+        dispatch_file_deinit(&wheel->file);
+        c_close(wheel->fd);
+        *wheel = (TimerWheel)TIMER_WHEEL_NULL(*wheel);
+}
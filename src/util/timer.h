@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * Timer Wheel
+ */
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/dispatch.h"
+
+typedef struct Timer Timer;
+typedef struct TimerWheel TimerWheel;
+typedef int (*TimerFn) (Timer *timer);
+
+#define TIMER_WHEEL_TICK_SHIFT (20) /* ~1ms per tick */
+#define TIMER_WHEEL_BITS (6)
+#define TIMER_WHEEL_SLOTS (1UL << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS (4)
+
+/* timers */
+
+struct Timer {
+        TimerWheel *wheel;
+        TimerFn fn;
+        CList link;
+        uint64_t deadline;
+};
+
+#define TIMER_NULL(_x) {                                        \
+                .link = C_LIST_INIT((_x).link),                 \
+        }
+
+void timer_init(Timer *timer, TimerWheel *wheel, TimerFn fn);
+void timer_deinit(Timer *timer);
+
+int timer_arm(Timer *timer, uint64_t timeout);
+void timer_disarm(Timer *timer);
+
+/* wheels */
+
+struct TimerWheel {
+        int fd;
+        DispatchFile file;
+
+        uint64_t now;
+        uint64_t armed;
+        size_t n_timers;
+
+        CList slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+#define TIMER_WHEEL_NULL(_x) {                                  \
+                .fd = -1,                                       \
+                .file = DISPATCH_FILE_NULL((_x).file),          \
+                .armed = UINT64_MAX,                            \
+        }
+
+int timer_wheel_init(TimerWheel *wheel, DispatchContext *dispatcher);
+void timer_wheel_deinit(TimerWheel *wheel);
+
+C_DEFINE_CLEANUP(TimerWheel *, timer_wheel_deinit);
+
+/* inline helpers */
+
+static inline bool timer_is_armed(Timer *timer) {
+        return c_list_is_linked(&timer->link);
+}
@@ -4,6 +4,8 @@
 
 #include <c-macro.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "util-broker.h"
 
 static void test_dummy(void) {
@@ -153,11 +155,446 @@ static void test_ping_pong(void) {
         util_broker_terminate(broker);
 }
 
+typedef struct TestDestination TestDestination;
+
+struct TestDestination {
+        const char *owner;
+        bool done;
+};
+
+static int test_destination_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        TestDestination *destination = userdata;
+
+        /* a NULL owner means the call is expected to fail */
+        if (destination->owner)
+                assert(!strcmp(sd_bus_message_get_sender(m), destination->owner));
+        else
+                assert(sd_bus_message_get_error(m));
+
+        destination->done = true;
+        return 0;
+}
+
+static void test_destination_ping(sd_event *event, sd_bus *client, const char *name, const char *owner) {
+        TestDestination destination = { .owner = owner };
+        int r;
+
+        r = sd_bus_call_method_async(client,
+                                     NULL,
+                                     name,
+                                     "/org/freedesktop/DBus",
+                                     "org.freedesktop.DBus.Peer",
+                                     "Ping",
+                                     test_destination_fn,
+                                     &destination,
+                                     NULL);
+        assert(r == 1);
+
+        /* the loop is run manually, as an exited event loop cannot be reused */
+        while (!destination.done) {
+                r = sd_event_run(event, (uint64_t)-1);
+                assert(r >= 0);
+        }
+}
+
+static void test_destination(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *server1 = NULL, *server2 = NULL, *client = NULL;
+        const char *unique1 = NULL, *unique2 = NULL;
+        int r;
+
+        /*
+         * Repeatedly call a well-known name, while its primary owner changes,
+         * and verify each call reaches the current owner. This verifies that
+         * destinations remembered from previous calls never go stale.
+         */
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        r = sd_event_new(&event);
+        assert(!r);
+
+        util_broker_connect(broker, &server1);
+        util_broker_connect(broker, &server2);
+        util_broker_connect(broker, &client);
+
+        r = sd_bus_get_unique_name(server1, &unique1);
+        assert(!r);
+        r = sd_bus_get_unique_name(server2, &unique2);
+        assert(!r);
+
+        r = sd_bus_request_name(server1, "com.example.foo", 0);
+        assert(r > 0);
+
+        r = sd_bus_attach_event(server1, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(!r);
+        r = sd_bus_attach_event(server2, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(!r);
+        r = sd_bus_attach_event(client, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(!r);
+
+        test_destination_ping(event, client, "com.example.foo", unique1);
+        test_destination_ping(event, client, "com.example.foo", unique1);
+
+        r = sd_bus_release_name(server1, "com.example.foo");
+        assert(!r);
+
+        test_destination_ping(event, client, "com.example.foo", NULL);
+
+        r = sd_bus_request_name(server2, "com.example.foo", 0);
+        assert(r > 0);
+
+        test_destination_ping(event, client, "com.example.foo", unique2);
+
+        util_broker_terminate(broker);
+}
+
+typedef struct TestReplyTimeout TestReplyTimeout;
+
+struct TestReplyTimeout {
+        sd_bus_message *call;
+        uint64_t cookie;
+        bool timed_out;
+        bool synced;
+};
+
+static int test_reply_timeout_server_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        TestReplyTimeout *state = userdata;
+
+        /* swallow the call, so sd-bus does not reply on its own */
+        if (!sd_bus_message_is_method_call(m, "com.example.Test", "Stall"))
+                return 0;
+
+        assert(!state->call);
+        state->call = sd_bus_message_ref(m);
+        return 1;
+}
+
+static int test_reply_timeout_client_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        TestReplyTimeout *state = userdata;
+        uint64_t cookie;
+        uint8_t type;
+        int r;
+
+        r = sd_bus_message_get_type(m, &type);
+        assert(r >= 0);
+
+        /* the late reply must never be forwarded */
+        if (type == SD_BUS_MESSAGE_METHOD_RETURN) {
+                r = sd_bus_message_get_reply_cookie(m, &cookie);
+                assert(r >= 0);
+                assert(cookie != state->cookie);
+        }
+
+        if (sd_bus_message_is_signal(m, "com.example.Test", "Sync"))
+                state->synced = true;
+
+        return 0;
+}
+
+static int test_reply_timeout_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        TestReplyTimeout *state = userdata;
+
+        assert(sd_bus_message_is_method_error(m, "org.freedesktop.DBus.Error.NoReply"));
+
+        state->timed_out = true;
+        return 0;
+}
+
+static void test_reply_timeout(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *server = NULL, *client = NULL;
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *signal = NULL;
+        const char *unique_server = NULL, *unique_client = NULL;
+        TestReplyTimeout state = {};
+        int r;
+
+        /*
+         * Call a peer that does not reply in time, and verify the caller
+         * gets a NoReply error from the bus. A reply sent after that must not
+         * be forwarded to the caller anymore.
+         */
+
+        util_broker_new(&broker);
+        broker->reply_timeout = 100;
+        util_broker_spawn(broker);
+
+        r = sd_event_new(&event);
+        assert(!r);
+
+        util_broker_connect(broker, &server);
+        util_broker_connect(broker, &client);
+
+        r = sd_bus_get_unique_name(server, &unique_server);
+        assert(!r);
+        r = sd_bus_get_unique_name(client, &unique_client);
+        assert(!r);
+
+        r = sd_bus_add_filter(server, NULL, test_reply_timeout_server_fn, &state);
+        assert(r >= 0);
+        r = sd_bus_add_filter(client, NULL, test_reply_timeout_client_fn, &state);
+        assert(r >= 0);
+
+        r = sd_bus_attach_event(server, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(!r);
+        r = sd_bus_attach_event(client, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(!r);
+
+        /* the call times out on the bus, long before sd-bus would give up */
+        {
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                r = sd_bus_message_new_method_call(client, &m, unique_server, "/", "com.example.Test", "Stall");
+                assert(r >= 0);
+
+                r = sd_bus_call_async(client, NULL, m, test_reply_timeout_fn, &state, 0);
+                assert(r >= 0);
+
+                r = sd_bus_message_get_cookie(m, &state.cookie);
+                assert(r >= 0);
+
+                while (!state.timed_out) {
+                        r = sd_event_run(event, (uint64_t)-1);
+                        assert(r >= 0);
+                }
+
+                assert(state.call);
+        }
+
+        /* reply late, followed by a signal to detect the reply arriving */
+        {
+                r = sd_bus_reply_method_return(state.call, NULL);
+                assert(r >= 0);
+
+                state.call = sd_bus_message_unref(state.call);
+
+                r = sd_bus_message_new_signal(server, &signal, "/", "com.example.Test", "Sync");
+                assert(r >= 0);
+
+                r = sd_bus_message_set_destination(signal, unique_client);
+                assert(r >= 0);
+
+                r = sd_bus_send(server, signal, NULL);
+                assert(r >= 0);
+
+                while (!state.synced) {
+                        r = sd_event_run(event, (uint64_t)-1);
+                        assert(r >= 0);
+                }
+        }
+
+        util_broker_terminate(broker);
+}
+
+typedef struct TestThrottle TestThrottle;
+
+struct TestThrottle {
+        size_t n_received;
+        bool stalled;
+        bool done;
+};
+
+#define TEST_THROTTLE_N_SIGNALS (256)
+
+static int test_throttle_server_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        TestThrottle *state = userdata;
+
+        if (sd_bus_message_is_signal(m, "com.example.Test", "Spam"))
+                ++state->n_received;
+
+        return 0;
+}
+
+static int test_throttle_stall_fn(sd_event_source *source, uint64_t usec, void *userdata) {
+        TestThrottle *state = userdata;
+
+        state->stalled = true;
+        return 0;
+}
+
+static int test_throttle_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        TestThrottle *state = userdata;
+
+        assert(!sd_bus_message_is_method_error(m, NULL));
+
+        state->done = true;
+        return 0;
+}
+
+static void test_throttle_spam(sd_bus *client, const char *destination, TestThrottle *state) {
+        char payload[4096];
+        size_t i;
+        int r;
+
+        memset(payload, 'x', sizeof(payload) - 1);
+        payload[sizeof(payload) - 1] = 0;
+
+        /* send more than the socket buffers can hold, followed by a call */
+        for (i = 0; i < TEST_THROTTLE_N_SIGNALS; ++i) {
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                r = sd_bus_message_new_signal(client, &m, "/", "com.example.Test", "Spam");
+                assert(r >= 0);
+
+                r = sd_bus_message_set_destination(m, destination);
+                assert(r >= 0);
+
+                r = sd_bus_message_append(m, "s", payload);
+                assert(r >= 0);
+
+                r = sd_bus_send(client, m, NULL);
+                assert(r >= 0);
+        }
+
+        r = sd_bus_call_method_async(client,
+                                     NULL,
+                                     "org.freedesktop.DBus",
+                                     "/org/freedesktop/DBus",
+                                     "org.freedesktop.DBus",
+                                     "GetId",
+                                     test_throttle_fn,
+                                     state,
+                                     NULL);
+        assert(r >= 0);
+}
+
+static void test_throttle_stall(sd_event *event, TestThrottle *state) {
+        uint64_t now;
+        int r;
+
+        r = sd_event_now(event, CLOCK_MONOTONIC, &now);
+        assert(r >= 0);
+
+        r = sd_event_add_time(event, NULL, CLOCK_MONOTONIC, now + 100 * 1000, 0, test_throttle_stall_fn, state);
+        assert(r >= 0);
+
+        while (!state->stalled) {
+                r = sd_event_run(event, (uint64_t)-1);
+                assert(r >= 0);
+        }
+}
+
+static void test_throttle_release(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *server = NULL, *client = NULL;
+        const char *unique_server = NULL;
+        TestThrottle state = {};
+        int r;
+
+        /*
+         * Spam a peer that does not read for a while. The sender is throttled
+         * meanwhile, so even its call to the driver is stalled. Once the
+         * receiver drains its queue, the sender is released, and nothing
+         * must have been lost.
+         */
+
+        util_broker_new(&broker);
+        broker->throttle_queue = 64 * 1024;
+        util_broker_spawn(broker);
+
+        r = sd_event_new(&event);
+        assert(!r);
+
+        util_broker_connect(broker, &server);
+        util_broker_connect(broker, &client);
+
+        r = sd_bus_get_unique_name(server, &unique_server);
+        assert(!r);
+
+        r = sd_bus_add_filter(server, NULL, test_throttle_server_fn, &state);
+        assert(r >= 0);
+
+        r = sd_bus_attach_event(client, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(!r);
+
+        test_throttle_spam(client, unique_server, &state);
+        test_throttle_stall(event, &state);
+
+        /* dbus-daemon buffers everything instead */
+        if (!getenv("DBUS_BROKER_TEST_DAEMON"))
+                assert(!state.done);
+
+        r = sd_bus_attach_event(server, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(!r);
+
+        while (!state.done || state.n_received < TEST_THROTTLE_N_SIGNALS) {
+                r = sd_event_run(event, (uint64_t)-1);
+                assert(r >= 0);
+        }
+
+        assert(state.n_received == TEST_THROTTLE_N_SIGNALS);
+
+        util_broker_terminate(broker);
+}
+
+static void test_throttle_timeout(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *server = NULL, *client = NULL;
+        _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        const char *unique_server = NULL;
+        TestThrottle state = {};
+        int r;
+
+        /*
+         * Spam a peer that never reads. It is disconnected once the throttle
+         * timeout elapsed, which releases the sender again.
+         */
+
+        util_broker_new(&broker);
+        broker->throttle_queue = 64 * 1024;
+        broker->throttle_timeout = 100;
+        util_broker_spawn(broker);
+
+        r = sd_event_new(&event);
+        assert(!r);
+
+        util_broker_connect(broker, &server);
+        util_broker_connect(broker, &client);
+
+        r = sd_bus_get_unique_name(server, &unique_server);
+        assert(!r);
+
+        r = sd_bus_attach_event(client, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(!r);
+
+        test_throttle_spam(client, unique_server, &state);
+
+        while (!state.done) {
+                r = sd_event_run(event, (uint64_t)-1);
+                assert(r >= 0);
+        }
+
+        r = sd_bus_call_method(client,
+                               unique_server,
+                               "/org/freedesktop/DBus",
+                               "org.freedesktop.DBus.Peer",
+                               "Ping",
+                               &error,
+                               NULL,
+                               NULL);
+        assert(r < 0);
+        assert(sd_bus_error_has_name(&error, "org.freedesktop.DBus.Error.NameHasNoOwner"));
+
+        util_broker_terminate(broker);
+}
+
 int main(int argc, char **argv) {
         test_dummy();
         test_connect();
         test_self_ping();
         test_ping_pong();
+        test_destination();
+        test_reply_timeout();
+        test_throttle_release();
+
+        /* dbus-daemon has no throttle timeout */
+        if (!getenv("DBUS_BROKER_TEST_DAEMON"))
+                test_throttle_timeout();
 
         return 0;
 }
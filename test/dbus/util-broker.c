@@ -4,6 +4,7 @@
 
 #include <c-macro.h>
 #include <c-syscall.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -119,10 +120,16 @@ static int util_append_policy(sd_bus_message *m) {
         return 0;
 }
 
-void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, pid_t *pidp) {
+void util_fork_broker(sd_bus **busp,
+                      sd_event *event,
+                      int listener_fd,
+                      uint64_t reply_timeout,
+                      uint64_t throttle_queue,
+                      uint64_t throttle_timeout,
+                      pid_t *pidp) {
         _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
         _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *message = NULL;
-        _c_cleanup_(c_freep) char *fdstr = NULL;
+        _c_cleanup_(c_freep) char *fdstr = NULL, *timeoutstr = NULL, *queuestr = NULL, *throttlestr = NULL;
         int r, pair[2];
         pid_t pid;
 
@@ -147,10 +154,22 @@ void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, pid_t *pi
                 r = asprintf(&fdstr, "%d", pair[1]);
                 assert(r >= 0);
 
+                r = asprintf(&timeoutstr, "%" PRIu64, reply_timeout);
+                assert(r >= 0);
+
+                r = asprintf(&queuestr, "%" PRIu64, throttle_queue);
+                assert(r >= 0);
+
+                r = asprintf(&throttlestr, "%" PRIu64, throttle_timeout);
+                assert(r >= 0);
+
                 r = execl("./src/dbus-broker",
                           "./src/dbus-broker",
                           "--verbose",
                           "--controller", fdstr,
+                          "--reply-timeout", timeoutstr,
+                          "--throttle-queue", queuestr,
+                          "--throttle-timeout", throttlestr,
                           (char *)NULL);
                 /* execl(2) only returns on error */
                 assert(r >= 0);
@@ -198,7 +217,7 @@ void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, pid_t *pi
         bus = NULL;
 }
 
-void util_fork_daemon(sd_event *event, int pipe_fd, pid_t *pidp) {
+void util_fork_daemon(sd_event *event, int pipe_fd, uint64_t reply_timeout, pid_t *pidp) {
         static const char *config =
                 "<!DOCTYPE busconfig PUBLIC "
                 "\"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\" "
@@ -212,8 +231,9 @@ void util_fork_daemon(sd_event *event, int pipe_fd, pid_t *pidp) {
                 "    <allow receive_sender=\"*\" eavesdrop=\"true\"/>\n"
                 "    <allow own=\"*\"/>\n"
                 "  </policy>\n"
+                "  %s\n"
                 "</busconfig>\n";
-        _c_cleanup_(c_freep) char *fdstr = NULL, *path = NULL;
+        _c_cleanup_(c_freep) char *fdstr = NULL, *path = NULL, *limit = NULL, *content = NULL;
         const char *bin;
         ssize_t n;
         int r, fd;
@@ -233,11 +253,20 @@ void util_fork_daemon(sd_event *event, int pipe_fd, pid_t *pidp) {
                 r = fcntl(pipe_fd, F_SETFD, r & ~FD_CLOEXEC);
                 assert(r >= 0);
 
+                /* dbus-daemon(1) never times out replies, unless limited */
+                if (reply_timeout) {
+                        r = asprintf(&limit, "<limit name=\"reply_timeout\">%" PRIu64 "</limit>", reply_timeout);
+                        assert(r >= 0);
+                }
+
+                r = asprintf(&content, config, limit ?: "");
+                assert(r >= 0);
+
                 /* write config into memfd (don't set MFD_CLOEXEC) */
                 fd = c_syscall_memfd_create("dbus-daemon-config-file", 0);
                 assert(fd >= 0);
-                n = write(fd, config, strlen(config));
-                assert(n == (ssize_t)strlen(config));
+                n = write(fd, content, strlen(content));
+                assert(n == (ssize_t)strlen(content));
 
                 /* prepare argv parameters */
                 r = asprintf(&path, "--config-file=/proc/self/fd/%d", fd);
@@ -303,10 +332,16 @@ static void *util_broker_thread(void *userdata) {
         util_event_new(&event);
 
         if (broker->listener_fd >= 0) {
-                util_fork_broker(&bus, event, broker->listener_fd, &broker->pid);
+                util_fork_broker(&bus,
+                                 event,
+                                 broker->listener_fd,
+                                 broker->reply_timeout,
+                                 broker->throttle_queue,
+                                 broker->throttle_timeout,
+                                 &broker->pid);
         } else {
                 assert(broker->listener_fd < 0);
-                util_fork_daemon(event, broker->pipe_fds[1], &broker->pid);
+                util_fork_daemon(event, broker->pipe_fds[1], broker->reply_timeout, &broker->pid);
         }
 
         broker->pipe_fds[1] = c_close(broker->pipe_fds[1]);
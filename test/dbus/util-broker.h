@@ -22,6 +22,9 @@ struct Broker {
         int listener_fd;
         int pipe_fds[2];
         pid_t pid;
+        uint64_t reply_timeout; /* in milliseconds, 0 to disable */
+        uint64_t throttle_queue; /* in bytes, 0 to disable, broker only */
+        uint64_t throttle_timeout; /* in milliseconds, 0 to disable, broker only */
 };
 
 #define BROKER_NULL {                                                           \
@@ -35,8 +38,14 @@ struct Broker {
 /* misc */
 
 void util_event_new(sd_event **eventp);
-void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, pid_t *pidp);
-void util_fork_daemon(sd_event *event, int pipe_fd, pid_t *pidp);
+void util_fork_broker(sd_bus **busp,
+                      sd_event *event,
+                      int listener_fd,
+                      uint64_t reply_timeout,
+                      uint64_t throttle_queue,
+                      uint64_t throttle_timeout,
+                      pid_t *pidp);
+void util_fork_daemon(sd_event *event, int pipe_fd, uint64_t reply_timeout, pid_t *pidp);
 
 /* broker */
 